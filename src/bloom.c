@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2024-2024, yanruibinghxu@gmail.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "bloom.h"
+#include "zmalloc.h"
+
+#define BLOOM_WORDS     8       /* 64 bit words per block, one cache line */
+#define BLOOM_KEYBITS   12      /* Bits per key, about 1% false positives */
+
+/* Odd multipliers spreading the low half of the hash over the 8 words */
+static const uint32_t salt[BLOOM_WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+bloom *bloom_create(size_t capacity) {
+    bloom *b = zmalloc(sizeof(*b));
+    size_t bytes;
+
+    if (b == NULL) return NULL;
+    if (capacity == 0) capacity = 1;
+    b->nblocks = (capacity * BLOOM_KEYBITS + 511) / 512;
+    b->capacity = capacity;
+    b->count = 0;
+    b->mapped = 0;
+    bytes = b->nblocks * BLOOM_WORDS * sizeof(uint64_t);
+    if (posix_memalign((void **)&b->blocks, 64, bytes) != 0) {
+        zfree(b);
+        return NULL;
+    }
+    memset(b->blocks, 0, bytes);
+    return b;
+}
+
+bloom *bloom_map(int fd, off_t offset, uint64_t nblocks, size_t capacity, size_t count) {
+    bloom *b;
+    size_t bytes = nblocks * BLOOM_WORDS * sizeof(uint64_t);
+    void *p;
+
+    if (nblocks == 0) return NULL;
+    p = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, offset);
+    if (p == MAP_FAILED) return NULL;
+    b = zmalloc(sizeof(*b));
+    if (b == NULL) {
+        munmap(p, bytes);
+        return NULL;
+    }
+    b->blocks = p;
+    b->nblocks = nblocks;
+    b->capacity = capacity;
+    b->count = count;
+    b->mapped = bytes;
+    return b;
+}
+
+void bloom_free(bloom *b) {
+    if (b == NULL) return;
+    if (b->mapped)
+        munmap(b->blocks, b->mapped);
+    else
+        free(b->blocks);
+    zfree(b);
+}
+
+void bloom_clear(bloom *b) {
+    memset(b->blocks, 0, b->nblocks * BLOOM_WORDS * sizeof(uint64_t));
+    b->count = 0;
+}
+
+/* The high half of the hash picks the block, the low half the bits */
+static inline uint64_t *bloom_block(const bloom *b, uint64_t hash) {
+    uint64_t i = ((hash >> 32) * b->nblocks) >> 32;
+    return b->blocks + i * BLOOM_WORDS;
+}
+
+void bloom_add(bloom *b, uint64_t hash) {
+    uint64_t *blk = bloom_block(b, hash);
+    uint32_t h = (uint32_t)hash;
+
+    for (int i = 0; i < BLOOM_WORDS; i++)
+        __atomic_fetch_or(&blk[i], 1ULL << ((h * salt[i]) >> 26), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&b->count, 1, __ATOMIC_RELAXED);
+}
+
+int bloom_maybe(const bloom *b, uint64_t hash) {
+    const uint64_t *blk = bloom_block(b, hash);
+    uint32_t h = (uint32_t)hash;
+
+    for (int i = 0; i < BLOOM_WORDS; i++) {
+        uint64_t w = __atomic_load_n(&blk[i], __ATOMIC_RELAXED);
+        if (!(w & (1ULL << ((h * salt[i]) >> 26)))) return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2024-2024, yanruibinghxu@gmail.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __KX_BLOOM_H__
+#define __KX_BLOOM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Blocked Bloom filter. Every key sets 8 bits in a single 64 byte block,
+ * one per 64 bit word, so a lookup costs one cache line whatever the
+ * size of the filter. Keys are added with atomic ORs and never removed,
+ * lookups may run concurrently with bloom_add() without locking. */
+#define BLOOM_BLOCKSIZE 64  /* Bytes per block */
+
+typedef struct bloom {
+    uint64_t *blocks;      /* nblocks * 8 words, cache line aligned */
+    uint64_t nblocks;
+    size_t capacity;       /* Keys it was sized for */
+    size_t count;          /* Keys added, duplicates included */
+    size_t mapped;         /* Length of the mapping holding blocks, 0 when
+                            * they were allocated */
+} bloom;
+
+/** @brief Create an empty filter sized for about 1% false positives
+ * @param capacity number of keys expected
+ * @return Returns the filter, NULL when out of memory */
+bloom *bloom_create(size_t capacity);
+
+/** @brief Map the blocks of a saved filter. The mapping is private, pages
+ *         are read in on first use and keys added later stay in memory.
+ * @param fd file holding the blocks
+ * @param offset where they start, a multiple of the page size
+ * @param nblocks number of 64 byte blocks
+ * @param capacity keys the saved filter was sized for
+ * @param count keys it held
+ * @return Returns the filter, NULL on failure */
+bloom *bloom_map(int fd, off_t offset, uint64_t nblocks, size_t capacity, size_t count);
+
+/** @brief Free a filter created by bloom_create() or bloom_map() */
+void bloom_free(bloom *b);
+
+/** @brief Remove every key, not safe against concurrent lookups */
+void bloom_clear(bloom *b);
+
+/** @brief Add a key by its 64 bit hash */
+void bloom_add(bloom *b, uint64_t hash);
+
+/** @brief Look a key up by its 64 bit hash
+ * @return Returns 0 when the key was never added, 1 when it may have been */
+int bloom_maybe(const bloom *b, uint64_t hash);
+
+#endif
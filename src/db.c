@@ -29,69 +29,58 @@
 #include "db.h"
 #include "zmalloc.h"
 #include "file.h"
-#include "util.h"
 
-#define KXDEFAULTSIZE  (10 * 1024 * 1024) // 10M
-
-#define MDB_CHECK(call)                             \
-    do {                                            \
-        int ret = call;                             \
-        if (ret != MDB_SUCCESS) {                   \
-            fprintf(stderr, "LMDB error: %s\n",     \
-                    mdb_strerror(ret));             \
-            return;                                 \
-        }                                           \
-    } while (0)
-
-static void insert_file(kxdb *db, const char *ky, kxfile *file);
-static void get_file(kxdb *db, void *key, kxfile **outfile);
-static void get_file_list(kxdb *db);
-
-kxdb *kx_creat_db(uint64_t size, const char *dbpath, const char *dbname) {
-    int rc;
-    struct stat st;
-
-    kxdb *db = zmalloc(sizeof(*db));
-    if (db == NULL) return NULL;
-
-    db->max_mapsize = size;
-    strncpy(db->dbpath, dbpath, sizeof(db->dbpath)-1);
-    db->dbpath[sizeof(db->dbpath)] = '\0';
-    strncpy(db->dbname, dbname, sizeof(db->dbname)-1);
-    db->dbname[sizeof(db->dbname)] = '\0';
-    /* Open LMDB environment */
-    rc = mdb_env_create(&db->env);
-    if (rc) {
-		fprintf(stderr, "mdb_env_create failed, error %d %s\n", rc, mdb_strerror(rc));
-		goto err;
-	}
-
-    rc = mdb_env_set_mapsize(db->env, size <= 0 ? KXDEFAULTSIZE : size);
-    if (rc) {
-		fprintf(stderr, "mdb_env_set_mapsize failed, error %d %s\n", rc, mdb_strerror(rc));
-		goto err;
-	}
-    mdb_env_set_maxdbs(db->env, 4);
-
-    /* Check if the directory exists and create it if it does not exist */
-    if (stat(dbpath, &st) < 0) {
-        kx_mkdirp(dbpath, 0777);
+/* Catalog record encoding. A record is a version byte followed by tagged
+ * fields, each one a tag byte, a varint length and the payload, so new
+ * fields can be added without breaking older readers. The uuid is the
+ * key and is not repeated. Records written before the encoding existed
+ * are a raw kxfile and are recognised by their size. */
+typedef struct kxfilev0 {
+    char fname[NAME_MAX];
+    char fullname[PATH_MAX];
+    uint64_t uuid;
+    kxfiletype type;
+} kxfilev0;
+
+#define KXREC_VERSION   1
+#define KXREC_VERSION2  2       /* Has a KXREC_DIRID, older readers must skip it */
+#define KXREC_PAD       0       /* Ignored, keeps a record off the legacy size */
+#define KXREC_TYPE      1       /* varint kxfiletype */
+#define KXREC_FULLNAME  2       /* bytes, no terminator */
+#define KXREC_FNAMEOFF  3       /* varint, fname is fullname + offset */
+#define KXREC_FNAME     4       /* bytes, when fname is not a suffix of fullname */
+#define KXREC_OWNER     5       /* bytes */
+#define KXREC_CTIME     6       /* varint seconds since the epoch */
+#define KXREC_DIRID     7       /* varint, fullname continues this interned directory */
+#define KXREC_EXPIRES   8       /* varint seconds since the epoch */
+
+/* Backends by KX_DB_BACKEND_* */
+static const kxdbtype *backends[] = {
+    &kxdb_lmdb,
+    &kxdb_mem,
+};
+
+static void get_file_list(kxdb *db, list **outlist);
+
+kxdb *kx_creat_db(uint64_t size, const char *dbpath, const char *dbname,
+                  const kxdboptions *opts) {
+    int backend = opts ? opts->backend : KX_DB_BACKEND_LMDB;
+    const kxdbtype *type;
+    kxdb *db;
+
+    if (backend < 0 || backend >= (int)(sizeof(backends)/sizeof(backends[0]))) {
+        fprintf(stderr, "Unknown catalog backend %d\n", backend);
+        return NULL;
     }
-
-    rc = mdb_env_open(db->env, dbpath, 0, 0664);
-    if (rc) {
-        fprintf(stderr, "mdb_env_open failed, error %d %s\n", rc, mdb_strerror(rc));
-		goto err;
-	}
-
+    type = backends[backend];
+    db = type->open(size, dbpath, dbname, opts);
+    if (db == NULL) return NULL;
+    db->type = type;
     return db;
-err:
-    return NULL;
 }
 
 void kx_free_db(kxdb *db) {
-    mdb_env_close(db->env);
-    zfree(db);
+    db->type->close(db);
 }
 
 int kx_store_db(kxdb *db, int type, void *key, void *data) {
@@ -99,8 +88,14 @@ int kx_store_db(kxdb *db, int type, void *key, void *data) {
 
     switch (type) {
     case KX_DB_INSERT_FILE:
-        insert_file(db, (const char*)key, (kxfile*)data);
-        ret = 0;
+        /* Records are keyed by their uuid, key is not used */
+        ret = db->type->put_file(db, (kxfile*)data);
+        break;
+    case KX_DB_INSERT_DIGESTS:
+        ret = db->type->put_digests(db, *(uint64_t*)key, (kxtree*)data);
+        break;
+    case KX_DB_INSERT_FINGERPRINT:
+        ret = db->type->put_fingerprint(db, (const kxfpkey*)key, *(uint64_t*)data);
         break;
     default:
         break;
@@ -114,13 +109,21 @@ int kx_get_db(kxdb *db, int type, void *key, void **outdata) {
 
     switch (type) {
     case KX_DB_GET_FILE:
-        get_file(db, key, (kxfile**)outdata);
-        ret = 0;
+        ret = db->type->get_file(db, *(uint64_t*)key, (kxfile**)outdata);
         break;
     case KX_DB_GET_FILELIST:
-        get_file_list(db);
+        get_file_list(db, (list**)outdata);
         ret = 0;
         break;
+    case KX_DB_GET_DIGESTS:
+        ret = db->type->get_digests(db, *(uint64_t*)key, (kxtree**)outdata);
+        break;
+    case KX_DB_GET_FINGERPRINT:
+        ret = db->type->get_fingerprint(db, (const kxfpkey*)key, (uint64_t*)outdata);
+        break;
+    case KX_DB_QUERY_FILES:
+        ret = db->type->query(db, (const kxdbquery*)key, (list**)outdata);
+        break;
     default:
         break;
     }
@@ -128,92 +131,332 @@ int kx_get_db(kxdb *db, int type, void *key, void **outdata) {
     return ret;
 }
 
-static void insert_file(kxdb *db, const char *ky, kxfile *file) {
-    MDB_dbi dbi; 
-    MDB_txn *txn = NULL;
-    MDB_val key, data;
+static int print_file(const kxfileview *v, void *privdata) {
+    (void)privdata;
+    printf(" [*] %-10.*s%-30.*s%20lu [L+]\n", (int)v->fnamelen, v->fname,
+            (int)v->fullnamelen, v->fullname, v->uuid);
+    return 0;
+}
 
-    // Start a new transaction
-    mdb_txn_begin(db->env, NULL, 0, &txn);
-    mdb_dbi_open(txn, db->dbname, MDB_CREATE, &dbi);
+static int collect_file(const kxfileview *v, void *privdata) {
+    kxfile *kf = zmalloc(sizeof(*kf));
 
-    // Serialize the Person struct and set it as the data
-    key.mv_size = strlen(ky);
-    key.mv_data = &file->uuid;
+    if (kf == NULL) return 1;
+    kx_db_view_copy(v, kf);
+    listAddNodeTail((list *)privdata, kf);
+    return 0;
+}
 
-    data.mv_size = sizeof(kxfile);
-    data.mv_data = (void *)file;
+/* Print every catalog record, or when outlist is not NULL return them
+ * as a list of kxfile copies owned by the caller. */
+static void get_file_list(kxdb *db, list **outlist) {
+    kxdbiter it;
+    list *files;
 
-    // Insert the serialized data into LMDB
-    MDB_CHECK(mdb_put(txn, dbi, &key, &data, 0));
-    // Commit the transaction
-    MDB_CHECK(mdb_txn_commit(txn));
+    memset(&it, 0, sizeof(it));
+    if (outlist == NULL) {
+        kx_db_foreach(db, &it, print_file, NULL);
+        return;
+    }
+
+    *outlist = NULL;
+    files = listCreate();
+    if (files == NULL) return;
+    listSetFreeMethod(files, (void (*)(void*))kx_free_file);
+    kx_db_foreach(db, &it, collect_file, files);
+    *outlist = files;
 }
 
-static void get_file(kxdb *db, void *key, kxfile **outfile) {
-    MDB_txn *txn = NULL;
-    MDB_cursor *cursor;
-    MDB_val mdb_key, mdb_data;
+kxdbbatch *kx_db_batch_begin(kxdb *db) {
+    return db->type->batch_begin(db);
+}
 
-    MDB_CHECK(mdb_txn_begin(db->env, NULL, MDB_RDONLY, &txn));
-    MDB_CHECK(mdb_dbi_open(txn, db->dbname, 0, &db->dbi));
-    MDB_CHECK(mdb_cursor_open(txn, db->dbi, &cursor));
+int kx_db_batch_put(kxdbbatch *batch, kxfile *file) {
+    return batch->db->type->batch_put(batch, file);
+}
+
+int kx_db_batch_commit(kxdbbatch *batch) {
+    return batch->db->type->batch_commit(batch);
+}
+
+void kx_db_batch_abort(kxdbbatch *batch) {
+    batch->db->type->batch_abort(batch);
+}
 
-    // Set the cursor position to the specified key
-    mdb_key.mv_data = (void *)key;
-    mdb_key.mv_size = sizeof(uint64_t);
+/* Backends without group commit write every record on its own anyway */
+int kx_db_group_commit_start(kxdb *db, size_t records, uint32_t delay) {
+    if (db->type->group_commit_start == NULL) return 0;
+    return db->type->group_commit_start(db, records, delay);
+}
 
-    MDB_CHECK(mdb_cursor_get(cursor, &mdb_key, &mdb_data, MDB_SET));
+void kx_db_group_commit_stop(kxdb *db) {
+    if (db->type->group_commit_stop)
+        db->type->group_commit_stop(db);
+}
 
-    // Check if the key exists
-    if (mdb_cursor_get(cursor, &mdb_key, &mdb_data, MDB_GET_CURRENT) == MDB_SUCCESS) {
-        // Key exists, print the data
-        *outfile = (kxfile *)mdb_data.mv_data;
-    } else {
-        *outfile = NULL;
-        printf("Key not found: %lu\n", *(uint64_t*)key);
+int kx_db_set_user(kxdb *db, const char *user) {
+    if (user && strlen(user) >= sizeof(db->user)) {
+        fprintf(stderr, "User name too long for the catalog: %s\n", user);
+        return -1;
     }
+    return db->type->set_user(db, user);
+}
 
-    // Close the cursor and transaction
-    mdb_cursor_close(cursor);
-    mdb_txn_abort(txn);
+static int unsupported(kxdb *db, const char *what) {
+    fprintf(stderr, "The %s catalog backend does not support %s\n",
+            db->type->name, what);
+    return -1;
 }
 
-static void get_file_list(kxdb *db) {
-    MDB_txn *txn = NULL;
-    MDB_cursor *cursor;
-    MDB_val mdb_key, mdb_data;
-    int rc;
+int kx_db_backup(kxdb *db, int fd, kxdbbackup *st) {
+    if (db->type->backup == NULL) return unsupported(db, "backups");
+    return db->type->backup(db, fd, st);
+}
 
-    rc = mdb_txn_begin(db->env, NULL, MDB_RDONLY, &txn);
-    if (rc != MDB_SUCCESS) {
-        fprintf(stderr, "Error: Failed to begin LMDB transaction (%s)\n", mdb_strerror(rc));
-        return;
+int kx_db_stat(kxdb *db, kxdbstat *st) {
+    if (db->type->stat == NULL) return unsupported(db, "statistics");
+    return db->type->stat(db, st);
+}
+
+int kx_db_readers(kxdb *db, kxdbreaderfn *func, void *ctx) {
+    if (db->type->readers == NULL) return unsupported(db, "reader tables");
+    return db->type->readers(db, func, ctx);
+}
+
+int kx_db_import(kxdb *db, kxdbsource *next, void *privdata, int replace,
+                 kxdbimport *st) {
+    if (db->type->import == NULL) return unsupported(db, "bulk loads");
+    return db->type->import(db, next, privdata, replace, st);
+}
+
+int kx_db_expire(kxdb *db, uint64_t uuid, uint64_t when) {
+    if (db->type->expire == NULL) return unsupported(db, "expiry");
+    return db->type->expire(db, uuid, when);
+}
+
+int kx_db_prune(kxdb *db, uint64_t now, kxdbprune *st) {
+    if (db->type->prune == NULL) return unsupported(db, "pruning");
+    return db->type->prune(db, now ? now : (uint64_t)time(NULL), st);
+}
+
+int kx_db_file_known(kxdb *db, uint64_t uuid, const char *path) {
+    return db->type->file_known(db, uuid, path);
+}
+
+long kx_db_foreach(kxdb *db, kxdbiter *it, kxdbiterfn *fn, void *privdata) {
+    return db->type->foreach(db, it, fn, privdata);
+}
+
+/* Raw records were a kxfile image, with or without the tree pointer */
+static int is_legacy(size_t len) {
+    return len == sizeof(kxfilev0) || len == sizeof(kxfilev0) + sizeof(void*);
+}
+
+static unsigned char *put_varint(unsigned char *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
     }
+    *p++ = (unsigned char)v;
+    return p;
+}
 
-    // Open the default database
-    rc = mdb_dbi_open(txn, db->dbname, 0, &db->dbi);
-    if (rc != MDB_SUCCESS) {
-        fprintf(stderr, "Error: Failed to open LMDB database (%s)\n", mdb_strerror(rc));
-        mdb_txn_abort(txn);
-        return;
+/* Returns NULL on a truncated or overlong varint */
+static const unsigned char *get_varint(const unsigned char *p,
+                                       const unsigned char *end, uint64_t *v) {
+    int shift;
+
+    *v = 0;
+    for (shift = 0; p < end && shift < 64; shift += 7) {
+        *v |= (uint64_t)(*p & 0x7f) << shift;
+        if ((*p++ & 0x80) == 0)
+            return p;
     }
+    return NULL;
+}
 
-    // Open a cursor
-    rc = mdb_cursor_open(txn, db->dbi, &cursor);
-    if (rc != MDB_SUCCESS) {
-        fprintf(stderr, "Error: Failed to open LMDB cursor (%s)\n", mdb_strerror(rc));
-        mdb_txn_abort(txn);
-        return;
+static unsigned char *put_field(unsigned char *p, int tag, const void *data, size_t len) {
+    *p++ = (unsigned char)tag;
+    p = put_varint(p, len);
+    memcpy(p, data, len);
+    return p + len;
+}
+
+/* Encode a catalog record into buf, which holds at least KX_DB_RECMAX
+ * bytes. With a dirid only the path after its first dirlen bytes is
+ * kept. Returns the encoded length. */
+size_t kx_db_encode_file(const kxfile *file, uint64_t dirid, size_t dirlen,
+                         unsigned char *buf) {
+    unsigned char *p = buf;
+    unsigned char num[10];
+    size_t flen = strnlen(file->fullname, sizeof(file->fullname));
+    size_t nlen = strnlen(file->fname, sizeof(file->fname));
+    const char *name = file->fullname;
+
+    if (dirid == 0 || dirlen > flen)
+        dirid = dirlen = 0;
+    name += dirlen;
+    flen -= dirlen;
+
+    *p++ = dirid ? KXREC_VERSION2 : KXREC_VERSION;
+    p = put_field(p, KXREC_TYPE, num, put_varint(num, file->type) - num);
+    if (dirid)
+        p = put_field(p, KXREC_DIRID, num, put_varint(num, dirid) - num);
+    p = put_field(p, KXREC_FULLNAME, name, flen);
+
+    /* fname is normally the last component of fullname, share it */
+    if (nlen <= flen && memcmp(name + flen - nlen, file->fname, nlen) == 0)
+        p = put_field(p, KXREC_FNAMEOFF, num, put_varint(num, flen - nlen) - num);
+    else
+        p = put_field(p, KXREC_FNAME, file->fname, nlen);
+
+    if (file->owner[0])
+        p = put_field(p, KXREC_OWNER, file->owner, strnlen(file->owner, sizeof(file->owner)));
+    if (file->ctime)
+        p = put_field(p, KXREC_CTIME, num, put_varint(num, file->ctime) - num);
+    if (file->expires)
+        p = put_field(p, KXREC_EXPIRES, num, put_varint(num, file->expires) - num);
+
+    while (is_legacy(p - buf))
+        p = put_field(p, KXREC_PAD, "", 0);
+    return p - buf;
+}
+
+/* Parse a catalog record in place, the view points into data. Accepts
+ * both the tagged encoding and legacy raw kxfile values, unknown tags
+ * are skipped. A view with a dirid holds the path after the directory,
+ * the backend puts the directory back in front. */
+int kx_db_view_file(const void *key, size_t klen, const void *data, size_t len,
+                    kxfileview *view) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    uint64_t tag, flen, v, fnameoff = UINT64_MAX;
+
+    memset(view, 0, sizeof(*view));
+    if (is_legacy(len)) {
+        const kxfilev0 *old = data;
+
+        memcpy(&view->uuid, &old->uuid, sizeof(view->uuid));
+        memcpy(&view->type, &old->type, sizeof(view->type));
+        view->fname = old->fname;
+        view->fnamelen = strnlen(old->fname, sizeof(old->fname)-1);
+        view->fullname = old->fullname;
+        view->fullnamelen = strnlen(old->fullname, sizeof(old->fullname)-1);
+        view->owner = "";
+        return 0;
     }
+    if (klen != sizeof(view->uuid) || p == end ||
+        (*p != KXREC_VERSION && *p != KXREC_VERSION2))
+        return -1;
+    p++;
+    memcpy(&view->uuid, key, sizeof(view->uuid));
+    view->fname = view->fullname = view->owner = "";
+
+    while (p < end) {
+        tag = *p++;
+        if ((p = get_varint(p, end, &flen)) == NULL || flen > (uint64_t)(end - p))
+            return -1;
+        switch (tag) {
+        case KXREC_TYPE:
+            if (get_varint(p, p + flen, &v) == NULL) return -1;
+            view->type = (kxfiletype)v;
+            break;
+        case KXREC_FULLNAME:
+            if (flen >= PATH_MAX) return -1;
+            view->fullname = (const char *)p;
+            view->fullnamelen = flen;
+            break;
+        case KXREC_FNAMEOFF:
+            if (get_varint(p, p + flen, &fnameoff) == NULL) return -1;
+            break;
+        case KXREC_FNAME:
+            if (flen >= NAME_MAX) return -1;
+            view->fname = (const char *)p;
+            view->fnamelen = flen;
+            break;
+        case KXREC_OWNER:
+            if (flen >= sizeof(((kxfile*)0)->owner)) return -1;
+            view->owner = (const char *)p;
+            view->ownerlen = flen;
+            break;
+        case KXREC_CTIME:
+            if (get_varint(p, p + flen, &view->ctime) == NULL) return -1;
+            break;
+        case KXREC_DIRID:
+            if (get_varint(p, p + flen, &view->dirid) == NULL) return -1;
+            break;
+        case KXREC_EXPIRES:
+            if (get_varint(p, p + flen, &view->expires) == NULL) return -1;
+            break;
+        default:
+            break;
+        }
+        p += flen;
+    }
+
+    if (fnameoff != UINT64_MAX) {
+        if (fnameoff > view->fullnamelen || view->fullnamelen - fnameoff >= NAME_MAX)
+            return -1;
+        view->fname = view->fullname + fnameoff;
+        view->fnamelen = view->fullnamelen - fnameoff;
+    }
+    return 0;
+}
+
+/* Copy a view out of the backend into a kxfile */
+void kx_db_view_copy(const kxfileview *view, kxfile *file) {
+    memset(file, 0, sizeof(*file));
+    file->uuid = view->uuid;
+    file->type = view->type;
+    file->ctime = view->ctime;
+    file->expires = view->expires;
+    memcpy(file->fname, view->fname, view->fnamelen);
+    memcpy(file->fullname, view->fullname, view->fullnamelen);
+    memcpy(file->owner, view->owner, view->ownerlen);
+}
 
-    // Iterate through all data
-    while (mdb_cursor_get(cursor, &mdb_key, &mdb_data, MDB_NEXT) == MDB_SUCCESS) {
-        char *key = (char *)mdb_key.mv_data;
-        kxfile *kf = (kxfile *)mdb_data.mv_data;
-        printf(" [*] %-10s%-30s%20lu [L+]\n", kf->fname, kf->fullname, kf->uuid);
+int kx_db_decode_file(const void *key, size_t klen, const void *data, size_t len,
+                      kxfile *file) {
+    kxfileview view;
+
+    if (kx_db_view_file(key, klen, data, len, &view) == -1 || view.dirid)
+        return -1;
+    kx_db_view_copy(&view, file);
+    return 0;
+}
+
+/* Tokens are the hex encoded key of the first record not yet visited,
+ * behind 'u' for uuid order or 'p' for path order. */
+void kx_db_token_encode(char *token, char kind, const void *key, size_t klen) {
+    const unsigned char *p = key;
+    size_t i;
+
+    *token++ = kind;
+    for (i = 0; i < klen && i < (KX_DB_TOKEN_LEN - 2) / 2; i++)
+        token += sprintf(token, "%02x", p[i]);
+    *token = '\0';
+}
+
+int kx_db_token_decode(const char *token, char kind, unsigned char *buf, size_t *klen) {
+    size_t i, len;
+    unsigned int byte;
+
+    if (token[0] != kind) return -1;
+    token++;
+    len = strlen(token);
+    if (len % 2 || len / 2 > KX_DB_TOKEN_LEN / 2) return -1;
+    for (i = 0; i < len / 2; i++) {
+        if (sscanf(token + i * 2, "%2x", &byte) != 1) return -1;
+        buf[i] = (unsigned char)byte;
     }
-    // Close the cursor and transaction
-    mdb_cursor_close(cursor);
-    mdb_txn_abort(txn);
-}
\ No newline at end of file
+    *klen = len / 2;
+    return 0;
+}
+
+int kx_db_match_query(const kxdbquery *q, const kxfile *kf) {
+    if (q->path && strcmp(q->path, kf->fullname) != 0) return 0;
+    if (q->owner && strcmp(q->owner, kf->owner) != 0) return 0;
+    if (q->since && kf->ctime < q->since) return 0;
+    if (q->until && kf->ctime > q->until) return 0;
+    return 1;
+}
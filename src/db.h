@@ -30,28 +30,229 @@
 #define __KX_DB_H__
 
 #include "rkxconfig.h"
+#include "adlist.h"
 
 #define KX_DB_INSERT_FILE   1
 #define KX_DB_GET_FILE      2
 #define KX_DB_GET_FILELIST  3
+#define KX_DB_INSERT_DIGESTS 4  /* key: uint64_t uuid, data: kxtree */
+#define KX_DB_GET_DIGESTS   5   /* key: uint64_t uuid, outdata: kxtree copy */
+#define KX_DB_INSERT_FINGERPRINT 6  /* key: kxfpkey, data: uint64_t uuid */
+#define KX_DB_GET_FINGERPRINT 7     /* key: kxfpkey, outdata: uint64_t uuid */
+#define KX_DB_QUERY_FILES   8   /* key: kxdbquery, outdata: list of kxfile */
 
+struct kxfile;
+struct kxtree;
+struct kxfpkey;
+
+/* Durability profiles, see kxdboptions */
+#define KX_DB_SYNC_FULL     0       /* fsync data and meta on every commit */
+#define KX_DB_SYNC_META     1       /* MDB_NOMETASYNC, a crash may undo the last commit */
+#define KX_DB_SYNC_ASYNC    2       /* MDB_NOSYNC|MDB_WRITEMAP|MDB_MAPASYNC, synced
+                                     * every syncms by the background thread */
+#define KX_DB_SYNC_INTERVAL 1000    /* Default ms between syncs of KX_DB_SYNC_ASYNC */
+
+#define KX_DB_READER_CHECK  30000   /* ms between sweeps of stale reader slots */
+
+/* Expiry defaults, see kx_db_prune() */
+#define KX_DB_PRUNE_INTERVAL 60000  /* ms between background prunes */
+#define KX_DB_PRUNE_TXN     1000    /* Entries deleted per write transaction */
+#define KX_DB_FPCACHE_TTL   (30 * 24 * 3600) /* Seconds a fingerprint is cached */
+#define KX_DB_RETENTION     (7 * 24 * 3600)  /* Seconds the record of a decrypted
+                                              * or deleted file is kept */
+
+/* Group commit defaults, see kx_db_group_commit_start() */
+#define KX_DB_GC_RECORDS    64      /* Commit once this many records wait */
+#define KX_DB_GC_DELAY      2       /* or once the oldest waited this many ms */
+
+/* Storage backends, see kxdboptions */
+#define KX_DB_BACKEND_LMDB  0       /* LMDB environment under dbpath, the default */
+#define KX_DB_BACKEND_MEM   1       /* Process memory only, gone on exit */
+
+/* A catalog. Backends embed it at the start of their own state and get
+ * it back in every call of their kxdbtype. */
 typedef struct kxdb {
-    uint64_t max_mapsize; /* Set the size of the memory map to use for this environment. */
-    MDB_env *env;
-    MDB_dbi dbi;
+    const struct kxdbtype *type; /* Backend serving the catalog */
     char dbname[32];       /* The name of the database to open. */
+    char user[32];         /* Current user, owns new records and scopes walks */
     char dbpath[128];      /* db file path */
 } kxdb;
 
-/** @brief Create a db object and currently use the lmdb 
- *         library to provide data persistence services.
- * @param[in] size Set the size of the memory map to use for this environment.
+/* Write transaction under construction, every record put into it is
+ * written at once by kx_db_batch_commit(). Backends embed it at the
+ * start of their own batch. */
+typedef struct kxdbbatch {
+    kxdb *db;
+} kxdbbatch;
+
+/* Filters of KX_DB_QUERY_FILES, unset fields match every record. The
+ * most selective index available answers the query. */
+typedef struct kxdbquery {
+    const char *path;      /* Exact full path */
+    const char *owner;     /* Files encrypted by this user */
+    uint64_t since;        /* Encrypted at or after, 0 for no bound */
+    uint64_t until;        /* Encrypted at or before, 0 for no bound */
+} kxdbquery;
+
+/* Read only view of a catalog record. Strings point into the backend's
+ * storage, are not NUL terminated and are only valid inside the callback. */
+typedef struct kxfileview {
+    uint64_t uuid;
+    int type;              /* kxfiletype */
+    uint64_t ctime;
+    uint64_t expires;      /* 0 when the record never expires */
+    const char *fullname;
+    size_t fullnamelen;
+    const char *fname;
+    size_t fnamelen;
+    const char *owner;
+    size_t ownerlen;
+    uint64_t dirid;        /* Interned directory fullname continues, 0 when
+                            * fullname is whole. Backends resolve it. */
+} kxfileview;
+
+#define KX_DB_TOKEN_LEN     1040    /* Room for a hex encoded path key */
+
+/* Walk of kx_db_foreach(). Records come in uuid order, or in path order
+ * when a prefix is set. */
+typedef struct kxdbiter {
+    const char *prefix;    /* Only paths starting with prefix */
+    const char *token;     /* Resume where a previous walk stopped, NULL to start */
+    size_t limit;          /* Stop after this many records, 0 for no limit */
+    int everyone;          /* Records of every user, not only the current one */
+    char next[KX_DB_TOKEN_LEN]; /* Out, token of the next page, "" at the end */
+} kxdbiter;
+
+/* Return non zero to stop the walk */
+typedef int kxdbiterfn(const kxfileview *view, void *privdata);
+
+/* Outcome of kx_db_backup() */
+typedef struct kxdbbackup {
+    uint64_t bytes;        /* Written to the target */
+    uint64_t srcbytes;     /* Pages in use by the live catalog */
+    long long ms;          /* Time the copy took */
+} kxdbbackup;
+
+#define KX_DB_STAT_DBS  11  /* Databases of kxdbstat, the freelist included */
+
+/* B-tree statistics of one database */
+typedef struct kxdbtree {
+    const char *name;
+    unsigned int depth;
+    uint64_t branchpages;
+    uint64_t leafpages;
+    uint64_t overflowpages;
+    uint64_t entries;
+} kxdbtree;
+
+/* Snapshot of the environment and every database, see kx_db_stat() */
+typedef struct kxdbstat {
+    uint64_t mapsize;      /* Bytes mapped */
+    uint64_t lastpage;     /* Last page in use */
+    uint64_t lasttxn;      /* Id of the last committed transaction */
+    unsigned int readers;  /* Reader slots in use */
+    unsigned int maxreaders;
+    unsigned int psize;    /* Page size */
+    uint64_t freepages;    /* Pages in the freelist, reusable by writers */
+    size_t bloomkeys;      /* Keys in the Bloom filter */
+    size_t bloomcapacity;  /* Keys it was sized for */
+    int bloomfresh;        /* The filter reflects the last commit */
+    int ndbs;
+    kxdbtree dbs[KX_DB_STAT_DBS];
+} kxdbstat;
+
+/* Called with each line of the reader table, see kx_db_readers() */
+typedef int kxdbreaderfn(const char *line, void *ctx);
+
+/* Record source of kx_db_import(). Fills kf and returns 1, returns 0
+ * at the end of the input and -1 on error. */
+typedef int kxdbsource(struct kxfile *kf, void *privdata);
+
+/* Outcome of kx_db_import() */
+typedef struct kxdbimport {
+    uint64_t records;      /* Read from the source */
+    uint64_t loaded;       /* Written to the catalog */
+    uint64_t duplicates;   /* Repeated uuids, the last record of each was kept */
+    int appended;          /* Loaded with MDB_APPEND, not merged */
+    long long ms;          /* Time the import took */
+} kxdbimport;
+
+/* Outcome of kx_db_prune() */
+typedef struct kxdbprune {
+    uint64_t files;        /* Expired file records deleted, with their digests */
+    uint64_t fingerprints; /* Expired fingerprint cache entries deleted */
+    uint64_t txns;         /* Write transactions it took */
+    long long ms;          /* Time the prune took */
+} kxdbprune;
+
+typedef struct kxdboptions {
+    size_t gcrecords;      /* Group commit batch size, 0 disables group commit */
+    uint32_t gcdelay;      /* Group commit delay in ms */
+    int durability;        /* KX_DB_SYNC_*, KX_DB_SYNC_FULL by default */
+    uint32_t syncms;       /* KX_DB_SYNC_ASYNC sync period in ms, 0 selects
+                            * KX_DB_SYNC_INTERVAL */
+    int backend;           /* KX_DB_BACKEND_*, KX_DB_BACKEND_LMDB by default */
+    uint32_t fpttl;        /* Seconds fingerprints stay cached, 0 selects
+                            * KX_DB_FPCACHE_TTL */
+    uint32_t prunems;      /* Background prune period in ms, 0 selects
+                            * KX_DB_PRUNE_INTERVAL */
+} kxdboptions;
+
+/* Storage backend. The public kx_db_* and kx_store_db()/kx_get_db()
+ * calls check their arguments and forward to these methods. The last
+ * ones are optional, the calls fail (or do nothing, for group commit)
+ * on backends that leave them NULL. */
+typedef struct kxdbtype {
+    const char *name;
+    kxdb *(*open)(uint64_t size, const char *dbpath, const char *dbname,
+                  const kxdboptions *opts);
+    void (*close)(kxdb *db);
+    int (*put_file)(kxdb *db, struct kxfile *file);
+    int (*get_file)(kxdb *db, uint64_t uuid, struct kxfile **outfile);
+    int (*query)(kxdb *db, const kxdbquery *q, list **outlist);
+    long (*foreach)(kxdb *db, kxdbiter *it, kxdbiterfn *fn, void *privdata);
+    int (*file_known)(kxdb *db, uint64_t uuid, const char *path);
+    int (*put_digests)(kxdb *db, uint64_t uuid, struct kxtree *tree);
+    int (*get_digests)(kxdb *db, uint64_t uuid, struct kxtree **outtree);
+    int (*put_fingerprint)(kxdb *db, const struct kxfpkey *fp, uint64_t uuid);
+    int (*get_fingerprint)(kxdb *db, const struct kxfpkey *fp, uint64_t *uuid);
+    kxdbbatch *(*batch_begin)(kxdb *db);
+    int (*batch_put)(kxdbbatch *batch, struct kxfile *file);
+    int (*batch_commit)(kxdbbatch *batch);
+    void (*batch_abort)(kxdbbatch *batch);
+    int (*set_user)(kxdb *db, const char *user);
+    int (*group_commit_start)(kxdb *db, size_t records, uint32_t delay);
+    void (*group_commit_stop)(kxdb *db);
+    int (*import)(kxdb *db, kxdbsource *next, void *privdata, int replace,
+                  kxdbimport *st);
+    int (*backup)(kxdb *db, int fd, kxdbbackup *st);
+    int (*stat)(kxdb *db, kxdbstat *st);
+    int (*readers)(kxdb *db, kxdbreaderfn *func, void *ctx);
+    int (*prune)(kxdb *db, uint64_t now, kxdbprune *st);
+    int (*expire)(kxdb *db, uint64_t uuid, uint64_t when);
+} kxdbtype;
+
+extern const kxdbtype kxdb_lmdb;
+extern const kxdbtype kxdb_mem;
+
+/** @brief Create a db object. The lmdb library provides data
+ *         persistence unless opts selects another backend.
+ * @param[in] size Initial size of the memory map, it is doubled whenever it
+ *            fills up (up to 1 TB) and the failed write is replayed.
  * @param[in] dbpath db storage path
- * @param[in] dbname The name of the database to open.
+ * @param[in] dbname The name of the integer keyed database holding the file
+ *            records of every user. Older per user databases ("<user>" and
+ *            "<user>.files") are migrated into it on open.
+ * @param[in] opts backend and durability profile, NULL for an LMDB
+ *            catalog with KX_DB_SYNC_FULL
+ * @note Several processes may open the same catalog at once, the 
+ *       environment uses MDB_NOTLS and a background thread reaps the
+ *       reader slots of processes that died. 
  * @note The size should be a multiple of the OS page size. The default is
  *       10485760 bytes. Bytes as unit
  * @return return kxdb pointer, Returns NULL if failed */
-kxdb *kx_creat_db(uint64_t size, const char *dbpath, const char *dbname);
+kxdb *kx_creat_db(uint64_t size, const char *dbpath, const char *dbname,
+                  const kxdboptions *opts);
 
 /** @brief free kxdb object
  *         This function is usually called at the end of the program 
@@ -67,6 +268,7 @@ void kx_free_db(kxdb *db);
 int kx_store_db(kxdb *db, int type, void *key, void *data);
 
 /** @brief Get db storage data, if key = NULL traverse all data, outdata = NULL.
+ *         Returned records are copies owned by the caller.
  * @param[in] db kxdb object pointer 
  * @param[in] type store type @ref define
  * @param[in] key store key 
@@ -74,4 +276,190 @@ int kx_store_db(kxdb *db, int type, void *key, void *data);
  * @return Returns 0 on success, -1 otherwise */
 int kx_get_db(kxdb *db, int type, void *key, void **outdata);
 
+/** @brief Start a write batch
+ * @param[in] db kxdb object pointer
+ * @return return batch, NULL on failure */
+kxdbbatch *kx_db_batch_begin(kxdb *db);
+
+/** @brief Add a file record (and its chunk digests if any) to a batch,
+ *         the record is copied
+ * @param[in] batch write batch
+ * @param[in] file file record
+ * @return Returns 0 on success, -1 otherwise */
+int kx_db_batch_put(kxdbbatch *batch, struct kxfile *file);
+
+/** @brief Write every record of the batch in one transaction and release it
+ * @param[in] batch write batch
+ * @return Returns 0 on success, -1 otherwise */
+int kx_db_batch_commit(kxdbbatch *batch);
+
+/** @brief Release a batch without writing it
+ * @param[in] batch write batch */
+void kx_db_batch_abort(kxdbbatch *batch);
+
+/** @brief Coalesce KX_DB_INSERT_FILE stores from concurrent threads.
+ *         A background thread commits pending records once records are
+ *         waiting or the oldest one waited delay ms, whichever comes
+ *         first. Writers still block until their record is durable,
+ *         so records should not exceed the number of concurrent writers
+ *         or every commit waits for the full delay.
+ * @param[in] db kxdb object pointer
+ * @param[in] records batch size, 0 selects KX_DB_GC_RECORDS
+ * @param[in] delay maximum delay in ms, 0 selects KX_DB_GC_DELAY
+ * @return Returns 0 on success, -1 otherwise */
+int kx_db_group_commit_start(kxdb *db, size_t records, uint32_t delay);
+
+/** @brief Stop group commit, pending records are committed first
+ * @param[in] db kxdb object pointer */
+void kx_db_group_commit_stop(kxdb *db);
+
+/** @brief Select the user the catalog works for. New records without an
+ *         owner are given to this user, walks and queries only see its 
+ *         files. Every user shares the one environment.
+ * @param[in] db kxdb object pointer
+ * @param[in] user user name, NULL to see every user's files
+ * @return Returns 0 on success, -1 otherwise */
+int kx_db_set_user(kxdb *db, const char *user);
+
+/** @brief Write a compacted copy of the live catalog to fd. The copy is
+ *         made by mdb_env_copyfd2(MDB_CP_COMPACT) from a read snapshot on
+ *         its own thread, so writers keep committing meanwhile. The map
+ *         cannot be grown during the copy: it is grown beforehand to hold
+ *         twice the data in use, and a writer that still fills it waits
+ *         for the copy, or a slow pipe consumer, to finish.
+ * @note LMDB backend only
+ * @param[in] db kxdb object pointer
+ * @param[in] fd target file or pipe, not closed
+ * @param[out] st bytes written and time taken, may be NULL
+ * @return Returns 0 on success, -1 otherwise */
+int kx_db_backup(kxdb *db, int fd, kxdbbackup *st);
+
+/** @brief Collect the statistics of mdb_stat -a -e -f from one read
+ *         snapshot, for every database of the catalog
+ * @note LMDB backend only
+ * @param[in] db kxdb object pointer
+ * @param[out] st statistics
+ * @return Returns 0 on success, -1 otherwise */
+int kx_db_stat(kxdb *db, kxdbstat *st);
+
+/** @brief Dump the reader lock table, as mdb_stat -r does
+ * @note LMDB backend only
+ * @param[in] db kxdb object pointer
+ * @param[in] func called with each line
+ * @param[in] ctx passed to func
+ * @return Returns 0 on success, -1 otherwise */
+int kx_db_readers(kxdb *db, kxdbreaderfn *func, void *ctx);
+
+/** @brief Bulk load records. They are sorted externally by uuid, in
+ *         runs spilled next to the catalog, and written in large
+ *         transactions. An empty catalog is loaded with MDB_APPEND, and
+ *         its indexes are then appended from sorts of their own. A
+ *         catalog that already has records gets them merged in order.
+ * @param[in] db kxdb object pointer
+ * @param[in] next record source
+ * @param[in] privdata passed to next
+ * @param[in] replace drop every file record and index first
+ * @param[out] st counters and time taken, may be NULL
+ * @return Returns 0 on success, -1 otherwise */
+int kx_db_import(kxdb *db, kxdbsource *next, void *privdata, int replace,
+                 kxdbimport *st);
+
+/** @brief Cheap negative check before a catalog lookup. Answers from
+ *         an in-memory Bloom filter, without a transaction, while no
+ *         other process has written the catalog since it was last built.
+ * @param[in] db kxdb object pointer
+ * @param[in] uuid file uuid, 0 to check the path only
+ * @param[in] path full path, NULL to check the uuid only
+ * @return Returns 0 when no such file is in the catalog, 1 when it may be */
+int kx_db_file_known(kxdb *db, uint64_t uuid, const char *path);
+
+/** @brief Give a file record an expiry time. A record that already
+ *         expires sooner keeps its time, so repeated calls do not
+ *         postpone the prune. The record is read and rewritten in one
+ *         write transaction of the backend.
+ * @param[in] db kxdb object pointer
+ * @param[in] uuid file uuid
+ * @param[in] when seconds since the epoch
+ * @return Returns 0 on success, -1 otherwise or when there is no such record */
+int kx_db_expire(kxdb *db, uint64_t uuid, uint64_t when);
+
+/** @brief Delete expired file records (with their indexes and chunk
+ *         digests) and expired fingerprint cache entries. Deletes are
+ *         spread over write transactions of at most KX_DB_PRUNE_TXN
+ *         entries, so writers never queue behind a long one. The
+ *         background thread runs this every KX_DB_PRUNE_INTERVAL.
+ * @note LMDB backend only
+ * @param[in] db kxdb object pointer
+ * @param[in] now seconds since the epoch, 0 for the current time
+ * @param[out] st counters and time taken, may be NULL
+ * @return Returns 0 on success, -1 otherwise */
+int kx_db_prune(kxdb *db, uint64_t now, kxdbprune *st);
+
+/** @brief Stream catalog records to a callback without decoding them
+ * @note Records are read in batches, fn runs between read transactions
+ *       and may write to the catalog. Records written meanwhile may or
+ *       may not be visited.
+ * @param[in] db kxdb object pointer
+ * @param[in,out] it where to start and stop, receives the next page token
+ * @param[in] fn called once per record
+ * @param[in] privdata passed to fn
+ * @return Returns the number of records visited, -1 on error */
+long kx_db_foreach(kxdb *db, kxdbiter *it, kxdbiterfn *fn, void *privdata);
+
+/* Helpers shared by the backends. Every backend stores file records in
+ * the same tagged encoding, so their records and page tokens agree. */
+
+#define KX_DB_RECMAX (sizeof(struct kxfile) + 64) /* Largest encoded record */
+
+/** @brief Encode a catalog record
+ * @param[in] file file record
+ * @param[in] dirid id of an interned directory the path starts with, 0
+ *            to keep the whole path in the record
+ * @param[in] dirlen length of that directory
+ * @param[out] buf holds at least KX_DB_RECMAX bytes
+ * @return Returns the encoded length */
+size_t kx_db_encode_file(const struct kxfile *file, uint64_t dirid, size_t dirlen,
+                         unsigned char *buf);
+
+/** @brief Parse an encoded record in place, the view points into data.
+ *         Legacy raw kxfile records are accepted as well.
+ * @param[in] key the uuid the record is stored under
+ * @param[in] klen length of key
+ * @param[in] data encoded record
+ * @param[in] len length of data
+ * @param[out] view record fields
+ * @return Returns 0 on success, -1 on a corrupt record */
+int kx_db_view_file(const void *key, size_t klen, const void *data, size_t len,
+                    kxfileview *view);
+
+/** @brief Copy a record view into a kxfile
+ * @param[in] view record view
+ * @param[out] file file record */
+void kx_db_view_copy(const kxfileview *view, struct kxfile *file);
+
+/** @brief Decode an encoded record into a kxfile
+ * @return Returns 0 on success, -1 on a corrupt record or one whose
+ *         directory is interned */
+int kx_db_decode_file(const void *key, size_t klen, const void *data, size_t len,
+                      struct kxfile *file);
+
+/** @brief Hex encode the key a walk resumes at into a page token
+ * @param[out] token holds KX_DB_TOKEN_LEN bytes
+ * @param[in] kind 'u' for uuid order, 'p' for path order
+ * @param[in] key first key not yet visited
+ * @param[in] klen length of key */
+void kx_db_token_encode(char *token, char kind, const void *key, size_t klen);
+
+/** @brief Decode a page token of kx_db_token_encode()
+ * @param[in] token page token
+ * @param[in] kind order the walk expects
+ * @param[out] buf holds KX_DB_TOKEN_LEN / 2 bytes, the decoded key
+ * @param[out] klen length of the key
+ * @return Returns 0 on success, -1 on a malformed token */
+int kx_db_token_decode(const char *token, char kind, unsigned char *buf, size_t *klen);
+
+/** @brief Check a record against every filter of a query
+ * @return Returns 1 when it matches, 0 otherwise */
+int kx_db_match_query(const kxdbquery *q, const struct kxfile *kf);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,3113 @@
+/*
+ * Copyright (c) 2024-2024, yanruibinghxu@gmail.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "db.h"
+#include "zmalloc.h"
+#include "file.h"
+#include "util.h"
+#include "xxhash.h"
+#include "bloom.h"
+
+#define KXDEFAULTSIZE  (10 * 1024 * 1024) // 10M
+#define KXMAXDBS       16                 /* Named databases in one environment */
+#define KXMAXREADERS   512                /* Reader slots shared by every process */
+#define KXMAPLIMIT     (1ULL << 40)       /* The map stops growing at 1 TB */
+#define KXMAPWAIT      5000               /* ms a resize waits for active transactions */
+#define KXSORTMEM      (64 * 1024 * 1024) /* Bytes sorted in memory before a run is spilled */
+#define KXIMPORTTXN    100000             /* Puts per bulk load transaction */
+#define KXBLOOMMIN     65536              /* Fewest keys a filter is sized for */
+#define KXBLOOMUUID    0x75               /* Hash seeds, uuid and path keys */
+#define KXBLOOMPATH    0x70               /* share one filter */
+#define KXBLOOMSNAP    "bloom.snap"       /* Filter saved at close, next to data.mdb */
+#define KXBLOOMEVERY   300000             /* Fewest ms between rebuilds after other processes wrote */
+#define KXBLOOMMAGIC   "RKXBLM01"
+#define KXSNAPALIGN    65536              /* Saved blocks start on a page boundary */
+#define KXCHUNKSDB     "chunks"           /* uuid -> tree hash chunk digests */
+#define KXFPCACHEDB    "fpcache"          /* kxfpkey -> uuid fingerprint cache */
+#define KXLEGACYFILES  ".files"           /* Suffix of the old per user record databases */
+#define KXPATHSDB      "paths"            /* Full path -> uuid */
+#define KXUSERSDB      "users"            /* Owner -> uuids */
+#define KXTIMESDB      "times"            /* Encryption time -> uuids */
+#define KXDIRSDB       "dirs"             /* Directory id -> interned directory */
+#define KXDIRIDSDB     "dirids"           /* Interned directory -> id */
+#define KXEXPIRYDB     "expiry"           /* Expiry time -> uuids */
+#define KXFPEXPIRYDB   "fpexpiry"         /* Expiry time -> kxfpkeys */
+#define KXPATHINLINE   256                /* Longer paths intern their directory */
+#define KXPATHKEYMAX   511                /* LMDB default max key size */
+#define KXWALKPAGE     256                /* Records a walk reads per read transaction */
+
+#define MDB_CHECK(call)                             \
+    do {                                            \
+        int ret = call;                             \
+        if (ret != MDB_SUCCESS) {                   \
+            fprintf(stderr, "LMDB error: %s\n",     \
+                    mdb_strerror(ret));             \
+            return;                                 \
+        }                                           \
+    } while (0)
+
+/* Catalog kept in an LMDB environment, the default backend */
+typedef struct kxlmdb {
+    kxdb base;             /* Must be first */
+    uint64_t max_mapsize; /* Current size of the memory map, grows when it fills up */
+    MDB_env *env;
+    MDB_dbi dbi;           /* File records, opened once by open_env() */
+    MDB_dbi chunks;        /* Tree hash chunk digests */
+    MDB_dbi fpcache;       /* Fingerprint cache */
+    MDB_dbi paths;         /* Index, full path -> uuid */
+    MDB_dbi users;         /* Index, owner -> uuids (DUPSORT|DUPFIXED) */
+    MDB_dbi times;         /* Index, encryption time -> uuids (DUPSORT|DUPFIXED) */
+    MDB_dbi dirs;          /* Path dictionary, id -> directory (INTEGERKEY) */
+    MDB_dbi dirids;        /* Path dictionary, directory -> id */
+    MDB_dbi expiry;        /* Index, expiry time -> uuids (DUPSORT|DUPFIXED) */
+    MDB_dbi fpexpiry;      /* Index, expiry time -> kxfpkeys (DUPSORT|DUPFIXED) */
+    pthread_key_t rtxnkey; /* Per thread read transaction, reset between uses */
+    pthread_mutex_t rtxnlock;
+    list *rtxns;           /* Every per thread read transaction, for close_env() */
+    pthread_rwlock_t maplock; /* Shared by transactions, exclusive to resize the map */
+    int longreads;         /* Backups and filter scans running, they hold
+                            * maplock shared throughout */
+    pthread_t bgthread;    /* Background thread, runs group commits */
+    pthread_mutex_t bglock;
+    pthread_cond_t bgcond; /* Wakes the background thread */
+    int bgrunning;
+    int bgstop;
+    struct kxlmdbbatch *gcpending; /* Records waiting for the next group commit */
+    pthread_cond_t gcdone; /* Wakes writers once their batch is committed */
+    size_t gcrecords;      /* Commit once this many records are pending */
+    uint32_t gcdelay;      /* or once the oldest pending record waited this many ms */
+    long long gcsince;     /* When the first pending record arrived */
+    int durability;        /* KX_DB_SYNC_* */
+    uint32_t syncms;       /* Background sync period, 0 when commits sync */
+    long long lastsync;    /* When the background thread last synced */
+    long long lastcheck;   /* When stale readers were last reaped */
+    uint32_t fpttl;        /* Seconds a fingerprint stays cached */
+    uint32_t prunems;      /* Period of the background prune */
+    long long lastprune;   /* When expired entries were last pruned */
+    bloom *bloom;          /* Hashes of every uuid and path in the catalog */
+    bloom *bloomnext;      /* Filter being built, writers note into it too */
+    pthread_mutex_t bloomlock; /* One build at a time */
+    unsigned long bloomseq; /* Odd while the filter is being swapped */
+    size_t bloomtxn;       /* Last transaction the filter reflects */
+    size_t bloomcommits;   /* Write transactions this process committed */
+    int bloomreaders;      /* Lookups reading the filter */
+    long long bloombuilt;  /* When the last build ended */
+} kxlmdb;
+
+/* Write transaction under construction. Records are buffered in memory
+ * and written in a single LMDB transaction (and a single fsync) by 
+ * batch_commit(). */
+typedef struct kxlmdbbatch {
+    kxdbbatch base;        /* Must be first */
+    kxlmdb *db;
+    list *ops;             /* Pending puts */
+    size_t count;          /* Number of records in the batch */
+    int status;            /* Commit result, group commit only */
+    int done;              /* Set once committed, group commit only */
+    int waiters;           /* Writers waiting for this batch, group commit only */
+} kxlmdbbatch;
+
+/* One buffered put of a batch, key and data live right after the header */
+typedef struct kxdbop {
+    MDB_dbi dbi;
+    unsigned int flags;    /* mdb_put() flags, MDB_APPEND(DUP) for bulk loads */
+    MDB_val key;
+    MDB_val data;
+} kxdbop;
+
+/* Read transaction cached for one thread. It stays reset between lookups
+ * so it keeps its reader slot and only needs mdb_txn_renew(). */
+typedef struct kxrtxn {
+    kxlmdb *db;
+    MDB_txn *txn;
+    int active;
+} kxrtxn;
+
+/* Header of a saved filter, the blocks follow at KXSNAPALIGN. It is only
+ * loaded by an environment still at the transaction it was saved at. */
+typedef struct kxbloomsnap {
+    char magic[8];         /* KXBLOOMMAGIC */
+    uint64_t txnid;        /* Last transaction the filter reflects */
+    uint64_t dev;          /* data.mdb the filter was built from */
+    uint64_t ino;
+    uint64_t nblocks;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t check;        /* XXH3 of the fields above */
+} kxbloomsnap;
+
+/* Value of a fingerprint cache entry. Catalogs written before entries
+ * expired hold the uuid alone, those never expire. */
+typedef struct kxfpentry {
+    uint64_t uuid;
+    uint64_t expires;      /* Seconds since the epoch */
+    uint64_t scheme;       /* KXFP_SCHEME it was cached under, entries of
+                            * older versions lack it and read as 0 */
+} kxfpentry;
+
+/* Records of a walk read in one transaction. Their strings are copied
+ * out of the map so the callbacks run without holding it. */
+typedef struct kxwalkpage {
+    kxfileview views[KXWALKPAGE];
+    size_t offs[KXWALKPAGE]; /* Where the strings of each view start */
+    size_t n;
+    char *strs;
+    size_t used;
+    size_t cap;
+} kxwalkpage;
+
+static void close_env(kxlmdb *db);
+static int insert_file(kxlmdb *db, kxfile *file);
+static int group_commit_put(kxlmdb *db, kxfile *file);
+static int batch_add(kxlmdbbatch *batch, MDB_dbi dbi, unsigned int flags,
+                     const void *key, size_t klen, const void *data, size_t dlen);
+static int batch_write(kxlmdbbatch *batch);
+static void batch_free(kxlmdbbatch *batch);
+static kxlmdbbatch *batch_begin(kxlmdb *db);
+static int batch_put(kxlmdbbatch *batch, kxfile *file);
+static int batch_commit(kxlmdbbatch *batch);
+static void batch_abort(kxlmdbbatch *batch);
+static int file_known(kxlmdb *db, uint64_t uuid, const char *path);
+static void get_file(kxlmdb *db, void *key, kxfile **outfile);
+static int insert_digests(kxlmdb *db, uint64_t uuid, kxtree *tree);
+static int get_digests(kxlmdb *db, uint64_t uuid, kxtree **outtree);
+static int insert_fingerprint(kxlmdb *db, const kxfpkey *fp, uint64_t uuid);
+static int get_fingerprint(kxlmdb *db, const kxfpkey *fp, uint64_t *uuid);
+static int open_dbis(kxlmdb *db);
+static int migrate_files(kxlmdb *db, MDB_txn *txn);
+static int drop_fingerprints(kxlmdb *db, MDB_txn *txn);
+static int reindex_files(kxlmdb *db, MDB_txn *txn);
+static int put_record(kxlmdb *db, MDB_txn *txn, MDB_val *key, MDB_val *data);
+static int put_fpentry(kxlmdb *db, MDB_txn *txn, MDB_val *key, MDB_val *data);
+static int index_file(kxlmdb *db, MDB_txn *txn, const kxfile *kf, int del);
+static int prune_env(kxlmdb *db, uint64_t now, kxdbprune *st);
+static int expire_file(kxlmdb *db, uint64_t uuid, uint64_t when);
+static int intern_record(kxlmdb *db, MDB_txn *txn, const MDB_val *key, MDB_val *data,
+                         unsigned char *buf);
+static int view_record(kxlmdb *db, MDB_txn *txn, const MDB_val *key,
+                       const MDB_val *data, kxfileview *view, char *path);
+static int decode_record(kxlmdb *db, MDB_txn *txn, const MDB_val *key,
+                         const MDB_val *data, kxfile *kf);
+static int query_files(kxlmdb *db, const kxdbquery *q, list **outlist);
+static void path_key(const char *path, MDB_val *key, unsigned char *buf);
+static void path_key_len(const char *path, size_t len, MDB_val *key, unsigned char *buf);
+static int grow_map(kxlmdb *db, uint64_t seen);
+static int bg_start(kxlmdb *db);
+static void reader_check(kxlmdb *db);
+static void bg_stop(kxlmdb *db);
+static MDB_txn *rtxn_begin(kxlmdb *db);
+static void rtxn_end(kxlmdb *db, MDB_txn *txn);
+static void rtxn_destroy(void *ptr);
+static void bloom_note(kxlmdb *db, const kxfile *kf);
+static void bloom_note_record(kxlmdb *db, const MDB_val *key, const MDB_val *data);
+static void bloom_commit(kxlmdb *db, size_t txnid);
+static int bloom_build(kxlmdb *db);
+static void bloom_refresh(kxlmdb *db);
+static int bloom_full(kxlmdb *db);
+static int bloom_load(kxlmdb *db);
+static void bloom_save(kxlmdb *db);
+
+static kxlmdb *open_env(uint64_t size, const char *dbpath, const char *dbname,
+                        const kxdboptions *opts) {
+    int rc;
+    unsigned int flags = 0;
+    struct stat st;
+
+    kxlmdb *db = zmalloc(sizeof(*db));
+    if (db == NULL) return NULL;
+
+    db->max_mapsize = size;
+    strncpy(db->base.dbpath, dbpath, sizeof(db->base.dbpath)-1);
+    db->base.dbpath[sizeof(db->base.dbpath)-1] = '\0';
+    strncpy(db->base.dbname, dbname, sizeof(db->base.dbname)-1);
+    db->base.dbname[sizeof(db->base.dbname)-1] = '\0';
+    db->base.user[0] = '\0';
+    db->bgrunning = 0;
+    db->bgstop = 0;
+    db->gcpending = NULL;
+    db->gcrecords = 0;
+    db->gcdelay = 0;
+    db->gcsince = 0;
+    db->durability = opts ? opts->durability : KX_DB_SYNC_FULL;
+    db->syncms = 0;
+    db->lastsync = kx_mstime();
+    db->lastcheck = db->lastsync;
+    db->lastprune = db->lastsync;
+    db->fpttl = opts && opts->fpttl ? opts->fpttl : KX_DB_FPCACHE_TTL;
+    db->prunems = opts && opts->prunems ? opts->prunems : KX_DB_PRUNE_INTERVAL;
+    db->env = NULL;
+    db->bloom = NULL;
+    db->bloomnext = NULL;
+    pthread_mutex_init(&db->bloomlock, NULL);
+    db->bloomseq = 0;
+    db->bloomtxn = 0;
+    db->bloomcommits = 0;
+    db->bloomreaders = 0;
+    db->bloombuilt = 0;
+    db->longreads = 0;
+    db->rtxns = listCreate();
+    pthread_key_create(&db->rtxnkey, rtxn_destroy);
+    pthread_mutex_init(&db->rtxnlock, NULL);
+    pthread_rwlock_init(&db->maplock, NULL);
+    pthread_mutex_init(&db->bglock, NULL);
+    pthread_cond_init(&db->bgcond, NULL);
+    pthread_cond_init(&db->gcdone, NULL);
+    /* Open LMDB environment */
+    rc = mdb_env_create(&db->env);
+    if (rc) {
+		fprintf(stderr, "mdb_env_create failed, error %d %s\n", rc, mdb_strerror(rc));
+        db->env = NULL;
+		goto err;
+	}
+
+    db->max_mapsize = size <= 0 ? KXDEFAULTSIZE : size;
+    rc = mdb_env_set_mapsize(db->env, db->max_mapsize);
+    if (rc) {
+		fprintf(stderr, "mdb_env_set_mapsize failed, error %d %s\n", rc, mdb_strerror(rc));
+		goto err;
+	}
+    mdb_env_set_maxdbs(db->env, KXMAXDBS);
+    mdb_env_set_maxreaders(db->env, KXMAXREADERS);
+
+    /* Check if the directory exists and create it if it does not exist */
+    if (stat(dbpath, &st) < 0) {
+        kx_mkdirp(dbpath, 0777);
+    }
+
+    switch (db->durability) {
+    case KX_DB_SYNC_META:
+        flags = MDB_NOMETASYNC;
+        break;
+    case KX_DB_SYNC_ASYNC:
+        flags = MDB_NOSYNC|MDB_WRITEMAP|MDB_MAPASYNC;
+        db->syncms = opts->syncms ? opts->syncms : KX_DB_SYNC_INTERVAL;
+        break;
+    default:
+        db->durability = KX_DB_SYNC_FULL;
+        break;
+    }
+
+    /* Read transactions are cached per thread and handed back with
+     * mdb_txn_reset(), they must not be tied to thread local storage */
+    rc = mdb_env_open(db->env, dbpath, flags|MDB_NOTLS, 0664);
+    if (rc) {
+        fprintf(stderr, "mdb_env_open failed, error %d %s\n", rc, mdb_strerror(rc));
+		goto err;
+	}
+    /* An existing catalog may already be larger than the requested size */
+    {
+        MDB_envinfo info;
+        mdb_env_info(db->env, &info);
+        db->max_mapsize = info.me_mapsize;
+    }
+
+    /* A process that died left its reader slots behind */
+    reader_check(db);
+    if (open_dbis(db) == -1)
+        goto err;
+    /* Without it every lookup goes to the B-tree, nothing more. The
+     * filter saved by the last close spares the scan of every record. */
+    if (bloom_load(db) == -1)
+        bloom_build(db);
+
+    /* Reaps stale readers, and syncs commits in KX_DB_SYNC_ASYNC */
+    pthread_mutex_lock(&db->bglock);
+    rc = bg_start(db);
+    pthread_mutex_unlock(&db->bglock);
+    if (rc == -1) goto err;
+
+    return db;
+err:
+    close_env(db);
+    return NULL;
+}
+
+static void close_env(kxlmdb *db) {
+    listIter li;
+    listNode *ln;
+
+    bg_stop(db);
+    if (db->env && db->durability != KX_DB_SYNC_FULL)
+        mdb_env_sync(db->env, 1);
+    if (db->env)
+        bloom_save(db);
+
+    /* Threads may still own cached read transactions, they must be gone
+     * before the environment is closed. */
+    pthread_key_delete(db->rtxnkey);
+    listRewind(db->rtxns, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        kxrtxn *rt = listNodeValue(ln);
+        mdb_txn_abort(rt->txn);
+        zfree(rt);
+    }
+    listRelease(db->rtxns);
+    pthread_mutex_destroy(&db->rtxnlock);
+    pthread_rwlock_destroy(&db->maplock);
+
+    if (db->env) mdb_env_close(db->env);
+    bloom_free(db->bloom);
+    pthread_mutex_destroy(&db->bloomlock);
+    pthread_cond_destroy(&db->gcdone);
+    pthread_cond_destroy(&db->bgcond);
+    pthread_mutex_destroy(&db->bglock);
+    zfree(db);
+}
+
+/* Records are keyed by the native 64 bit uuid in an MDB_INTEGERKEY
+ * database shared by every user. */
+static int insert_file(kxlmdb *db, kxfile *file) {
+    kxlmdbbatch *batch;
+
+    if (db->bgrunning && db->gcrecords)
+        return group_commit_put(db, file);
+
+    batch = batch_begin(db);
+    if (batch == NULL) return -1;
+    if (batch_put(batch, file) == -1) {
+        batch_abort(batch);
+        return -1;
+    }
+    return batch_commit(batch);
+}
+
+static kxlmdbbatch *batch_begin(kxlmdb *db) {
+    kxlmdbbatch *batch = zmalloc(sizeof(*batch));
+    if (batch == NULL) return NULL;
+
+    batch->ops = listCreate();
+    if (batch->ops == NULL) {
+        zfree(batch);
+        return NULL;
+    }
+    listSetFreeMethod(batch->ops, zfree);
+    batch->base.db = &db->base;
+    batch->db = db;
+    batch->count = 0;
+    batch->status = 0;
+    batch->done = 0;
+    batch->waiters = 0;
+    return batch;
+}
+
+static int batch_put(kxlmdbbatch *batch, kxfile *file) {
+    unsigned char rec[KX_DB_RECMAX];
+    size_t len;
+    kxfile owned;
+
+    /* Records without an owner belong to the current user */
+    if (file->owner[0] == '\0' && batch->db->base.user[0]) {
+        memcpy(&owned, file, sizeof(owned));
+        strncpy(owned.owner, batch->db->base.user, sizeof(owned.owner)-1);
+        owned.owner[sizeof(owned.owner)-1] = '\0';
+        len = kx_db_encode_file(&owned, 0, 0, rec);
+    } else {
+        len = kx_db_encode_file(file, 0, 0, rec);
+    }
+
+    if (batch_add(batch, batch->db->dbi, 0, &file->uuid, sizeof(file->uuid),
+                  rec, len) == -1)
+        return -1;
+    if (file->tree && batch_add(batch, batch->db->chunks, 0, &file->uuid, sizeof(file->uuid),
+                                file->tree, KXTREE_SIZE(file->tree->nchunks)) == -1)
+        return -1;
+    batch->count++;
+    return 0;
+}
+
+static int batch_commit(kxlmdbbatch *batch) {
+    int ret = batch_write(batch);
+    batch_free(batch);
+    return ret;
+}
+
+static void batch_abort(kxlmdbbatch *batch) {
+    batch_free(batch);
+}
+
+static int batch_add(kxlmdbbatch *batch, MDB_dbi dbi, unsigned int flags,
+                     const void *key, size_t klen, const void *data, size_t dlen) {
+    kxdbop *op = zmalloc(sizeof(*op) + klen + dlen);
+    if (op == NULL) return -1;
+
+    op->dbi = dbi;
+    op->flags = flags;
+    op->key.mv_size = klen;
+    op->key.mv_data = (char *)(op + 1);
+    op->data.mv_size = dlen;
+    op->data.mv_data = (char *)(op + 1) + klen;
+    memcpy(op->key.mv_data, key, klen);
+    memcpy(op->data.mv_data, data, dlen);
+
+    if (listAddNodeTail(batch->ops, op) == NULL) {
+        zfree(op);
+        return -1;
+    }
+    return 0;
+}
+
+/* Write the batch in one transaction. When the map fills up it is grown
+ * and the whole batch replayed, which is why ops stay buffered until the
+ * commit succeeds. */
+static int batch_write(kxlmdbbatch *batch) {
+    int rc;
+    kxlmdb *db = batch->db;
+    MDB_txn *txn = NULL;
+    uint64_t mapsize;
+    size_t txnid;
+    listIter li;
+    listNode *ln;
+    MDB_val rec;
+    unsigned char buf[KX_DB_RECMAX];
+
+    if (listLength(batch->ops) == 0) return 0;
+
+again:
+    pthread_rwlock_rdlock(&db->maplock);
+    mapsize = db->max_mapsize;
+    rc = mdb_txn_begin(db->env, NULL, 0, &txn);
+    if (rc != MDB_SUCCESS) {
+        txn = NULL;
+        goto err;
+    }
+
+    listRewind(batch->ops, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        kxdbop *op = listNodeValue(ln);
+
+        /* File records carry their index entries into the same txn,
+         * bulk loads write the indexes in passes of their own */
+        if (op->dbi == db->dbi && !op->flags) {
+            rc = put_record(db, txn, &op->key, &op->data);
+        } else if (op->dbi == db->fpcache) {
+            rc = put_fpentry(db, txn, &op->key, &op->data);
+        } else {
+            rec = op->data;
+            if (op->dbi == db->dbi &&
+                (rc = intern_record(db, txn, &op->key, &rec, buf)) != MDB_SUCCESS)
+                goto err;
+            rc = mdb_put(txn, op->dbi, &op->key, &rec, op->flags);
+            /* Someone else wrote past this key meanwhile */
+            if (rc == MDB_KEYEXIST && op->flags)
+                rc = mdb_put(txn, op->dbi, &op->key, &rec, 0);
+            if (rc == MDB_SUCCESS && op->dbi == db->dbi)
+                bloom_note_record(db, &op->key, &op->data);
+        }
+        if (rc != MDB_SUCCESS) goto err;
+    }
+
+    txnid = mdb_txn_id(txn);
+    /* Counted while the writer lock is held, see bloom_build() */
+    __atomic_add_fetch(&db->bloomcommits, 1, __ATOMIC_RELEASE);
+    rc = mdb_txn_commit(txn);
+    txn = NULL;
+    if (rc != MDB_SUCCESS) {
+        __atomic_sub_fetch(&db->bloomcommits, 1, __ATOMIC_RELEASE);
+        goto err;
+    }
+    bloom_commit(db, txnid);
+    pthread_rwlock_unlock(&db->maplock);
+    return 0;
+err:
+    if (txn) mdb_txn_abort(txn);
+    pthread_rwlock_unlock(&db->maplock);
+    if (rc == MDB_MAP_FULL || rc == MDB_MAP_RESIZED) {
+        if (grow_map(db, rc == MDB_MAP_FULL ? mapsize : 0) == 0)
+            goto again;
+    }
+    fprintf(stderr, "LMDB error: %s\n", mdb_strerror(rc));
+    return -1;
+}
+
+static void batch_free(kxlmdbbatch *batch) {
+    listRelease(batch->ops);
+    zfree(batch);
+}
+
+/* Queue a record for the next group commit and wait until it is on disk.
+ * Every writer that joined the same batch shares one transaction. */
+static int group_commit_put(kxlmdb *db, kxfile *file) {
+    kxlmdbbatch *batch;
+    int ret;
+
+    pthread_mutex_lock(&db->bglock);
+    if (db->gcpending == NULL) {
+        db->gcpending = batch_begin(db);
+        if (db->gcpending == NULL) {
+            pthread_mutex_unlock(&db->bglock);
+            return -1;
+        }
+        db->gcsince = kx_mstime();
+        pthread_cond_signal(&db->bgcond);
+    }
+    batch = db->gcpending;
+
+    if (batch_put(batch, file) == -1) {
+        pthread_mutex_unlock(&db->bglock);
+        return -1;
+    }
+    if (batch->count >= db->gcrecords)
+        pthread_cond_signal(&db->bgcond);
+
+    batch->waiters++;
+    while (!batch->done)
+        pthread_cond_wait(&db->gcdone, &db->bglock);
+    ret = batch->status;
+    if (--batch->waiters == 0)
+        batch_free(batch);
+    pthread_mutex_unlock(&db->bglock);
+
+    return ret;
+}
+
+/* Commit the pending batch, called and returns with bglock held */
+static void group_commit_flush(kxlmdb *db) {
+    kxlmdbbatch *batch = db->gcpending;
+    int status;
+
+    db->gcpending = NULL;
+    pthread_mutex_unlock(&db->bglock);
+    status = batch_write(batch);
+    pthread_mutex_lock(&db->bglock);
+
+    batch->status = status == 0 ? 0 : -1;
+    batch->done = 1;
+    pthread_cond_broadcast(&db->gcdone);
+    if (batch->waiters == 0)
+        batch_free(batch);
+}
+
+/* Flush dirty map pages to disk, called and returns with bglock held */
+static void bg_sync(kxlmdb *db) {
+    int rc;
+
+    pthread_mutex_unlock(&db->bglock);
+    pthread_rwlock_rdlock(&db->maplock);
+    rc = mdb_env_sync(db->env, 1);
+    pthread_rwlock_unlock(&db->maplock);
+    if (rc != MDB_SUCCESS)
+        fprintf(stderr, "Catalog sync failed: %s\n", mdb_strerror(rc));
+    pthread_mutex_lock(&db->bglock);
+    db->lastsync = kx_mstime();
+    db->lastcheck = db->lastsync;
+}
+
+/* Copy thread of backup_env(), writes the snapshot into a pipe */
+struct backupjob {
+    MDB_env *env;
+    int fd;
+    int rc;
+};
+
+static void *backup_main(void *arg) {
+    struct backupjob *job = arg;
+
+    job->rc = mdb_env_copyfd2(job->env, job->fd, MDB_CP_COMPACT);
+    close(job->fd);
+    return NULL;
+}
+
+static int backup_env(kxlmdb *db, int fd, kxdbbackup *st) {
+    int pfd[2];
+    char buf[64 * 1024];
+    ssize_t n, w, off;
+    uint64_t bytes = 0;
+    long long start = kx_mstime();
+    struct backupjob job;
+    pthread_t tid;
+    MDB_envinfo info;
+    MDB_stat mst;
+    int ret = 0;
+
+    if (pipe(pfd) == -1) {
+        perror("Error pipe() failed");
+        return -1;
+    }
+
+    /* The map cannot move while the copy reads it, so a writer that
+     * fills it waits for the copy to end. Grow it first to leave room
+     * for as much data again as the catalog holds now. */
+    mdb_env_stat(db->env, &mst);
+    while (1) {
+        mdb_env_info(db->env, &info);
+        if ((uint64_t)(info.me_last_pgno + 1) * mst.ms_psize * 2 <= info.me_mapsize ||
+            info.me_mapsize >= KXMAPLIMIT || grow_map(db, info.me_mapsize) == -1)
+            break;
+    }
+
+    /* The snapshot is read through the map, it must not move under it */
+    pthread_rwlock_rdlock(&db->maplock);
+    __atomic_add_fetch(&db->longreads, 1, __ATOMIC_RELEASE);
+    mdb_env_info(db->env, &info);
+    mdb_env_stat(db->env, &mst);
+
+    job.env = db->env;
+    job.fd = pfd[1];
+    job.rc = MDB_SUCCESS;
+    if (pthread_create(&tid, NULL, backup_main, &job) != 0) {
+        __atomic_sub_fetch(&db->longreads, 1, __ATOMIC_RELEASE);
+        pthread_rwlock_unlock(&db->maplock);
+        close(pfd[0]);
+        close(pfd[1]);
+        fprintf(stderr, "Unable to start backup thread\n");
+        return -1;
+    }
+
+    /* Pump the copy through, counting what reaches the target */
+    while ((n = read(pfd[0], buf, sizeof(buf))) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            ret = -1;
+            break;
+        }
+        for (off = 0; off < n; off += w) {
+            w = write(fd, buf + off, n - off);
+            if (w == -1) {
+                if (errno == EINTR) {
+                    w = 0;
+                    continue;
+                }
+                perror("Error backup write failed");
+                ret = -1;
+                break;
+            }
+        }
+        if (ret == -1) break;
+        bytes += n;
+    }
+    /* Unblocks the copy thread if the target failed */
+    close(pfd[0]);
+    pthread_join(tid, NULL);
+    __atomic_sub_fetch(&db->longreads, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&db->maplock);
+
+    if (job.rc != MDB_SUCCESS && ret == 0) {
+        fprintf(stderr, "Backup failed: %s\n", mdb_strerror(job.rc));
+        ret = -1;
+    }
+    if (st) {
+        st->bytes = bytes;
+        st->srcbytes = (uint64_t)(info.me_last_pgno + 1) * mst.ms_psize;
+        st->ms = kx_mstime() - start;
+    }
+    return ret;
+}
+
+/* The statistics of mdb_stat -a -e -f, for the databases we know of */
+static int stat_env(kxlmdb *db, kxdbstat *st) {
+    int rc;
+    MDB_txn *txn;
+    MDB_cursor *cursor;
+    MDB_val key, data;
+    MDB_envinfo info;
+    MDB_stat ms;
+    bloom *b;
+    const struct { const char *name; MDB_dbi dbi; } dbs[KX_DB_STAT_DBS] = {
+        {"freelist", 0},   /* FREE_DBI */
+        {db->base.dbname, db->dbi},
+        {KXPATHSDB, db->paths},
+        {KXUSERSDB, db->users},
+        {KXTIMESDB, db->times},
+        {KXCHUNKSDB, db->chunks},
+        {KXFPCACHEDB, db->fpcache},
+        {KXDIRSDB, db->dirs},
+        {KXDIRIDSDB, db->dirids},
+        {KXEXPIRYDB, db->expiry},
+        {KXFPEXPIRYDB, db->fpexpiry},
+    };
+
+    memset(st, 0, sizeof(*st));
+    txn = rtxn_begin(db);
+    if (txn == NULL) return -1;
+
+    mdb_env_info(db->env, &info);
+    st->mapsize = info.me_mapsize;
+    st->lastpage = info.me_last_pgno;
+    st->lasttxn = info.me_last_txnid;
+    st->readers = info.me_numreaders;
+    st->maxreaders = info.me_maxreaders;
+    for (int i = 0; i < KX_DB_STAT_DBS; i++) {
+        kxdbtree *t = &st->dbs[i];
+
+        rc = mdb_stat(txn, dbs[i].dbi, &ms);
+        if (rc != MDB_SUCCESS) goto err;
+        t->name = dbs[i].name;
+        t->depth = ms.ms_depth;
+        t->branchpages = ms.ms_branch_pages;
+        t->leafpages = ms.ms_leaf_pages;
+        t->overflowpages = ms.ms_overflow_pages;
+        t->entries = ms.ms_entries;
+        st->psize = ms.ms_psize;
+        st->ndbs++;
+    }
+
+    /* Each freelist record is an IDL, its first word the page count */
+    rc = mdb_cursor_open(txn, 0, &cursor);
+    if (rc != MDB_SUCCESS) goto err;
+    while ((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == MDB_SUCCESS) {
+        mdb_size_t n;
+        memcpy(&n, data.mv_data, sizeof(n));
+        st->freepages += n;
+    }
+    mdb_cursor_close(cursor);
+    if (rc != MDB_NOTFOUND) goto err;
+    rtxn_end(db, txn);
+
+    __atomic_add_fetch(&db->bloomreaders, 1, __ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&db->bloom, __ATOMIC_SEQ_CST);
+    if (b) {
+        st->bloomkeys = __atomic_load_n(&b->count, __ATOMIC_RELAXED);
+        st->bloomcapacity = b->capacity;
+        st->bloomfresh = !(__atomic_load_n(&db->bloomseq, __ATOMIC_ACQUIRE) & 1) &&
+                         __atomic_load_n(&db->bloomtxn, __ATOMIC_ACQUIRE) ==
+                         st->lasttxn;
+    }
+    __atomic_sub_fetch(&db->bloomreaders, 1, __ATOMIC_RELEASE);
+    return 0;
+err:
+    rtxn_end(db, txn);
+    fprintf(stderr, "LMDB error: %s\n", mdb_strerror(rc));
+    return -1;
+}
+
+static int list_readers(kxlmdb *db, kxdbreaderfn *func, void *ctx) {
+    int rc;
+
+    pthread_rwlock_rdlock(&db->maplock);
+    rc = mdb_reader_list(db->env, func, ctx);
+    pthread_rwlock_unlock(&db->maplock);
+    return rc < 0 ? -1 : 0;
+}
+
+/* External sort of (key, data) pairs for import_files(). Pairs are
+ * buffered and sorted in memory; once the buffer is full it is spilled
+ * as a sorted run to an unlinked file next to the catalog, and the runs
+ * are merged back at the end. Order is the one LMDB uses for the target
+ * database, integer or memcmp keys, then integer dups. Pairs that still
+ * compare equal come out newest first, so the last record of a repeated
+ * uuid is the one kept, as with the memory backend. The paths sort leaves
+ * the dups out, a repeated path comes out with its last input first. */
+typedef struct kxsortent {
+    MDB_val key;
+    MDB_val data;
+    uint64_t seq;          /* Input order */
+} kxsortent;
+
+typedef struct kxsortrun {
+    FILE *fp;
+    kxsortent cur;
+    unsigned char *buf;
+    size_t bufsize;
+} kxsortrun;
+
+typedef struct kxsorter {
+    kxlmdb *db;
+    int (*cmp)(const void *, const void *); /* Order of the pairs */
+    unsigned char *arena;
+    size_t used;
+    size_t limit;
+    kxsortent *ents;
+    size_t n;
+    size_t cap;
+    size_t pos;            /* Next entry when nothing was spilled */
+    kxsortrun *runs;
+    int nruns;
+    int last;              /* Run the previous pair came from */
+} kxsorter;
+
+static int cmp_u64(const MDB_val *a, const MDB_val *b) {
+    uint64_t x, y;
+
+    memcpy(&x, a->mv_data, sizeof(x));
+    memcpy(&y, b->mv_data, sizeof(y));
+    return x < y ? -1 : x > y;
+}
+
+/* mdb_cmp_memn() */
+static int cmp_memn(const MDB_val *a, const MDB_val *b) {
+    size_t len = a->mv_size < b->mv_size ? a->mv_size : b->mv_size;
+    int c = memcmp(a->mv_data, b->mv_data, len);
+
+    if (c) return c;
+    return a->mv_size < b->mv_size ? -1 : a->mv_size > b->mv_size;
+}
+
+static int cmp_dup(const kxsortent *a, const kxsortent *b) {
+    int c = 0;
+
+    if (a->data.mv_size == sizeof(uint64_t) && b->data.mv_size == sizeof(uint64_t))
+        c = cmp_u64(&a->data, &b->data);
+    if (c) return c;
+    return a->seq > b->seq ? -1 : a->seq < b->seq;
+}
+
+static int cmp_intent(const void *x, const void *y) {
+    const kxsortent *a = x, *b = y;
+    int c = cmp_u64(&a->key, &b->key);
+    return c ? c : cmp_dup(a, b);
+}
+
+static int cmp_memnent(const void *x, const void *y) {
+    const kxsortent *a = x, *b = y;
+    int c = cmp_memn(&a->key, &b->key);
+    return c ? c : cmp_dup(a, b);
+}
+
+static int cmp_memnseq(const void *x, const void *y) {
+    const kxsortent *a = x, *b = y;
+    int c = cmp_memn(&a->key, &b->key);
+    return c ? c : (a->seq > b->seq ? -1 : a->seq < b->seq);
+}
+
+static kxsorter *sorter_create(kxlmdb *db, int (*cmp)(const void *, const void *),
+                               size_t limit) {
+    kxsorter *s = zmalloc(sizeof(*s));
+
+    if (s == NULL) return NULL;
+    memset(s, 0, sizeof(*s));
+    s->db = db;
+    s->cmp = cmp;
+    s->limit = limit;
+    s->last = -1;
+    s->arena = zmalloc(limit);
+    if (s->arena == NULL) {
+        zfree(s);
+        return NULL;
+    }
+    return s;
+}
+
+static void sorter_free(kxsorter *s) {
+    if (s == NULL) return;
+    for (int i = 0; i < s->nruns; i++) {
+        fclose(s->runs[i].fp);
+        if (s->runs[i].buf) zfree(s->runs[i].buf);
+    }
+    if (s->runs) zfree(s->runs);
+    if (s->ents) zfree(s->ents);
+    if (s->arena) zfree(s->arena);
+    zfree(s);
+}
+
+static void sorter_sort(kxsorter *s) {
+    qsort(s->ents, s->n, sizeof(kxsortent), s->cmp);
+}
+
+/* Write the buffered pairs out as one sorted run and empty the buffer */
+static int sorter_spill(kxsorter *s) {
+    char tmpl[sizeof(s->db->base.dbpath) + 16];
+    kxsortrun *runs;
+    FILE *fp;
+    int fd;
+
+    snprintf(tmpl, sizeof(tmpl), "%s/sort.XXXXXX", s->db->base.dbpath);
+    fd = mkstemp(tmpl);
+    if (fd == -1) {
+        fprintf(stderr, "Error creating %s: %s\n", tmpl, strerror(errno));
+        return -1;
+    }
+    unlink(tmpl);
+    fp = fdopen(fd, "w+");
+    if (fp == NULL) {
+        close(fd);
+        return -1;
+    }
+    runs = zrealloc(s->runs, (s->nruns + 1) * sizeof(*runs));
+    if (runs == NULL) {
+        fclose(fp);
+        return -1;
+    }
+    s->runs = runs;
+    memset(&runs[s->nruns], 0, sizeof(*runs));
+    runs[s->nruns++].fp = fp;
+
+    sorter_sort(s);
+    for (size_t i = 0; i < s->n; i++) {
+        uint32_t len[2] = {s->ents[i].key.mv_size, s->ents[i].data.mv_size};
+        if (fwrite(len, sizeof(len), 1, fp) != 1 ||
+            fwrite(&s->ents[i].seq, sizeof(s->ents[i].seq), 1, fp) != 1 ||
+            fwrite(s->ents[i].key.mv_data, len[0], 1, fp) != 1 ||
+            fwrite(s->ents[i].data.mv_data, len[1], 1, fp) != 1) {
+            fprintf(stderr, "Error writing sort run: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    s->n = 0;
+    s->used = 0;
+    return 0;
+}
+
+/* Add a pair, seq is its place in the input */
+static int sorter_add(kxsorter *s, const void *key, size_t klen,
+                      const void *data, size_t dlen, uint64_t seq) {
+    kxsortent *e;
+
+    if (s->used + klen + dlen > s->limit && sorter_spill(s) == -1)
+        return -1;
+    if (s->n == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 4096;
+        kxsortent *ents = zrealloc(s->ents, cap * sizeof(*ents));
+        if (ents == NULL) return -1;
+        s->ents = ents;
+        s->cap = cap;
+    }
+    e = &s->ents[s->n++];
+    e->seq = seq;
+    e->key.mv_size = klen;
+    e->key.mv_data = s->arena + s->used;
+    memcpy(e->key.mv_data, key, klen);
+    e->data.mv_size = dlen;
+    e->data.mv_data = s->arena + s->used + klen;
+    memcpy(e->data.mv_data, data, dlen);
+    s->used += klen + dlen;
+    return 0;
+}
+
+/* Read the next pair of a run, 0 at its end */
+static int run_read(kxsortrun *r) {
+    uint32_t len[2];
+
+    if (fread(len, sizeof(len), 1, r->fp) != 1)
+        return ferror(r->fp) ? -1 : 0;
+    if (fread(&r->cur.seq, sizeof(r->cur.seq), 1, r->fp) != 1)
+        return -1;
+    if (len[0] + len[1] > r->bufsize) {
+        unsigned char *buf = zrealloc(r->buf, len[0] + len[1]);
+        if (buf == NULL) return -1;
+        r->buf = buf;
+        r->bufsize = len[0] + len[1];
+    }
+    if (len[0] + len[1] && fread(r->buf, len[0] + len[1], 1, r->fp) != 1)
+        return -1;
+    r->cur.key.mv_size = len[0];
+    r->cur.key.mv_data = r->buf;
+    r->cur.data.mv_size = len[1];
+    r->cur.data.mv_data = r->buf + len[0];
+    return 1;
+}
+
+/* Done adding, position on the first pair */
+static int sorter_finish(kxsorter *s) {
+    if (s->nruns == 0) {
+        sorter_sort(s);
+        return 0;
+    }
+    if (s->n && sorter_spill(s) == -1)
+        return -1;
+    for (int i = 0; i < s->nruns; i++) {
+        kxsortrun *r = &s->runs[i];
+        if (fflush(r->fp) != 0 || fseek(r->fp, 0, SEEK_SET) != 0)
+            return -1;
+        if (run_read(r) == -1) return -1;
+    }
+    return 0;
+}
+
+/* Next pair in order, valid until the following call, and its input
+ * seq if wanted. Returns 1, 0 at the end, -1 on error */
+static int sorter_next(kxsorter *s, MDB_val *key, MDB_val *data, uint64_t *seq) {
+    int min = -1;
+
+    if (s->nruns == 0) {
+        if (s->pos == s->n) return 0;
+        *key = s->ents[s->pos].key;
+        *data = s->ents[s->pos].data;
+        if (seq) *seq = s->ents[s->pos].seq;
+        s->pos++;
+        return 1;
+    }
+
+    if (s->last >= 0) {
+        kxsortrun *r = &s->runs[s->last];
+        int rc = run_read(r);
+        if (rc == -1) return -1;
+        if (rc == 0) r->cur.key.mv_data = NULL;
+    }
+    for (int i = 0; i < s->nruns; i++) {
+        if (s->runs[i].cur.key.mv_data == NULL) continue;
+        if (min == -1 || s->cmp(&s->runs[i].cur, &s->runs[min].cur) < 0)
+            min = i;
+    }
+    s->last = min;
+    if (min == -1) return 0;
+    *key = s->runs[min].cur.key;
+    *data = s->runs[min].cur.data;
+    if (seq) *seq = s->runs[min].cur.seq;
+    return 1;
+}
+
+/* Start a fresh batch once the current one holds a transaction's worth */
+static int import_flush(kxlmdbbatch **batch, int force) {
+    kxlmdb *db = (*batch)->db;
+    int ret;
+
+    if (!force && listLength((*batch)->ops) < KXIMPORTTXN)
+        return 0;
+    ret = batch_commit(*batch);
+    *batch = ret == 0 ? batch_begin(db) : NULL;
+    return *batch ? 0 : -1;
+}
+
+/* Append one index from its sort. Keys of the paths index are unique,
+ * the first uuid of a repeated path, the last one input, wins as it
+ * does when the records are put one by one.
+ *
+ * Merging into a catalog (flags = 0) the records were already indexed
+ * in uuid order, only paths repeated in the input are put again. */
+static int import_index(kxlmdb *db, kxsorter *s, MDB_dbi dbi, unsigned int flags) {
+    kxlmdbbatch *batch;
+    MDB_val key, data, prev = {0, NULL};
+    unsigned char prevbuf[KXPATHKEYMAX + 1];
+    uint64_t win = 0;
+    int rc, repeated = 0;
+
+    if (sorter_finish(s) == -1) return -1;
+    batch = batch_begin(db);
+    if (batch == NULL) return -1;
+
+    while ((rc = sorter_next(s, &key, &data, NULL)) == 1) {
+        if (dbi == db->paths) {
+            if (prev.mv_data && cmp_memn(&key, &prev) == 0) {
+                if (flags || repeated++) continue;
+                key = prev;
+                data.mv_size = sizeof(win);
+                data.mv_data = &win;
+            } else {
+                memcpy(prevbuf, key.mv_data, key.mv_size);
+                prev.mv_size = key.mv_size;
+                prev.mv_data = prevbuf;
+                memcpy(&win, data.mv_data, sizeof(win));
+                repeated = 0;
+                if (!flags) continue;
+            }
+        }
+        if (batch_add(batch, dbi, flags, key.mv_data, key.mv_size,
+                      data.mv_data, data.mv_size) == -1 ||
+            import_flush(&batch, 0) == -1) {
+            rc = -1;
+            break;
+        }
+    }
+    if (batch == NULL) return -1;
+    if (rc == -1) {
+        batch_abort(batch);
+        return -1;
+    }
+    return import_flush(&batch, 1) == 0 ? 0 : -1;
+}
+
+/* Empty the file records, their digests, indexes and the path dictionary
+ * in one transaction. Fingerprints are left alone, they expire on their
+ * own. */
+static int import_clear(kxlmdb *db) {
+    int rc;
+    MDB_txn *txn;
+
+    pthread_rwlock_rdlock(&db->maplock);
+    rc = mdb_txn_begin(db->env, NULL, 0, &txn);
+    if (rc == MDB_SUCCESS) {
+        if ((rc = mdb_drop(txn, db->dbi, 0)) != MDB_SUCCESS ||
+            (rc = mdb_drop(txn, db->chunks, 0)) != MDB_SUCCESS ||
+            (rc = mdb_drop(txn, db->paths, 0)) != MDB_SUCCESS ||
+            (rc = mdb_drop(txn, db->users, 0)) != MDB_SUCCESS ||
+            (rc = mdb_drop(txn, db->times, 0)) != MDB_SUCCESS ||
+            (rc = mdb_drop(txn, db->dirs, 0)) != MDB_SUCCESS ||
+            (rc = mdb_drop(txn, db->dirids, 0)) != MDB_SUCCESS ||
+            (rc = mdb_drop(txn, db->expiry, 0)) != MDB_SUCCESS)
+            mdb_txn_abort(txn);
+        else
+            rc = mdb_txn_commit(txn);
+    }
+    pthread_rwlock_unlock(&db->maplock);
+    if (rc != MDB_SUCCESS) {
+        fprintf(stderr, "LMDB error: %s\n", mdb_strerror(rc));
+        return -1;
+    }
+    return 0;
+}
+
+static int import_files(kxlmdb *db, kxdbsource *next, void *privdata, int replace,
+                        kxdbimport *st) {
+    kxdbimport stat;
+    kxsorter *files = NULL, *paths = NULL, *users = NULL, *times = NULL;
+    kxsorter *expiry = NULL;
+    kxlmdbbatch *batch = NULL;
+    unsigned char *rec = NULL;
+    unsigned char buf[1 + sizeof(XXH128_hash_t)];
+    MDB_val key, data, pkey;
+    MDB_txn *txn;
+    MDB_stat ms;
+    kxfile *kf = NULL;
+    kxfileview view;
+    uint64_t prev = 0, seq;
+    int rc, ret = -1, first = 1;
+
+    memset(&stat, 0, sizeof(stat));
+    stat.ms = kx_mstime();
+    kf = zmalloc(sizeof(*kf));
+    rec = zmalloc(KX_DB_RECMAX);
+    files = sorter_create(db, cmp_intent, KXSORTMEM);
+    if (kf == NULL || rec == NULL || files == NULL) goto out;
+
+    /* Sort the whole input by uuid before touching the catalog */
+    while (1) {
+        memset(kf, 0, sizeof(*kf));
+        rc = next(kf, privdata);
+        if (rc == 0) break;
+        if (rc == -1) goto out;
+        stat.records++;
+        if (kf->owner[0] == '\0' && db->base.user[0])
+            strcpy(kf->owner, db->base.user);
+        if (sorter_add(files, &kf->uuid, sizeof(kf->uuid),
+                       rec, kx_db_encode_file(kf, 0, 0, rec), stat.records) == -1)
+            goto out;
+    }
+    if (sorter_finish(files) == -1) goto out;
+
+    if (replace && import_clear(db) == -1)
+        goto out;
+    txn = rtxn_begin(db);
+    if (txn == NULL) goto out;
+    rc = mdb_stat(txn, db->dbi, &ms);
+    rtxn_end(db, txn);
+    if (rc != MDB_SUCCESS) goto out;
+    stat.appended = ms.ms_entries == 0;
+
+    /* Small keys, a quarter of the record sort buffer is plenty. A merge
+     * only needs the paths, to settle the ones the input repeats. */
+    paths = sorter_create(db, cmp_memnseq, KXSORTMEM / 4);
+    if (paths == NULL) goto out;
+    if (stat.appended) {
+        users = sorter_create(db, cmp_memnent, KXSORTMEM / 4);
+        times = sorter_create(db, cmp_intent, KXSORTMEM / 4);
+        expiry = sorter_create(db, cmp_intent, KXSORTMEM / 4);
+        if (users == NULL || times == NULL || expiry == NULL)
+            goto out;
+    }
+
+    batch = batch_begin(db);
+    if (batch == NULL) goto out;
+    while ((rc = sorter_next(files, &key, &data, &seq)) == 1) {
+        uint64_t uuid;
+
+        memcpy(&uuid, key.mv_data, sizeof(uuid));
+        /* Newest first, later records of the same uuid are older */
+        if (!first && uuid == prev) {
+            stat.duplicates++;
+            continue;
+        }
+        first = 0;
+        prev = uuid;
+
+        if (batch_add(batch, db->dbi, stat.appended ? MDB_APPEND : 0,
+                      key.mv_data, key.mv_size, data.mv_data, data.mv_size) == -1)
+            goto out;
+        if (kx_db_view_file(key.mv_data, key.mv_size, data.mv_data, data.mv_size,
+                            &view) == 0) {
+            uint64_t ctime = view.ctime, expires = view.expires;
+
+            if (view.fullnamelen) {
+                path_key_len(view.fullname, view.fullnamelen, &pkey, buf);
+                if (sorter_add(paths, pkey.mv_data, pkey.mv_size, &uuid, sizeof(uuid),
+                               seq) == -1)
+                    goto out;
+            }
+            if (!stat.appended) goto next;
+            if (view.ownerlen && sorter_add(users, view.owner, view.ownerlen,
+                                            &uuid, sizeof(uuid), seq) == -1)
+                goto out;
+            if (ctime && sorter_add(times, &ctime, sizeof(ctime),
+                                    &uuid, sizeof(uuid), seq) == -1)
+                goto out;
+            if (expires && sorter_add(expiry, &expires, sizeof(expires),
+                                      &uuid, sizeof(uuid), seq) == -1)
+                goto out;
+        }
+next:
+        stat.loaded++;
+        if (import_flush(&batch, 0) == -1) goto out;
+    }
+    if (rc == -1 || import_flush(&batch, 1) == -1) goto out;
+    batch_abort(batch);
+    batch = NULL;
+    sorter_free(files);
+    files = NULL;
+
+    if (import_index(db, paths, db->paths, stat.appended ? MDB_APPEND : 0) == -1)
+        goto out;
+    if (stat.appended &&
+        (import_index(db, users, db->users, MDB_APPENDDUP) == -1 ||
+         import_index(db, times, db->times, MDB_APPENDDUP) == -1 ||
+         import_index(db, expiry, db->expiry, MDB_APPENDDUP) == -1))
+        goto out;
+    ret = 0;
+out:
+    if (ret == -1)
+        fprintf(stderr, "Catalog import failed after %lu records\n", stat.loaded);
+    if (batch) batch_abort(batch);
+    sorter_free(files);
+    sorter_free(paths);
+    sorter_free(users);
+    sorter_free(times);
+    sorter_free(expiry);
+    if (rec) zfree(rec);
+    if (kf) zfree(kf);
+    /* Appended indexes and replaced records never went through the filter */
+    if (stat.appended || replace)
+        bloom_build(db);
+    stat.ms = kx_mstime() - stat.ms;
+    if (st) *st = stat;
+    return ret;
+}
+
+/* Free the reader slots of dead processes, otherwise the oldest snapshot
+ * they pin keeps LMDB from reusing pages and the map only grows. */
+static void reader_check(kxlmdb *db) {
+    int dead = 0;
+
+    if (mdb_reader_check(db->env, &dead) == MDB_SUCCESS && dead > 0)
+        fprintf(stderr, "Cleared %d stale catalog reader slots\n", dead);
+    db->lastcheck = kx_mstime();
+}
+
+/* Background thread, runs group commits, the periodic sync of
+ * KX_DB_SYNC_ASYNC, the prune of expired entries and the stale reader
+ * sweep (with the Bloom filter rebuild), sleeping until whichever is
+ * due first. */
+static void *db_bg_main(void *arg) {
+    kxlmdb *db = arg;
+    struct timespec deadline;
+    long long waited, wait;
+
+    pthread_mutex_lock(&db->bglock);
+    while (!db->bgstop) {
+        /* The reader sweep is always due at some point */
+        waited = kx_mstime() - db->lastcheck;
+        if (waited >= KX_DB_READER_CHECK) {
+            pthread_mutex_unlock(&db->bglock);
+            reader_check(db);
+            bloom_refresh(db);
+            pthread_mutex_lock(&db->bglock);
+            continue;
+        }
+        wait = KX_DB_READER_CHECK - waited;
+
+        /* Commits go on between the prune's short transactions */
+        waited = kx_mstime() - db->lastprune;
+        if (waited >= db->prunems) {
+            kxdbprune pst;
+
+            pthread_mutex_unlock(&db->bglock);
+            if (prune_env(db, (uint64_t)time(NULL), &pst) == 0 && pst.files)
+                fprintf(stderr, "Pruned %lu expired catalog records\n", pst.files);
+            pthread_mutex_lock(&db->bglock);
+            db->lastprune = kx_mstime();
+            continue;
+        }
+        if (db->prunems - waited < wait)
+            wait = db->prunems - waited;
+
+        /* Not after a failed build, the sweep retries those */
+        if (db->bloomtxn && bloom_full(db)) {
+            pthread_mutex_unlock(&db->bglock);
+            bloom_build(db);
+            pthread_mutex_lock(&db->bglock);
+            continue;
+        }
+
+        if (db->gcpending) {
+            waited = kx_mstime() - db->gcsince;
+            if (db->gcpending->count >= db->gcrecords || waited >= db->gcdelay) {
+                group_commit_flush(db);
+                continue;
+            }
+            if (db->gcdelay - waited < wait)
+                wait = db->gcdelay - waited;
+        }
+        if (db->syncms) {
+            waited = kx_mstime() - db->lastsync;
+            if (waited >= db->syncms) {
+                bg_sync(db);
+                continue;
+            }
+            if (db->syncms - waited < wait)
+                wait = db->syncms - waited;
+        }
+
+        kx_deadline(&deadline, wait);
+        pthread_cond_timedwait(&db->bgcond, &db->bglock, &deadline);
+    }
+    if (db->gcpending)
+        group_commit_flush(db);
+    if (db->syncms)
+        bg_sync(db);
+    pthread_mutex_unlock(&db->bglock);
+
+    return NULL;
+}
+
+/* Start the background thread if needed, called with bglock held */
+static int bg_start(kxlmdb *db) {
+    if (db->bgrunning) return 0;
+
+    db->bgstop = 0;
+    if (pthread_create(&db->bgthread, NULL, db_bg_main, db) != 0) {
+        fprintf(stderr, "Unable to start catalog background thread\n");
+        return -1;
+    }
+    db->bgrunning = 1;
+    return 0;
+}
+
+/* Stop the background thread once pending work is written */
+static void bg_stop(kxlmdb *db) {
+    pthread_mutex_lock(&db->bglock);
+    if (!db->bgrunning) {
+        pthread_mutex_unlock(&db->bglock);
+        return;
+    }
+    db->bgstop = 1;
+    pthread_cond_signal(&db->bgcond);
+    pthread_mutex_unlock(&db->bglock);
+
+    pthread_join(db->bgthread, NULL);
+    db->bgrunning = 0;
+    db->gcrecords = 0;
+}
+
+static int group_commit_start(kxlmdb *db, size_t records, uint32_t delay) {
+    int ret;
+
+    pthread_mutex_lock(&db->bglock);
+    db->gcrecords = records ? records : KX_DB_GC_RECORDS;
+    db->gcdelay = delay ? delay : KX_DB_GC_DELAY;
+    ret = bg_start(db);
+    if (ret == -1) db->gcrecords = 0;
+    pthread_mutex_unlock(&db->bglock);
+    return ret;
+}
+
+/* The background thread has other jobs, it keeps running until
+ * close_env() and only the pending group is drained here. */
+static void group_commit_stop(kxlmdb *db) {
+    pthread_mutex_lock(&db->bglock);
+    db->gcrecords = 0;
+    if (db->gcpending)
+        group_commit_flush(db);
+    pthread_mutex_unlock(&db->bglock);
+}
+
+/* Collect up to max entries of an expiry index due by now. Each takes
+ * 8 + width bytes of buf, the time followed by the indexed key. */
+static int prune_due(MDB_txn *txn, MDB_dbi dbi, uint64_t now, size_t width,
+                     unsigned char *buf, size_t max, size_t *n) {
+    int rc;
+    MDB_cursor *cursor;
+    MDB_val key, data;
+    uint64_t when;
+
+    *n = 0;
+    if (max == 0) return MDB_SUCCESS;
+    rc = mdb_cursor_open(txn, dbi, &cursor);
+    if (rc != MDB_SUCCESS) return rc;
+    rc = mdb_cursor_get(cursor, &key, &data, MDB_FIRST);
+    while (rc == MDB_SUCCESS && *n < max) {
+        memcpy(&when, key.mv_data, sizeof(when));
+        if (when > now) break;
+        if (data.mv_size == width) {
+            memcpy(buf, &when, sizeof(when));
+            memcpy(buf + sizeof(when), data.mv_data, width);
+            buf += sizeof(when) + width;
+            (*n)++;
+        }
+        rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+    }
+    mdb_cursor_close(cursor);
+    return rc == MDB_NOTFOUND ? MDB_SUCCESS : rc;
+}
+
+/* Delete an expired record with its indexes and chunk digests. A record
+ * given a later expiry meanwhile only loses the stale index entry. The
+ * directory it interned stays, other paths may share it. */
+static int prune_file(kxlmdb *db, MDB_txn *txn, uint64_t when, uint64_t uuid,
+                      uint64_t now, uint64_t *pruned) {
+    int rc;
+    MDB_val key, data, ekey;
+    kxfile kf;
+
+    key.mv_size = sizeof(uuid);
+    key.mv_data = &uuid;
+    rc = mdb_get(txn, db->dbi, &key, &data);
+    if (rc == MDB_SUCCESS && decode_record(db, txn, &key, &data, &kf) == 0 &&
+        kf.expires && kf.expires <= now) {
+        if ((rc = index_file(db, txn, &kf, 1)) != MDB_SUCCESS ||
+            (rc = mdb_del(txn, db->dbi, &key, NULL)) != MDB_SUCCESS)
+            return rc;
+        rc = mdb_del(txn, db->chunks, &key, NULL);
+        (*pruned)++;
+    }
+    if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND) return rc;
+
+    ekey.mv_size = sizeof(when);
+    ekey.mv_data = &when;
+    rc = mdb_del(txn, db->expiry, &ekey, &key);
+    return rc == MDB_NOTFOUND ? MDB_SUCCESS : rc;
+}
+
+/* Returns -1 when data is too short to be an entry */
+static int read_fpentry(const MDB_val *data, kxfpentry *ent) {
+    memset(ent, 0, sizeof(*ent));
+    if (data->mv_size < offsetof(kxfpentry, scheme))
+        return -1;
+    memcpy(ent, data->mv_data,
+           data->mv_size < sizeof(*ent) ? data->mv_size : sizeof(*ent));
+    return 0;
+}
+
+static int prune_fingerprint(kxlmdb *db, MDB_txn *txn, uint64_t when,
+                             unsigned char *fp, uint64_t now, uint64_t *pruned) {
+    int rc;
+    MDB_val key, data, ekey;
+    kxfpentry ent;
+
+    key.mv_size = sizeof(kxfpkey);
+    key.mv_data = fp;
+    rc = mdb_get(txn, db->fpcache, &key, &data);
+    if (rc == MDB_SUCCESS && read_fpentry(&data, &ent) == 0) {
+        if (ent.expires && ent.expires <= now) {
+            if ((rc = mdb_del(txn, db->fpcache, &key, NULL)) != MDB_SUCCESS)
+                return rc;
+            (*pruned)++;
+        }
+    }
+    if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND) return rc;
+
+    ekey.mv_size = sizeof(when);
+    ekey.mv_data = &when;
+    rc = mdb_del(txn, db->fpexpiry, &ekey, &key);
+    return rc == MDB_NOTFOUND ? MDB_SUCCESS : rc;
+}
+
+/* One write transaction of the prune, it goes through at most
+ * KX_DB_PRUNE_TXN due index entries, records first. buf holds that many
+ * fingerprint entries. Returns how many it went through, fewer than
+ * KX_DB_PRUNE_TXN once nothing is left, or -1 on error. */
+static long prune_txn(kxlmdb *db, uint64_t now, unsigned char *buf, kxdbprune *st) {
+    int rc;
+    MDB_txn *txn = NULL;
+    uint64_t mapsize, when, uuid, files, fps;
+    size_t i, nfiles, nfps, txnid;
+    const size_t fw = sizeof(when) + sizeof(uuid);
+    const size_t pw = sizeof(when) + sizeof(kxfpkey);
+
+again:
+    files = fps = 0;
+    pthread_rwlock_rdlock(&db->maplock);
+    mapsize = db->max_mapsize;
+    rc = mdb_txn_begin(db->env, NULL, 0, &txn);
+    if (rc != MDB_SUCCESS) {
+        txn = NULL;
+        goto err;
+    }
+
+    rc = prune_due(txn, db->expiry, now, sizeof(uuid), buf, KX_DB_PRUNE_TXN, &nfiles);
+    if (rc != MDB_SUCCESS) goto err;
+    for (i = 0; i < nfiles; i++) {
+        memcpy(&when, buf + i * fw, sizeof(when));
+        memcpy(&uuid, buf + i * fw + sizeof(when), sizeof(uuid));
+        rc = prune_file(db, txn, when, uuid, now, &files);
+        if (rc != MDB_SUCCESS) goto err;
+    }
+    rc = prune_due(txn, db->fpexpiry, now, sizeof(kxfpkey), buf,
+                   KX_DB_PRUNE_TXN - nfiles, &nfps);
+    if (rc != MDB_SUCCESS) goto err;
+    for (i = 0; i < nfps; i++) {
+        memcpy(&when, buf + i * pw, sizeof(when));
+        rc = prune_fingerprint(db, txn, when, buf + i * pw + sizeof(when), now, &fps);
+        if (rc != MDB_SUCCESS) goto err;
+    }
+
+    if (nfiles + nfps == 0) {
+        mdb_txn_abort(txn);
+        pthread_rwlock_unlock(&db->maplock);
+        return 0;
+    }
+    txnid = mdb_txn_id(txn);
+    __atomic_add_fetch(&db->bloomcommits, 1, __ATOMIC_RELEASE);
+    rc = mdb_txn_commit(txn);
+    txn = NULL;
+    if (rc != MDB_SUCCESS) {
+        __atomic_sub_fetch(&db->bloomcommits, 1, __ATOMIC_RELEASE);
+        goto err;
+    }
+    /* Deleted keys stay in the filter, as false positives only */
+    bloom_commit(db, txnid);
+    pthread_rwlock_unlock(&db->maplock);
+
+    st->files += files;
+    st->fingerprints += fps;
+    st->txns++;
+    return nfiles + nfps;
+err:
+    if (txn) mdb_txn_abort(txn);
+    pthread_rwlock_unlock(&db->maplock);
+    if (rc == MDB_MAP_FULL || rc == MDB_MAP_RESIZED) {
+        if (grow_map(db, rc == MDB_MAP_FULL ? mapsize : 0) == 0)
+            goto again;
+    }
+    fprintf(stderr, "LMDB error: %s\n", mdb_strerror(rc));
+    return -1;
+}
+
+/* Read, lower the expiry time and put back a record in one transaction,
+ * a put racing with it is never undone. put_record() moves its expiry
+ * index entry. Returns -1 without a word when the record is gone. */
+static int expire_file(kxlmdb *db, uint64_t uuid, uint64_t when) {
+    int rc;
+    MDB_txn *txn = NULL;
+    MDB_val key, data;
+    uint64_t mapsize;
+    size_t txnid;
+    kxfile *kf;
+    unsigned char *rec;
+
+    kf = zmalloc(sizeof(*kf));
+    rec = zmalloc(KX_DB_RECMAX);
+    if (kf == NULL || rec == NULL) {
+        if (kf) zfree(kf);
+        if (rec) zfree(rec);
+        return -1;
+    }
+    key.mv_size = sizeof(uuid);
+    key.mv_data = &uuid;
+
+again:
+    pthread_rwlock_rdlock(&db->maplock);
+    mapsize = db->max_mapsize;
+    rc = mdb_txn_begin(db->env, NULL, 0, &txn);
+    if (rc != MDB_SUCCESS) {
+        txn = NULL;
+        goto err;
+    }
+    rc = mdb_get(txn, db->dbi, &key, &data);
+    if (rc == MDB_SUCCESS && decode_record(db, txn, &key, &data, kf) == -1)
+        rc = MDB_NOTFOUND;
+    if (rc != MDB_SUCCESS) goto err;
+    if (kf->expires && kf->expires <= when) {
+        mdb_txn_abort(txn);
+        pthread_rwlock_unlock(&db->maplock);
+        goto out;
+    }
+
+    kf->expires = when;
+    kf->tree = NULL;
+    data.mv_data = rec;
+    data.mv_size = kx_db_encode_file(kf, 0, 0, rec);
+    rc = put_record(db, txn, &key, &data);
+    if (rc != MDB_SUCCESS) goto err;
+    txnid = mdb_txn_id(txn);
+    __atomic_add_fetch(&db->bloomcommits, 1, __ATOMIC_RELEASE);
+    rc = mdb_txn_commit(txn);
+    txn = NULL;
+    if (rc != MDB_SUCCESS) {
+        __atomic_sub_fetch(&db->bloomcommits, 1, __ATOMIC_RELEASE);
+        goto err;
+    }
+    bloom_commit(db, txnid);
+    pthread_rwlock_unlock(&db->maplock);
+out:
+    zfree(kf);
+    zfree(rec);
+    return 0;
+err:
+    if (txn) mdb_txn_abort(txn);
+    pthread_rwlock_unlock(&db->maplock);
+    if (rc == MDB_MAP_FULL || rc == MDB_MAP_RESIZED) {
+        if (grow_map(db, rc == MDB_MAP_FULL ? mapsize : 0) == 0)
+            goto again;
+    }
+    if (rc != MDB_NOTFOUND)
+        fprintf(stderr, "LMDB error: %s\n", mdb_strerror(rc));
+    zfree(kf);
+    zfree(rec);
+    return -1;
+}
+
+/* Expired entries are found through their expiry index, so a prune only
+ * reads what it deletes. Each transaction is short and the map lock is
+ * let go between them. */
+static int prune_env(kxlmdb *db, uint64_t now, kxdbprune *st) {
+    kxdbprune stat;
+    unsigned char *buf;
+    long n;
+
+    memset(&stat, 0, sizeof(stat));
+    stat.ms = kx_mstime();
+    buf = zmalloc(KX_DB_PRUNE_TXN * (sizeof(uint64_t) + sizeof(kxfpkey)));
+    if (buf == NULL) return -1;
+    do {
+        n = prune_txn(db, now, buf, &stat);
+    } while (n == KX_DB_PRUNE_TXN);
+    zfree(buf);
+
+    stat.ms = kx_mstime() - stat.ms;
+    if (st) *st = stat;
+    return n == -1 ? -1 : 0;
+}
+
+/* Point lookup by uuid, the record is copied out of the map since the
+ * read transaction is reset before returning. */
+static void get_file(kxlmdb *db, void *key, kxfile **outfile) {
+    int rc;
+    MDB_txn *txn;
+    MDB_val mdb_key, mdb_data;
+    kxfile *kf;
+
+    *outfile = NULL;
+    if (!file_known(db, *(uint64_t*)key, NULL)) {
+        printf("Key not found: %lu\n", *(uint64_t*)key);
+        return;
+    }
+    txn = rtxn_begin(db);
+    if (txn == NULL) return;
+
+    mdb_key.mv_data = (void *)key;
+    mdb_key.mv_size = sizeof(uint64_t);
+
+    rc = mdb_get(txn, db->dbi, &mdb_key, &mdb_data);
+    if (rc == MDB_SUCCESS) {
+        kf = zmalloc(sizeof(*kf));
+        if (kf && decode_record(db, txn, &mdb_key, &mdb_data, kf) == -1) {
+            fprintf(stderr, "Corrupt catalog record: %lu\n", *(uint64_t*)key);
+            zfree(kf);
+            kf = NULL;
+        }
+        *outfile = kf;
+    } else if (rc == MDB_NOTFOUND) {
+        printf("Key not found: %lu\n", *(uint64_t*)key);
+    } else {
+        fprintf(stderr, "LMDB error: %s\n", mdb_strerror(rc));
+    }
+    rtxn_end(db, txn);
+}
+
+static int set_user(kxlmdb *db, const char *user) {
+    pthread_mutex_lock(&db->bglock);
+    if (user)
+        strcpy(db->base.user, user);
+    else
+        db->base.user[0] = '\0';
+    pthread_mutex_unlock(&db->bglock);
+    return 0;
+}
+
+/* Copy a view into the page, its strings into one buffer */
+static int walk_add(kxwalkpage *page, const kxfileview *view) {
+    size_t len = view->fullnamelen + view->fnamelen + view->ownerlen;
+    char *p;
+
+    if (page->used + len > page->cap) {
+        size_t cap = (page->used + len) * 2;
+        p = zrealloc(page->strs, cap);
+        if (p == NULL) return -1;
+        page->strs = p;
+        page->cap = cap;
+    }
+    p = page->strs + page->used;
+    memcpy(p, view->fullname, view->fullnamelen);
+    memcpy(p + view->fullnamelen, view->fname, view->fnamelen);
+    memcpy(p + view->fullnamelen + view->fnamelen, view->owner, view->ownerlen);
+    page->views[page->n] = *view;
+    page->offs[page->n++] = page->used;
+    page->used += len;
+    return 0;
+}
+
+/* Walks come from one of three sources. Without a user set the files
+ * database is walked in uuid order. With a user, the dups of that user
+ * in the users index are walked instead, also in uuid order, so other
+ * users' records are never touched. With a prefix the paths index is
+ * walked and records of other users are skipped.
+ *
+ * Records are read KXWALKPAGE at a time, each page in its own read
+ * transaction, and handed to fn after it ended. A callback that waits
+ * on writers, as the workers of file --verify, never holds the map lock
+ * a resize needs. The next page resumes at the key the last one stopped
+ * at, just like a page token. */
+static long foreach_file(kxlmdb *db, kxdbiter *it, kxdbiterfn *fn, void *privdata) {
+    int rc, more;
+    long count = 0;
+    size_t i;
+    MDB_txn *txn;
+    MDB_cursor *cursor;
+    MDB_dbi dbi;
+    MDB_val key, data, fkey, fdata, tok, *at;
+    MDB_cursor_op op, next;
+    union {
+        uint64_t uuid;     /* Keeps integer keys aligned */
+        unsigned char bytes[KX_DB_TOKEN_LEN / 2];
+    } buf;
+    size_t plen = it->prefix ? strlen(it->prefix) : 0;
+    size_t ulen = it->everyone ? 0 : strlen(db->base.user);
+    kxfileview view;
+    kxwalkpage *page;
+    char path[PATH_MAX];
+
+    it->next[0] = '\0';
+    if (it->token && it->token[0]) {
+        if (kx_db_token_decode(it->token, it->prefix ? 'p' : 'u', buf.bytes,
+                               &tok.mv_size) == -1 ||
+            (!it->prefix && tok.mv_size != sizeof(uint64_t))) {
+            fprintf(stderr, "Invalid page token\n");
+            return -1;
+        }
+        tok.mv_data = buf.bytes;
+    } else {
+        tok.mv_size = 0;
+    }
+
+    page = zmalloc(sizeof(*page));
+    if (page == NULL) return -1;
+    page->strs = NULL;
+    page->cap = 0;
+
+    do {
+        op = MDB_FIRST;
+        next = MDB_NEXT;
+        if (it->prefix) {
+            dbi = db->paths;
+            op = MDB_SET_RANGE;
+            key = tok.mv_size ? tok : (MDB_val){plen, (void *)it->prefix};
+        } else if (ulen) {
+            dbi = db->users;
+            key.mv_size = ulen;
+            key.mv_data = db->base.user;
+            op = MDB_SET;
+            next = MDB_NEXT_DUP;
+            if (tok.mv_size) {
+                data = tok;
+                op = MDB_GET_BOTH_RANGE;
+            }
+        } else {
+            dbi = db->dbi;
+            if (tok.mv_size) {
+                key = tok;
+                op = MDB_SET_RANGE;
+            }
+        }
+
+        more = 0;
+        page->n = 0;
+        page->used = 0;
+        txn = rtxn_begin(db);
+        if (txn == NULL) {
+            count = -1;
+            break;
+        }
+        rc = mdb_cursor_open(txn, dbi, &cursor);
+        if (rc != MDB_SUCCESS) goto out;
+
+        rc = mdb_cursor_get(cursor, &key, &data, op);
+        while (rc == MDB_SUCCESS) {
+            if (it->prefix) {
+                /* Paths sort by bytes, the first one without the prefix ends it */
+                if (key.mv_size < plen || memcmp(key.mv_data, it->prefix, plen) != 0)
+                    break;
+            }
+            at = dbi == db->users ? &data : &key;
+            if (it->limit && count + page->n == it->limit) {
+                kx_db_token_encode(it->next, it->prefix ? 'p' : 'u', at->mv_data, at->mv_size);
+                break;
+            }
+            if (page->n == KXWALKPAGE) {
+                /* Copied before the transaction ends, tok points at it */
+                memcpy(buf.bytes, at->mv_data, at->mv_size);
+                tok.mv_size = at->mv_size;
+                tok.mv_data = buf.bytes;
+                more = 1;
+                break;
+            }
+
+            if (dbi == db->dbi) {
+                fkey = key;
+                fdata = data;
+            } else {
+                fkey = data;
+                rc = mdb_get(txn, db->dbi, &fkey, &fdata);
+                if (rc == MDB_NOTFOUND) goto next;
+                if (rc != MDB_SUCCESS) break;
+            }
+            if (view_record(db, txn, &fkey, &fdata, &view, path) == 0) {
+                if (it->prefix && ulen && (view.ownerlen != ulen ||
+                    memcmp(view.owner, db->base.user, ulen) != 0))
+                    goto next;
+                if (walk_add(page, &view) == -1) {
+                    rc = ENOMEM;
+                    break;
+                }
+            }
+next:
+            rc = mdb_cursor_get(cursor, &key, &data, next);
+        }
+        mdb_cursor_close(cursor);
+out:
+        rtxn_end(db, txn);
+        if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND) {
+            fprintf(stderr, "LMDB error: %s\n", mdb_strerror(rc));
+            count = -1;
+            break;
+        }
+
+        for (i = 0; i < page->n; i++) {
+            view = page->views[i];
+            view.fullname = page->strs + page->offs[i];
+            view.fname = view.fullname + view.fullnamelen;
+            view.owner = view.fname + view.fnamelen;
+            count++;
+            if (fn(&view, privdata)) {
+                it->next[0] = '\0';
+                more = 0;
+                break;
+            }
+        }
+    } while (more);
+
+    zfree(page->strs);
+    zfree(page);
+    return count;
+}
+
+static int insert_digests(kxlmdb *db, uint64_t uuid, kxtree *tree) {
+    kxlmdbbatch *batch = batch_begin(db);
+    if (batch == NULL) return -1;
+
+    if (batch_add(batch, db->chunks, 0, &uuid, sizeof(uuid),
+                  tree, KXTREE_SIZE(tree->nchunks)) == -1) {
+        batch_abort(batch);
+        return -1;
+    }
+    return batch_commit(batch);
+}
+
+/* Copy the chunk digests out of the map, the result outlives the read
+ * transaction and must be released with zfree(). */
+static int get_digests(kxlmdb *db, uint64_t uuid, kxtree **outtree) {
+    int rc;
+    MDB_txn *txn;
+    MDB_val key, data;
+    kxtree *tree = NULL;
+
+    *outtree = NULL;
+    txn = rtxn_begin(db);
+    if (txn == NULL) return -1;
+
+    key.mv_size = sizeof(uuid);
+    key.mv_data = &uuid;
+    rc = mdb_get(txn, db->chunks, &key, &data);
+    if (rc == MDB_SUCCESS) {
+        tree = zmalloc(data.mv_size);
+        if (tree) memcpy(tree, data.mv_data, data.mv_size);
+    } else if (rc != MDB_NOTFOUND) {
+        /* Files hashed in one pass have no digests, that is not an error */
+        fprintf(stderr, "LMDB error: %s\n", mdb_strerror(rc));
+    }
+    rtxn_end(db, txn);
+
+    *outtree = tree;
+    return tree ? 0 : -1;
+}
+
+static int insert_fingerprint(kxlmdb *db, const kxfpkey *fp, uint64_t uuid) {
+    kxfpentry ent = {uuid, (uint64_t)time(NULL) + db->fpttl, KXFP_SCHEME};
+    kxlmdbbatch *batch = batch_begin(db);
+    if (batch == NULL) return -1;
+
+    if (batch_add(batch, db->fpcache, 0, fp, sizeof(*fp), &ent, sizeof(ent)) == -1) {
+        batch_abort(batch);
+        return -1;
+    }
+    return batch_commit(batch);
+}
+
+static int get_fingerprint(kxlmdb *db, const kxfpkey *fp, uint64_t *uuid) {
+    int rc;
+    MDB_txn *txn;
+    MDB_val key, data;
+
+    txn = rtxn_begin(db);
+    if (txn == NULL) return -1;
+
+    key.mv_size = sizeof(*fp);
+    key.mv_data = (void *)fp;
+    rc = mdb_get(txn, db->fpcache, &key, &data);
+    if (rc == MDB_SUCCESS) {
+        kxfpentry ent;
+
+        /* Expired and not pruned yet, or hashed another way, as good
+         * as gone */
+        if (read_fpentry(&data, &ent) == -1 || ent.scheme != KXFP_SCHEME ||
+            (ent.expires && ent.expires <= (uint64_t)time(NULL)))
+            rc = MDB_NOTFOUND;
+        else
+            *uuid = ent.uuid;
+    } else if (rc != MDB_NOTFOUND)
+        /* A cache miss is the normal case for new or modified files */
+        fprintf(stderr, "LMDB error: %s\n", mdb_strerror(rc));
+    rtxn_end(db, txn);
+
+    return rc == MDB_SUCCESS ? 0 : -1;
+}
+
+/* Key of the paths index. Paths longer than the LMDB key limit are keyed
+ * by their 128 bit hash behind a NUL byte, which no real path starts with. */
+static void path_key(const char *path, MDB_val *key, unsigned char *buf) {
+    path_key_len(path, strlen(path), key, buf);
+}
+
+static void path_key_len(const char *path, size_t len, MDB_val *key, unsigned char *buf) {
+    if (len <= KXPATHKEYMAX) {
+        key->mv_size = len;
+        key->mv_data = (void *)path;
+    } else {
+        XXH128_hash_t h = XXH3_128bits(path, len);
+        buf[0] = '\0';
+        memcpy(buf + 1, &h, sizeof(h));
+        key->mv_size = 1 + sizeof(h);
+        key->mv_data = buf;
+    }
+}
+
+/* Add (del = 0) or remove (del = 1) the index entries of a record */
+static int index_file(kxlmdb *db, MDB_txn *txn, const kxfile *kf, int del) {
+    int rc;
+    MDB_val key, data;
+    unsigned char buf[1 + sizeof(XXH128_hash_t)];
+    uint64_t uuid = kf->uuid;
+    uint64_t ctime = kf->ctime;
+    uint64_t expires = kf->expires;
+
+    data.mv_size = sizeof(uuid);
+    data.mv_data = &uuid;
+
+    if (kf->fullname[0]) {
+        path_key(kf->fullname, &key, buf);
+        if (del) {
+            /* The path may already point at a newer version of the file */
+            MDB_val cur;
+            rc = mdb_get(txn, db->paths, &key, &cur);
+            if (rc == MDB_SUCCESS && cur.mv_size == sizeof(uuid) &&
+                memcmp(cur.mv_data, &uuid, sizeof(uuid)) == 0)
+                rc = mdb_del(txn, db->paths, &key, NULL);
+        } else {
+            rc = mdb_put(txn, db->paths, &key, &data, 0);
+        }
+        if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND) return rc;
+    }
+
+    if (kf->owner[0]) {
+        key.mv_size = strlen(kf->owner);
+        key.mv_data = (void *)kf->owner;
+        rc = del ? mdb_del(txn, db->users, &key, &data)
+                 : mdb_put(txn, db->users, &key, &data, MDB_NODUPDATA);
+        if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND && rc != MDB_KEYEXIST) return rc;
+    }
+
+    if (ctime) {
+        key.mv_size = sizeof(ctime);
+        key.mv_data = &ctime;
+        rc = del ? mdb_del(txn, db->times, &key, &data)
+                 : mdb_put(txn, db->times, &key, &data, MDB_NODUPDATA);
+        if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND && rc != MDB_KEYEXIST) return rc;
+    }
+
+    if (expires) {
+        key.mv_size = sizeof(expires);
+        key.mv_data = &expires;
+        rc = del ? mdb_del(txn, db->expiry, &key, &data)
+                 : mdb_put(txn, db->expiry, &key, &data, MDB_NODUPDATA);
+        if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND && rc != MDB_KEYEXIST) return rc;
+    }
+    return MDB_SUCCESS;
+}
+
+/* Store a file record and keep the secondary indexes in step with it,
+ * inside the caller's write transaction. */
+static int put_record(kxlmdb *db, MDB_txn *txn, MDB_val *key, MDB_val *data) {
+    int rc;
+    MDB_val old, rec = *data;
+    kxfile kf;
+    unsigned char buf[KX_DB_RECMAX];
+
+    rc = mdb_get(txn, db->dbi, key, &old);
+    if (rc == MDB_SUCCESS && decode_record(db, txn, key, &old, &kf) == 0) {
+        rc = index_file(db, txn, &kf, 1);
+        if (rc != MDB_SUCCESS) return rc;
+    } else if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND) {
+        return rc;
+    }
+
+    rc = intern_record(db, txn, key, &rec, buf);
+    if (rc != MDB_SUCCESS) return rc;
+    rc = mdb_put(txn, db->dbi, key, &rec, 0);
+    if (rc != MDB_SUCCESS) return rc;
+    if (kx_db_decode_file(key->mv_data, key->mv_size, data->mv_data, data->mv_size, &kf) == -1)
+        return MDB_SUCCESS;
+    /* Before the commit, a failed one only leaves a false positive */
+    bloom_note(db, &kf);
+    return index_file(db, txn, &kf, 0);
+}
+
+/* Store a fingerprint cache entry, its expiry index entry moves with it */
+static int put_fpentry(kxlmdb *db, MDB_txn *txn, MDB_val *key, MDB_val *data) {
+    int rc;
+    MDB_val old, ekey;
+    kxfpentry ent;
+
+    rc = mdb_get(txn, db->fpcache, key, &old);
+    if (rc == MDB_SUCCESS && read_fpentry(&old, &ent) == 0) {
+        ekey.mv_size = sizeof(ent.expires);
+        ekey.mv_data = &ent.expires;
+        rc = mdb_del(txn, db->fpexpiry, &ekey, key);
+    }
+    if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND) return rc;
+
+    rc = mdb_put(txn, db->fpcache, key, data, 0);
+    if (rc != MDB_SUCCESS || data->mv_size != sizeof(ent)) return rc;
+    memcpy(&ent, data->mv_data, sizeof(ent));
+    ekey.mv_size = sizeof(ent.expires);
+    ekey.mv_data = &ent.expires;
+    rc = mdb_put(txn, db->fpexpiry, &ekey, key, MDB_NODUPDATA);
+    return rc == MDB_KEYEXIST ? MDB_SUCCESS : rc;
+}
+
+/* Id of the directory dir[0..len), interned on first use. Ids are handed
+ * out in order, a new one follows the last one in use. */
+static int intern_dir(kxlmdb *db, MDB_txn *txn, const char *dir, size_t len,
+                      uint64_t *id) {
+    int rc;
+    MDB_cursor *cursor;
+    MDB_val key, data, last;
+    unsigned char buf[1 + sizeof(XXH128_hash_t)];
+
+    path_key_len(dir, len, &key, buf);
+    rc = mdb_get(txn, db->dirids, &key, &data);
+    if (rc == MDB_SUCCESS && data.mv_size == sizeof(*id)) {
+        memcpy(id, data.mv_data, sizeof(*id));
+        return MDB_SUCCESS;
+    }
+    if (rc != MDB_NOTFOUND) return rc;
+
+    rc = mdb_cursor_open(txn, db->dirs, &cursor);
+    if (rc != MDB_SUCCESS) return rc;
+    rc = mdb_cursor_get(cursor, &last, &data, MDB_LAST);
+    mdb_cursor_close(cursor);
+    if (rc == MDB_SUCCESS) {
+        memcpy(id, last.mv_data, sizeof(*id));
+        (*id)++;
+    } else if (rc == MDB_NOTFOUND) {
+        *id = 1;
+    } else {
+        return rc;
+    }
+
+    data.mv_size = sizeof(*id);
+    data.mv_data = id;
+    rc = mdb_put(txn, db->dirids, &key, &data, 0);
+    if (rc != MDB_SUCCESS) return rc;
+    key.mv_size = sizeof(*id);
+    key.mv_data = id;
+    data.mv_size = len;
+    data.mv_data = (void *)dir;
+    return mdb_put(txn, db->dirs, &key, &data, MDB_APPEND);
+}
+
+/* Records bigger than about half a page go to overflow pages, and the
+ * path is what makes them big. A long path gets its directory interned
+ * in the path dictionary, so the record keeps only the file name and
+ * stays in its leaf page. data then points into buf, which holds
+ * KX_DB_RECMAX bytes. */
+static int intern_record(kxlmdb *db, MDB_txn *txn, const MDB_val *key, MDB_val *data,
+                         unsigned char *buf) {
+    int rc;
+    kxfileview view;
+    kxfile kf;
+    size_t dirlen;
+    uint64_t id;
+
+    if (kx_db_view_file(key->mv_data, key->mv_size, data->mv_data, data->mv_size,
+                        &view) == -1 || view.dirid ||
+        view.fullnamelen <= KXPATHINLINE)
+        return MDB_SUCCESS;
+    for (dirlen = view.fullnamelen; dirlen > 1; dirlen--)
+        if (view.fullname[dirlen - 1] == '/') break;
+    if (dirlen <= 1) return MDB_SUCCESS;
+
+    rc = intern_dir(db, txn, view.fullname, dirlen, &id);
+    if (rc != MDB_SUCCESS) return rc;
+    kx_db_view_copy(&view, &kf);
+    data->mv_size = kx_db_encode_file(&kf, id, dirlen, buf);
+    data->mv_data = buf;
+    return MDB_SUCCESS;
+}
+
+/* Parse a record and put its interned directory, if any, back in front
+ * of the path. path holds PATH_MAX bytes and must outlive the view. */
+static int view_record(kxlmdb *db, MDB_txn *txn, const MDB_val *key,
+                       const MDB_val *data, kxfileview *view, char *path) {
+    MDB_val dkey, dir;
+    uint64_t id;
+
+    if (kx_db_view_file(key->mv_data, key->mv_size, data->mv_data, data->mv_size,
+                        view) == -1)
+        return -1;
+    if (view->dirid == 0) return 0;
+
+    id = view->dirid;
+    dkey.mv_size = sizeof(id);
+    dkey.mv_data = &id;
+    if (mdb_get(txn, db->dirs, &dkey, &dir) != MDB_SUCCESS ||
+        dir.mv_size + view->fullnamelen >= PATH_MAX)
+        return -1;
+    memcpy(path, dir.mv_data, dir.mv_size);
+    memcpy(path + dir.mv_size, view->fullname, view->fullnamelen);
+    view->fullname = path;
+    view->fullnamelen += dir.mv_size;
+    view->dirid = 0;
+    return 0;
+}
+
+static int decode_record(kxlmdb *db, MDB_txn *txn, const MDB_val *key,
+                         const MDB_val *data, kxfile *kf) {
+    kxfileview view;
+    char path[PATH_MAX];
+
+    if (view_record(db, txn, key, data, &view, path) == -1)
+        return -1;
+    kx_db_view_copy(&view, kf);
+    return 0;
+}
+
+/* Build the indexes of catalogs written before they existed */
+static int reindex_files(kxlmdb *db, MDB_txn *txn) {
+    int rc;
+    MDB_stat st, pst;
+    MDB_cursor *cursor;
+    MDB_val key, data;
+
+    if ((rc = mdb_stat(txn, db->dbi, &st)) != MDB_SUCCESS) return rc;
+    if ((rc = mdb_stat(txn, db->paths, &pst)) != MDB_SUCCESS) return rc;
+    if (st.ms_entries == 0 || pst.ms_entries != 0) return MDB_SUCCESS;
+
+    rc = mdb_cursor_open(txn, db->dbi, &cursor);
+    if (rc != MDB_SUCCESS) return rc;
+    while ((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == MDB_SUCCESS) {
+        kxfile kf;
+
+        if (decode_record(db, txn, &key, &data, &kf) == -1)
+            continue;
+        rc = index_file(db, txn, &kf, 0);
+        if (rc != MDB_SUCCESS) break;
+    }
+    mdb_cursor_close(cursor);
+    return rc == MDB_NOTFOUND ? MDB_SUCCESS : rc;
+}
+
+static inline uint64_t bloom_uuid(uint64_t uuid) {
+    return XXH3_64bits_withSeed(&uuid, sizeof(uuid), KXBLOOMUUID);
+}
+
+static inline uint64_t bloom_path(const char *path, size_t len) {
+    return XXH3_64bits_withSeed(path, len, KXBLOOMPATH);
+}
+
+static void bloom_note_hash(kxlmdb *db, bloom *b, uint64_t hash) {
+    bloom *next = __atomic_load_n(&db->bloomnext, __ATOMIC_SEQ_CST);
+
+    bloom_add(b, hash);
+    if (next) bloom_add(next, hash);
+}
+
+/* Called inside the write transaction storing the record, the filter
+ * cannot be swapped meanwhile. A filter being built gets the key too. */
+static void bloom_note(kxlmdb *db, const kxfile *kf) {
+    bloom *b = __atomic_load_n(&db->bloom, __ATOMIC_ACQUIRE);
+
+    if (b == NULL) return;
+    bloom_note_hash(db, b, bloom_uuid(kf->uuid));
+    if (kf->fullname[0])
+        bloom_note_hash(db, b, bloom_path(kf->fullname, strlen(kf->fullname)));
+    /* Outgrown, have the background thread size a new one */
+    if (__atomic_load_n(&b->count, __ATOMIC_RELAXED) > b->capacity)
+        pthread_cond_signal(&db->bgcond);
+}
+
+/* Same for records written without put_record(), straight from the map */
+static void bloom_note_record(kxlmdb *db, const MDB_val *key, const MDB_val *data) {
+    bloom *b = __atomic_load_n(&db->bloom, __ATOMIC_ACQUIRE);
+    kxfileview view;
+
+    if (b == NULL || kx_db_view_file(key->mv_data, key->mv_size, data->mv_data,
+                                     data->mv_size, &view) == -1)
+        return;
+    bloom_note_hash(db, b, bloom_uuid(view.uuid));
+    if (view.fullnamelen)
+        bloom_note_hash(db, b, bloom_path(view.fullname, view.fullnamelen));
+    if (__atomic_load_n(&b->count, __ATOMIC_RELAXED) > b->capacity)
+        pthread_cond_signal(&db->bgcond);
+}
+
+/* The filter still reflects the catalog after our own commit only if it
+ * did right before it, any other process writing in between leaves it
+ * stale until the next rebuild. */
+static void bloom_commit(kxlmdb *db, size_t txnid) {
+    size_t prev = txnid - 1;
+
+    __atomic_compare_exchange_n(&db->bloomtxn, &prev, txnid, 0,
+                                __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+/* (Re)build the filter into a new one from a scan in a read transaction,
+ * lookups keep using the current filter meanwhile and writers of this
+ * process note their keys into both. Two short write transactions, only
+ * begun and aborted, bracket the scan: while one is open no process can
+ * commit, so the commits in between are known exactly. When they were
+ * all ours the new filter reflects the catalog, otherwise it is swapped
+ * in as stale and the background thread tries again later. */
+static int bloom_build(kxlmdb *db) {
+    int rc;
+    MDB_txn *txn = NULL, *rtxn = NULL;
+    MDB_cursor *cursor;
+    MDB_val key, data;
+    MDB_stat st;
+    kxfileview view;
+    char path[PATH_MAX];
+    bloom *b = NULL, *old;
+    size_t start, end, own, need;
+
+    pthread_mutex_lock(&db->bloomlock);
+    pthread_rwlock_rdlock(&db->maplock);
+    __atomic_add_fetch(&db->longreads, 1, __ATOMIC_RELEASE);
+    rc = mdb_txn_begin(db->env, NULL, MDB_RDONLY, &rtxn);
+    if (rc != MDB_SUCCESS) goto unlock;
+    rc = mdb_stat(rtxn, db->dbi, &st);
+    mdb_txn_abort(rtxn);
+    rtxn = NULL;
+    if (rc != MDB_SUCCESS) goto unlock;
+
+    need = st.ms_entries * 2;
+    b = bloom_create(need * 2 > KXBLOOMMIN ? need * 2 : KXBLOOMMIN);
+    if (b == NULL) {
+        rc = ENOMEM;
+        goto unlock;
+    }
+    __atomic_store_n(&db->bloomnext, b, __ATOMIC_SEQ_CST);
+
+    /* Writers that noted their keys before the new filter was published
+     * have committed once we hold the writer lock */
+    rc = mdb_txn_begin(db->env, NULL, 0, &txn);
+    if (rc != MDB_SUCCESS) goto unlock;
+    start = mdb_txn_id(txn) - 1;
+    own = __atomic_load_n(&db->bloomcommits, __ATOMIC_ACQUIRE);
+    rc = mdb_txn_begin(db->env, NULL, MDB_RDONLY, &rtxn);
+    mdb_txn_abort(txn);
+    txn = NULL;
+    if (rc != MDB_SUCCESS) goto unlock;
+
+    rc = mdb_cursor_open(rtxn, db->dbi, &cursor);
+    if (rc == MDB_SUCCESS) {
+        rc = mdb_cursor_get(cursor, &key, &data, MDB_FIRST);
+        while (rc == MDB_SUCCESS) {
+            if (view_record(db, rtxn, &key, &data, &view, path) == 0) {
+                bloom_add(b, bloom_uuid(view.uuid));
+                if (view.fullnamelen)
+                    bloom_add(b, bloom_path(view.fullname, view.fullnamelen));
+            }
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+        }
+        mdb_cursor_close(cursor);
+    }
+    mdb_txn_abort(rtxn);
+    rtxn = NULL;
+    if (rc != MDB_NOTFOUND) goto unlock;
+
+    rc = mdb_txn_begin(db->env, NULL, 0, &txn);
+    if (rc != MDB_SUCCESS) goto unlock;
+    end = mdb_txn_id(txn) - 1;
+    own = __atomic_load_n(&db->bloomcommits, __ATOMIC_ACQUIRE) - own;
+
+    /* No writer runs, lookups fall back to the B-tree until the
+     * sequence is even again */
+    __atomic_add_fetch(&db->bloomseq, 1, __ATOMIC_ACQ_REL);
+    old = __atomic_exchange_n(&db->bloom, b, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&db->bloomnext, NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&db->bloomtxn, end - start == own ? end : 0, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&db->bloomseq, 1, __ATOMIC_RELEASE);
+    mdb_txn_abort(txn);
+    __atomic_sub_fetch(&db->longreads, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&db->maplock);
+
+    /* Lookups that picked the old filter up are short */
+    while (__atomic_load_n(&db->bloomreaders, __ATOMIC_SEQ_CST))
+        sched_yield();
+    bloom_free(old);
+    db->bloombuilt = kx_mstime();
+    pthread_mutex_unlock(&db->bloomlock);
+    return 0;
+
+unlock:
+    if (rtxn) mdb_txn_abort(rtxn);
+    /* Writers may be noting into the new filter, wait them out. If
+     * that fails it is left behind rather than freed under them. */
+    __atomic_store_n(&db->bloomnext, NULL, __ATOMIC_SEQ_CST);
+    if (b && (txn || mdb_txn_begin(db->env, NULL, 0, &txn) == MDB_SUCCESS))
+        mdb_txn_abort(txn);
+    else
+        b = NULL;
+    __atomic_sub_fetch(&db->longreads, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&db->maplock);
+    if (b) bloom_free(b);
+    __atomic_store_n(&db->bloomtxn, 0, __ATOMIC_RELEASE);
+    db->bloombuilt = kx_mstime();
+    pthread_mutex_unlock(&db->bloomlock);
+    fprintf(stderr, "Unable to build the catalog filter: %s\n", mdb_strerror(rc));
+    return -1;
+}
+
+/* Fill a saved filter header for the environment as it is now */
+static int bloom_snap_header(kxlmdb *db, kxbloomsnap *h) {
+    MDB_envinfo info;
+    mdb_filehandle_t fd;
+    struct stat st;
+
+    if (mdb_env_get_fd(db->env, &fd) != MDB_SUCCESS || fstat(fd, &st) == -1)
+        return -1;
+    mdb_env_info(db->env, &info);
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, KXBLOOMMAGIC, sizeof(h->magic));
+    h->txnid = info.me_last_txnid;
+    h->dev = st.st_dev;
+    h->ino = st.st_ino;
+    return 0;
+}
+
+/* Map the filter saved by the last close instead of scanning every
+ * record, when nothing was committed since. Its pages are only read
+ * in as lookups touch them. */
+static int bloom_load(kxlmdb *db) {
+    char path[PATH_MAX];
+    kxbloomsnap h, cur;
+    struct stat st;
+    bloom *b;
+    int fd, ret = -1;
+
+    snprintf(path, sizeof(path), "%s/%s", db->base.dbpath, KXBLOOMSNAP);
+    fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    if (read(fd, &h, sizeof(h)) != sizeof(h) || fstat(fd, &st) == -1 ||
+        bloom_snap_header(db, &cur) == -1)
+        goto out;
+    if (memcmp(h.magic, cur.magic, sizeof(h.magic)) != 0 ||
+        h.check != XXH3_64bits(&h, offsetof(kxbloomsnap, check)) ||
+        h.txnid != cur.txnid || h.dev != cur.dev || h.ino != cur.ino ||
+        (uint64_t)st.st_size != KXSNAPALIGN + h.nblocks * BLOOM_BLOCKSIZE)
+        goto out;
+
+    b = bloom_map(fd, KXSNAPALIGN, h.nblocks, h.capacity, h.count);
+    if (b == NULL) goto out;
+    db->bloom = b;
+    db->bloomtxn = h.txnid;
+    ret = 0;
+out:
+    close(fd);
+    return ret;
+}
+
+/* Keep a filter that reflects the last commit for the next open. Called
+ * by close_env() once the background thread is gone. The copy is synced
+ * before it replaces the old one, a torn filter would hide records. */
+static void bloom_save(kxlmdb *db) {
+    char path[PATH_MAX], tmp[PATH_MAX + 16];
+    kxbloomsnap h;
+    bloom *b = db->bloom;
+    size_t bytes;
+    FILE *fp;
+    int ok;
+
+    snprintf(path, sizeof(path), "%s/%s", db->base.dbpath, KXBLOOMSNAP);
+    if (b == NULL || (db->bloomseq & 1) || db->bloomtxn == 0 ||
+        bloom_snap_header(db, &h) == -1 || h.txnid != db->bloomtxn) {
+        unlink(path);
+        return;
+    }
+    h.nblocks = b->nblocks;
+    h.capacity = b->capacity;
+    h.count = b->count;
+    h.check = XXH3_64bits(&h, offsetof(kxbloomsnap, check));
+    bytes = b->nblocks * BLOOM_BLOCKSIZE;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    fp = fopen(tmp, "w");
+    if (fp == NULL) return;
+    ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+         fseeko(fp, KXSNAPALIGN, SEEK_SET) == 0 &&
+         fwrite(b->blocks, 1, bytes, fp) == bytes &&
+         fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0) ok = 0;
+    if (!ok || rename(tmp, path) == -1) {
+        fprintf(stderr, "Unable to save the catalog filter to %s\n", path);
+        unlink(tmp);
+    }
+}
+
+/* The filter holds more keys than it was sized for */
+static int bloom_full(kxlmdb *db) {
+    bloom *b;
+    int full = 0;
+
+    __atomic_add_fetch(&db->bloomreaders, 1, __ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&db->bloom, __ATOMIC_SEQ_CST);
+    if (b)
+        full = __atomic_load_n(&b->count, __ATOMIC_RELAXED) > b->capacity;
+    __atomic_sub_fetch(&db->bloomreaders, 1, __ATOMIC_RELEASE);
+    return full;
+}
+
+/* Called by the background thread. Rebuilds the filter once it holds
+ * more keys than it was sized for and false positives climb, or once
+ * other processes wrote the catalog, at most every KXBLOOMEVERY. */
+static void bloom_refresh(kxlmdb *db) {
+    MDB_envinfo info;
+
+    if (__atomic_load_n(&db->bloom, __ATOMIC_ACQUIRE) == NULL) return;
+    pthread_rwlock_rdlock(&db->maplock);
+    mdb_env_info(db->env, &info);
+    pthread_rwlock_unlock(&db->maplock);
+    if (bloom_full(db)) {
+        bloom_build(db);
+    } else if (info.me_last_txnid != __atomic_load_n(&db->bloomtxn, __ATOMIC_ACQUIRE) &&
+               kx_mstime() - db->bloombuilt >= KXBLOOMEVERY) {
+        /* Other processes keep writing, do not rescan for each sweep */
+        bloom_build(db);
+    }
+}
+
+static int file_known(kxlmdb *db, uint64_t uuid, const char *path) {
+    MDB_envinfo info;
+    unsigned long seq;
+    size_t txnid;
+    bloom *b;
+    int maybe = 1;
+
+    /* Keeps a swapped out filter from being freed while we read it */
+    __atomic_add_fetch(&db->bloomreaders, 1, __ATOMIC_SEQ_CST);
+    seq = __atomic_load_n(&db->bloomseq, __ATOMIC_ACQUIRE);
+    b = __atomic_load_n(&db->bloom, __ATOMIC_SEQ_CST);
+    if (b == NULL || (seq & 1)) goto out;
+    txnid = __atomic_load_n(&db->bloomtxn, __ATOMIC_ACQUIRE);
+
+    /* Only the meta page is read, the map must not move meanwhile */
+    pthread_rwlock_rdlock(&db->maplock);
+    mdb_env_info(db->env, &info);
+    pthread_rwlock_unlock(&db->maplock);
+    if (txnid == 0 || info.me_last_txnid != txnid) goto out;
+
+    if (uuid)
+        maybe = bloom_maybe(b, bloom_uuid(uuid));
+    if (maybe && path)
+        maybe = bloom_maybe(b, bloom_path(path, strlen(path)));
+
+    /* A swap meanwhile may pair this filter with the wrong txnid */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&db->bloomseq, __ATOMIC_RELAXED) != seq) maybe = 1;
+out:
+    __atomic_sub_fetch(&db->bloomreaders, 1, __ATOMIC_RELEASE);
+    return maybe;
+}
+
+/* Look up uuid in the catalog and append the record to files if it
+ * passes every filter of the query. */
+static void query_add(kxlmdb *db, MDB_txn *txn, const kxdbquery *q,
+                      const void *uuid, list *files) {
+    MDB_val key, data;
+    kxfile *kf;
+    uint64_t id;
+
+    memcpy(&id, uuid, sizeof(id));
+    key.mv_size = sizeof(id);
+    key.mv_data = &id;
+    if (mdb_get(txn, db->dbi, &key, &data) != MDB_SUCCESS)
+        return;
+    kf = zmalloc(sizeof(*kf));
+    if (kf == NULL) return;
+    if (decode_record(db, txn, &key, &data, kf) == -1 || !kx_db_match_query(q, kf)) {
+        zfree(kf);
+        return;
+    }
+    listAddNodeTail(files, kf);
+}
+
+/* Answer a query from the most selective index: the path, then the
+ * owner, then the time range. Without any filter it is a full scan.
+ * There is always an owner filter once a user is set. */
+static int query_files(kxlmdb *db, const kxdbquery *query, list **outlist) {
+    int rc = MDB_SUCCESS;
+    kxdbquery scoped = *query;
+    const kxdbquery *q = &scoped;
+    MDB_txn *txn;
+    MDB_cursor *cursor = NULL;
+    MDB_val key, data;
+    unsigned char buf[1 + sizeof(XXH128_hash_t)];
+    list *files;
+
+    /* Queries see the current user's files unless another owner is named */
+    if (scoped.owner == NULL && db->base.user[0])
+        scoped.owner = db->base.user;
+
+    *outlist = NULL;
+    files = listCreate();
+    if (files == NULL) return -1;
+    listSetFreeMethod(files, (void (*)(void*))kx_free_file);
+
+    if (q->path && !file_known(db, 0, q->path)) {
+        *outlist = files;
+        return 0;
+    }
+
+    txn = rtxn_begin(db);
+    if (txn == NULL) {
+        listRelease(files);
+        return -1;
+    }
+
+    if (q->path) {
+        path_key(q->path, &key, buf);
+        rc = mdb_get(txn, db->paths, &key, &data);
+        if (rc == MDB_SUCCESS)
+            query_add(db, txn, q, data.mv_data, files);
+    } else if (q->owner) {
+        key.mv_size = strlen(q->owner);
+        key.mv_data = (void *)q->owner;
+        rc = mdb_cursor_open(txn, db->users, &cursor);
+        if (rc == MDB_SUCCESS)
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_SET);
+        while (rc == MDB_SUCCESS) {
+            query_add(db, txn, q, data.mv_data, files);
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT_DUP);
+        }
+    } else if (q->since || q->until) {
+        uint64_t since = q->since;
+        key.mv_size = sizeof(since);
+        key.mv_data = &since;
+        rc = mdb_cursor_open(txn, db->times, &cursor);
+        if (rc == MDB_SUCCESS)
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+        while (rc == MDB_SUCCESS) {
+            uint64_t t;
+            memcpy(&t, key.mv_data, sizeof(t));
+            if (q->until && t > q->until)
+                break;
+            query_add(db, txn, q, data.mv_data, files);
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+        }
+    } else {
+        rc = mdb_cursor_open(txn, db->dbi, &cursor);
+        if (rc == MDB_SUCCESS)
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_FIRST);
+        while (rc == MDB_SUCCESS) {
+            kxfile *kf = zmalloc(sizeof(*kf));
+            if (kf && decode_record(db, txn, &key, &data, kf) == 0)
+                listAddNodeTail(files, kf);
+            else if (kf)
+                zfree(kf);
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+        }
+    }
+    if (cursor) mdb_cursor_close(cursor);
+    rtxn_end(db, txn);
+
+    if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND) {
+        fprintf(stderr, "LMDB error: %s\n", mdb_strerror(rc));
+        listRelease(files);
+        return -1;
+    }
+    *outlist = files;
+    return 0;
+}
+
+/* Open (creating them if needed) every named database once, the handles
+ * stay valid for the life of the environment. */
+static int open_dbis(kxlmdb *db) {
+    int rc;
+    MDB_txn *txn;
+
+    rc = mdb_txn_begin(db->env, NULL, 0, &txn);
+    if (rc != MDB_SUCCESS) goto err;
+
+    rc = mdb_dbi_open(txn, db->base.dbname, MDB_CREATE|MDB_INTEGERKEY, &db->dbi);
+    if (rc != MDB_SUCCESS) goto abort;
+    rc = mdb_dbi_open(txn, KXCHUNKSDB, MDB_CREATE, &db->chunks);
+    if (rc != MDB_SUCCESS) goto abort;
+    rc = mdb_dbi_open(txn, KXFPCACHEDB, MDB_CREATE, &db->fpcache);
+    if (rc != MDB_SUCCESS) goto abort;
+    rc = mdb_dbi_open(txn, KXPATHSDB, MDB_CREATE, &db->paths);
+    if (rc != MDB_SUCCESS) goto abort;
+    rc = mdb_dbi_open(txn, KXUSERSDB, MDB_CREATE|MDB_DUPSORT|MDB_DUPFIXED|MDB_INTEGERDUP,
+                      &db->users);
+    if (rc != MDB_SUCCESS) goto abort;
+    rc = mdb_dbi_open(txn, KXTIMESDB, 
+                      MDB_CREATE|MDB_INTEGERKEY|MDB_DUPSORT|MDB_DUPFIXED|MDB_INTEGERDUP,
+                      &db->times);
+    if (rc != MDB_SUCCESS) goto abort;
+    rc = mdb_dbi_open(txn, KXDIRSDB, MDB_CREATE|MDB_INTEGERKEY, &db->dirs);
+    if (rc != MDB_SUCCESS) goto abort;
+    rc = mdb_dbi_open(txn, KXDIRIDSDB, MDB_CREATE, &db->dirids);
+    if (rc != MDB_SUCCESS) goto abort;
+    rc = mdb_dbi_open(txn, KXEXPIRYDB,
+                      MDB_CREATE|MDB_INTEGERKEY|MDB_DUPSORT|MDB_DUPFIXED|MDB_INTEGERDUP,
+                      &db->expiry);
+    if (rc != MDB_SUCCESS) goto abort;
+    rc = mdb_dbi_open(txn, KXFPEXPIRYDB,
+                      MDB_CREATE|MDB_INTEGERKEY|MDB_DUPSORT|MDB_DUPFIXED,
+                      &db->fpexpiry);
+    if (rc != MDB_SUCCESS) goto abort;
+    rc = drop_fingerprints(db, txn);
+    if (rc != MDB_SUCCESS) goto abort;
+    rc = migrate_files(db, txn);
+    if (rc != MDB_SUCCESS) goto abort;
+    rc = reindex_files(db, txn);
+    if (rc != MDB_SUCCESS) goto abort;
+
+    rc = mdb_txn_commit(txn);
+    if (rc != MDB_SUCCESS) goto err;
+    return 0;
+abort:
+    mdb_txn_abort(txn);
+err:
+    /* Migrating an old catalog can need more room than it had */
+    if (rc == MDB_MAP_FULL && grow_map(db, db->max_mapsize) == 0)
+        return open_dbis(db);
+    fprintf(stderr, "mdb_dbi_open failed, error %d %s\n", rc, mdb_strerror(rc));
+    return -1;
+}
+
+/* Cached fingerprints keyed by another kxfpkey layout can never be hit
+ * and their size would break the fixed size expiry dups, empty both
+ * databases. They only hold a cache. */
+static int drop_fingerprints(kxlmdb *db, MDB_txn *txn) {
+    MDB_cursor *cursor;
+    MDB_val key, data;
+    int rc;
+
+    rc = mdb_cursor_open(txn, db->fpcache, &cursor);
+    if (rc != MDB_SUCCESS) return rc;
+    rc = mdb_cursor_get(cursor, &key, &data, MDB_FIRST);
+    mdb_cursor_close(cursor);
+    if (rc == MDB_NOTFOUND) return MDB_SUCCESS;
+    if (rc != MDB_SUCCESS || key.mv_size == sizeof(kxfpkey)) return rc;
+    rc = mdb_drop(txn, db->fpcache, 0);
+    if (rc == MDB_SUCCESS) rc = mdb_drop(txn, db->fpexpiry, 0);
+    return rc;
+}
+
+/* Move the records of one legacy database into the shared one. A
+ * "<user>.files" database has integer keys, a "<user>" one keys of the
+ * form "<user>:<uuid>", anything else is left alone. Records that do not
+ * decode stay where they are, the database is only dropped once empty. */
+static int migrate_db(kxlmdb *db, MDB_txn *txn, const char *name, const char *owner,
+                      int intkey) {
+    int rc;
+    MDB_dbi old;
+    MDB_cursor *cursor;
+    MDB_val key, data;
+    unsigned char rec[KX_DB_RECMAX];
+    size_t moved = 0, failed = 0, olen = strlen(owner);
+    unsigned int flags;
+
+    rc = mdb_dbi_open(txn, name, 0, &old);
+    if (rc != MDB_SUCCESS) return rc;
+    rc = mdb_dbi_flags(txn, old, &flags);
+    if (rc != MDB_SUCCESS) return rc;
+    if (!!(flags & MDB_INTEGERKEY) != intkey || (flags & MDB_DUPSORT))
+        return MDB_INCOMPATIBLE;
+
+    rc = mdb_cursor_open(txn, old, &cursor);
+    if (rc != MDB_SUCCESS) return rc;
+    rc = mdb_cursor_get(cursor, &key, &data, MDB_FIRST);
+    /* The first key tells a legacy catalog from another program's data */
+    if (rc == MDB_SUCCESS && !intkey &&
+        (key.mv_size <= olen || memcmp(key.mv_data, owner, olen) != 0 ||
+         ((char *)key.mv_data)[olen] != ':')) {
+        mdb_cursor_close(cursor);
+        return MDB_INCOMPATIBLE;
+    }
+    for (; rc == MDB_SUCCESS; rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) {
+        kxfile kf;
+        MDB_val nkey, ndata;
+
+        if (kx_db_decode_file(key.mv_data, key.mv_size, data.mv_data, data.mv_size, &kf) == -1) {
+            failed++;
+            continue;
+        }
+        if (kf.owner[0] == '\0')
+            strncpy(kf.owner, owner, sizeof(kf.owner)-1);
+        nkey.mv_size = sizeof(kf.uuid);
+        nkey.mv_data = &kf.uuid;
+        ndata.mv_size = kx_db_encode_file(&kf, 0, 0, rec);
+        ndata.mv_data = rec;
+        rc = put_record(db, txn, &nkey, &ndata);
+        if (rc == MDB_SUCCESS) rc = mdb_cursor_del(cursor, 0);
+        if (rc != MDB_SUCCESS) break;
+        moved++;
+    }
+    mdb_cursor_close(cursor);
+    if (rc != MDB_NOTFOUND) return rc;
+
+    rc = failed ? MDB_SUCCESS : mdb_drop(txn, old, 1);
+    if (rc == MDB_SUCCESS && moved)
+        printf("Migrated %zu catalog records of %s\n", moved, owner);
+    if (failed)
+        fprintf(stderr, "Kept %zu catalog records of %s that could not be decoded "
+                "in database %s\n", failed, owner, name);
+    return rc;
+}
+
+/* Older catalogs kept the records of every user in a database of its
+ * own, named "<user>" and later "<user>.files". Named databases of that
+ * shape are moved into the shared files database and dropped, others,
+ * such as those a newer binary adds, are not touched. */
+static int migrate_files(kxlmdb *db, MDB_txn *txn) {
+    static const char *ours[] = {KXCHUNKSDB, KXFPCACHEDB, KXPATHSDB, KXUSERSDB, KXTIMESDB,
+                                 KXDIRSDB, KXDIRIDSDB, KXEXPIRYDB, KXFPEXPIRYDB, NULL};
+    int rc, i;
+    MDB_dbi main;
+    MDB_cursor *cursor;
+    MDB_val key, data;
+    list *names;
+    listIter li;
+    listNode *ln;
+
+    rc = mdb_dbi_open(txn, NULL, 0, &main);
+    if (rc != MDB_SUCCESS) return rc;
+    names = listCreate();
+    if (names == NULL) return ENOMEM;
+    listSetFreeMethod(names, zfree);
+
+    /* Collect first, dropping a database edits the main one */
+    rc = mdb_cursor_open(txn, main, &cursor);
+    if (rc != MDB_SUCCESS) goto out;
+    while ((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == MDB_SUCCESS) {
+        char *name;
+
+        if (key.mv_size == 0 || key.mv_size >= sizeof(db->base.user) + sizeof(KXLEGACYFILES))
+            continue;
+        name = zmalloc(key.mv_size + 1);
+        memcpy(name, key.mv_data, key.mv_size);
+        name[key.mv_size] = '\0';
+        for (i = 0; ours[i]; i++)
+            if (strcmp(name, ours[i]) == 0) break;
+        if (ours[i] || strcmp(name, db->base.dbname) == 0 || memchr(key.mv_data, '\0', key.mv_size))
+            zfree(name);
+        else
+            listAddNodeTail(names, name);
+    }
+    mdb_cursor_close(cursor);
+    if (rc != MDB_NOTFOUND) goto out;
+    rc = MDB_SUCCESS;
+
+    listRewind(names, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        char owner[sizeof(db->base.user)];
+        const char *name = listNodeValue(ln);
+        size_t len = strlen(name), slen = strlen(KXLEGACYFILES);
+
+        int intkey = 0;
+
+        if (len > slen && strcmp(name + len - slen, KXLEGACYFILES) == 0) {
+            len -= slen;
+            intkey = 1;
+        }
+        if (len >= sizeof(owner) || memchr(name, '.', len) || memchr(name, ':', len))
+            continue;
+        memcpy(owner, name, len);
+        owner[len] = '\0';
+        rc = migrate_db(db, txn, name, owner, intkey);
+        if (rc == MDB_INCOMPATIBLE) rc = MDB_SUCCESS;   /* Not a catalog */
+        if (rc != MDB_SUCCESS) break;
+    }
+out:
+    listRelease(names);
+    return rc;
+}
+
+/* Grow the map after MDB_MAP_FULL, doubling it, or adopt the size
+ * another process set after MDB_MAP_RESIZED (seen = 0). seen is the size
+ * the failed transaction ran with, if the map has grown since then some
+ * other thread already did the work. Every transaction of this process
+ * holds maplock shared, so holding it exclusively means none is active,
+ * which mdb_env_set_mapsize() requires. A running backup or filter scan
+ * holds it throughout, the resize then waits for it instead of failing
+ * the write. */
+static int grow_map(kxlmdb *db, uint64_t seen) {
+    int rc = MDB_SUCCESS;
+    struct timespec ts;
+    MDB_envinfo info;
+    uint64_t size;
+
+    kx_deadline(&ts, KXMAPWAIT);
+    while (pthread_rwlock_timedwrlock(&db->maplock, &ts) != 0) {
+        if (__atomic_load_n(&db->longreads, __ATOMIC_ACQUIRE) == 0) {
+            fprintf(stderr, "Catalog resize timed out waiting for readers\n");
+            return -1;
+        }
+        kx_deadline(&ts, KXMAPWAIT);
+    }
+
+    mdb_env_info(db->env, &info);
+    if (seen == 0) {
+        rc = mdb_env_set_mapsize(db->env, 0);
+    } else if (info.me_mapsize <= seen) {
+        if (info.me_mapsize >= KXMAPLIMIT) {
+            rc = MDB_MAP_FULL;
+        } else {
+            size = info.me_mapsize * 2;
+            if (size > KXMAPLIMIT) size = KXMAPLIMIT;
+            rc = mdb_env_set_mapsize(db->env, size);
+        }
+    }
+    if (rc == MDB_SUCCESS) {
+        mdb_env_info(db->env, &info);
+        db->max_mapsize = info.me_mapsize;
+    }
+    pthread_rwlock_unlock(&db->maplock);
+
+    if (rc != MDB_SUCCESS) {
+        fprintf(stderr, "Catalog resize failed: %s\n", mdb_strerror(rc));
+        return -1;
+    }
+    return 0;
+}
+
+/* Return the read transaction of the calling thread, renewed so it sees
+ * the latest commit. Each thread gets one on first use. The map lock is
+ * held shared until rtxn_end(). */
+static MDB_txn *rtxn_begin(kxlmdb *db) {
+    int rc;
+    kxrtxn *rt = pthread_getspecific(db->rtxnkey);
+
+    /* Lookups do not nest, a thread owns a single reader slot */
+    if (rt && rt->active) {
+        fprintf(stderr, "Error: nested LMDB read transaction\n");
+        return NULL;
+    }
+
+again:
+    pthread_rwlock_rdlock(&db->maplock);
+    if (rt == NULL) {
+        rt = zmalloc(sizeof(*rt));
+        if (rt == NULL) goto err;
+        rc = mdb_txn_begin(db->env, NULL, MDB_RDONLY, &rt->txn);
+        if (rc != MDB_SUCCESS) {
+            zfree(rt);
+            rt = NULL;
+            goto fail;
+        }
+        rt->db = db;
+        pthread_mutex_lock(&db->rtxnlock);
+        listAddNodeTail(db->rtxns, rt);
+        pthread_mutex_unlock(&db->rtxnlock);
+        pthread_setspecific(db->rtxnkey, rt);
+    } else {
+        rc = mdb_txn_renew(rt->txn);
+        if (rc != MDB_SUCCESS) goto fail;
+    }
+    rt->active = 1;
+    return rt->txn;
+fail:
+    pthread_rwlock_unlock(&db->maplock);
+    if (rc == MDB_MAP_RESIZED && grow_map(db, 0) == 0)
+        goto again;
+    fprintf(stderr, "Error: Failed to begin LMDB transaction (%s)\n", mdb_strerror(rc));
+    return NULL;
+err:
+    pthread_rwlock_unlock(&db->maplock);
+    return NULL;
+}
+
+/* Release the snapshot but keep the reader slot for the next lookup */
+static void rtxn_end(kxlmdb *db, MDB_txn *txn) {
+    kxrtxn *rt = pthread_getspecific(db->rtxnkey);
+
+    mdb_txn_reset(txn);
+    if (rt) rt->active = 0;
+    pthread_rwlock_unlock(&db->maplock);
+}
+
+/* Thread exit destructor of rtxnkey */
+static void rtxn_destroy(void *ptr) {
+    kxrtxn *rt = ptr;
+    listNode *ln;
+
+    pthread_mutex_lock(&rt->db->rtxnlock);
+    ln = listSearchKey(rt->db->rtxns, rt);
+    if (ln) listDelNode(rt->db->rtxns, ln);
+    pthread_mutex_unlock(&rt->db->rtxnlock);
+
+    mdb_txn_abort(rt->txn);
+    zfree(rt);
+}
+
+/* Entry points of kxdb_lmdb, the generic layer hands them the kxdb and
+ * kxdbbatch embedded at the start of kxlmdb and kxlmdbbatch. */
+static kxdb *lmdb_open(uint64_t size, const char *dbpath, const char *dbname,
+                       const kxdboptions *opts) {
+    kxlmdb *db = open_env(size, dbpath, dbname, opts);
+    return db ? &db->base : NULL;
+}
+
+static void lmdb_close(kxdb *db) {
+    close_env((kxlmdb *)db);
+}
+
+static int lmdb_put_file(kxdb *db, kxfile *file) {
+    return insert_file((kxlmdb *)db, file);
+}
+
+static int lmdb_get_file(kxdb *db, uint64_t uuid, kxfile **outfile) {
+    get_file((kxlmdb *)db, &uuid, outfile);
+    return 0;
+}
+
+static int lmdb_query(kxdb *db, const kxdbquery *q, list **outlist) {
+    return query_files((kxlmdb *)db, q, outlist);
+}
+
+static long lmdb_foreach(kxdb *db, kxdbiter *it, kxdbiterfn *fn, void *privdata) {
+    return foreach_file((kxlmdb *)db, it, fn, privdata);
+}
+
+static int lmdb_file_known(kxdb *db, uint64_t uuid, const char *path) {
+    return file_known((kxlmdb *)db, uuid, path);
+}
+
+static int lmdb_put_digests(kxdb *db, uint64_t uuid, kxtree *tree) {
+    return insert_digests((kxlmdb *)db, uuid, tree);
+}
+
+static int lmdb_get_digests(kxdb *db, uint64_t uuid, kxtree **outtree) {
+    return get_digests((kxlmdb *)db, uuid, outtree);
+}
+
+static int lmdb_put_fingerprint(kxdb *db, const kxfpkey *fp, uint64_t uuid) {
+    return insert_fingerprint((kxlmdb *)db, fp, uuid);
+}
+
+static int lmdb_get_fingerprint(kxdb *db, const kxfpkey *fp, uint64_t *uuid) {
+    return get_fingerprint((kxlmdb *)db, fp, uuid);
+}
+
+static kxdbbatch *lmdb_batch_begin(kxdb *db) {
+    kxlmdbbatch *batch = batch_begin((kxlmdb *)db);
+    return batch ? &batch->base : NULL;
+}
+
+static int lmdb_batch_put(kxdbbatch *batch, kxfile *file) {
+    return batch_put((kxlmdbbatch *)batch, file);
+}
+
+static int lmdb_batch_commit(kxdbbatch *batch) {
+    return batch_commit((kxlmdbbatch *)batch);
+}
+
+static void lmdb_batch_abort(kxdbbatch *batch) {
+    batch_abort((kxlmdbbatch *)batch);
+}
+
+static int lmdb_set_user(kxdb *db, const char *user) {
+    return set_user((kxlmdb *)db, user);
+}
+
+static int lmdb_group_commit_start(kxdb *db, size_t records, uint32_t delay) {
+    return group_commit_start((kxlmdb *)db, records, delay);
+}
+
+static void lmdb_group_commit_stop(kxdb *db) {
+    group_commit_stop((kxlmdb *)db);
+}
+
+static int lmdb_import(kxdb *db, kxdbsource *next, void *privdata, int replace,
+                       kxdbimport *st) {
+    return import_files((kxlmdb *)db, next, privdata, replace, st);
+}
+
+static int lmdb_backup(kxdb *db, int fd, kxdbbackup *st) {
+    return backup_env((kxlmdb *)db, fd, st);
+}
+
+static int lmdb_stat(kxdb *db, kxdbstat *st) {
+    return stat_env((kxlmdb *)db, st);
+}
+
+static int lmdb_readers(kxdb *db, kxdbreaderfn *func, void *ctx) {
+    return list_readers((kxlmdb *)db, func, ctx);
+}
+
+static int lmdb_prune(kxdb *db, uint64_t now, kxdbprune *st) {
+    return prune_env((kxlmdb *)db, now, st);
+}
+
+static int lmdb_expire(kxdb *db, uint64_t uuid, uint64_t when) {
+    return expire_file((kxlmdb *)db, uuid, when);
+}
+
+const kxdbtype kxdb_lmdb = {
+    .name = "lmdb",
+    .open = lmdb_open,
+    .close = lmdb_close,
+    .put_file = lmdb_put_file,
+    .get_file = lmdb_get_file,
+    .query = lmdb_query,
+    .foreach = lmdb_foreach,
+    .file_known = lmdb_file_known,
+    .put_digests = lmdb_put_digests,
+    .get_digests = lmdb_get_digests,
+    .put_fingerprint = lmdb_put_fingerprint,
+    .get_fingerprint = lmdb_get_fingerprint,
+    .batch_begin = lmdb_batch_begin,
+    .batch_put = lmdb_batch_put,
+    .batch_commit = lmdb_batch_commit,
+    .batch_abort = lmdb_batch_abort,
+    .set_user = lmdb_set_user,
+    .group_commit_start = lmdb_group_commit_start,
+    .group_commit_stop = lmdb_group_commit_stop,
+    .import = lmdb_import,
+    .backup = lmdb_backup,
+    .stat = lmdb_stat,
+    .readers = lmdb_readers,
+    .prune = lmdb_prune,
+    .expire = lmdb_expire,
+};
@@ -0,0 +1,683 @@
+/*
+ * Copyright (c) 2024-2024, yanruibinghxu@gmail.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "db.h"
+#include "zmalloc.h"
+#include "file.h"
+#include "util.h"
+#include "xxhash.h"
+
+/* Catalog kept in process memory, for tests, benchmarks and nodes that
+ * need no catalog once they exit. Readers take no lock: every table is
+ * an open addressing array of pointers to immutable entries, and writers,
+ * serialized by one mutex, publish a new entry or a new larger table with
+ * a release store. What a writer replaces is retired rather than freed,
+ * since a reader may still hold it, and is only freed by mem_close().
+ * Memory thus grows with every overwrite, replacing import and table
+ * doubling for the life of the catalog, which suits short lived and
+ * mostly appended catalogs. */
+
+#define MEMSLOTS        1024    /* Slots of a new table, a power of two */
+
+/* One key and its value, never modified once published */
+typedef struct mementry {
+    uint64_t hash;
+    size_t klen;
+    size_t dlen;
+    unsigned char kv[];    /* Key, then value */
+} mementry;
+
+typedef struct memtable {
+    size_t mask;           /* Slots minus one */
+    size_t used;           /* Slots taken, writers only */
+    mementry *slots[];
+} memtable;
+
+typedef struct kxmem {
+    kxdb base;             /* Must be first */
+    pthread_mutex_t lock;  /* Serializes writers */
+    memtable *files;       /* uuid -> encoded record */
+    memtable *paths;       /* Full path -> uuid */
+    memtable *chunks;      /* uuid -> tree hash chunk digests */
+    memtable *fpcache;     /* kxfpkey -> uuid */
+    char *user;            /* Current user, "" for none. Never written in
+                            * place, mem_set_user() publishes a new copy */
+    list *retired;         /* Replaced entries, tables and users */
+} kxmem;
+
+/* Batches keep private copies of their records until the commit */
+typedef struct kxmembatch {
+    kxdbbatch base;        /* Must be first */
+    list *files;
+} kxmembatch;
+
+#define ENTRY_DATA(e)   ((e)->kv + (e)->klen)
+
+static memtable *table_create(size_t slots) {
+    memtable *t = zcalloc(sizeof(*t) + slots * sizeof(mementry *));
+
+    if (t == NULL) return NULL;
+    t->mask = slots - 1;
+    return t;
+}
+
+/* Free a table and every entry it holds, nothing may reach it anymore */
+static void table_free(memtable *t) {
+    size_t i;
+
+    if (t == NULL) return;
+    for (i = 0; i <= t->mask; i++)
+        zfree(t->slots[i]);
+    zfree(t);
+}
+
+static void retire(list *retired, void *ptr) {
+    if (retired == NULL || listAddNodeTail(retired, ptr) == NULL)
+        zfree(ptr);
+}
+
+/* Valid until mem_close(), a replaced user is retired */
+static const char *current_user(kxmem *db) {
+    return __atomic_load_n(&db->user, __ATOMIC_ACQUIRE);
+}
+
+/* Lock free lookup, the entry stays valid until the catalog is closed */
+static mementry *table_get(memtable **tp, const void *key, size_t klen) {
+    memtable *t = __atomic_load_n(tp, __ATOMIC_ACQUIRE);
+    uint64_t hash = XXH3_64bits(key, klen);
+    size_t i = hash & t->mask;
+    mementry *e;
+
+    while ((e = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE)) != NULL) {
+        if (e->hash == hash && e->klen == klen && memcmp(e->kv, key, klen) == 0)
+            return e;
+        i = (i + 1) & t->mask;
+    }
+    return NULL;
+}
+
+/* Slot of key in t, or the empty slot it would take */
+static size_t table_slot(memtable *t, uint64_t hash, const void *key, size_t klen) {
+    size_t i = hash & t->mask;
+    mementry *e;
+
+    while ((e = t->slots[i]) != NULL) {
+        if (e->hash == hash && e->klen == klen && memcmp(e->kv, key, klen) == 0)
+            break;
+        i = (i + 1) & t->mask;
+    }
+    return i;
+}
+
+/* Double a table that is half full. Readers keep probing the old one
+ * until they load the new pointer, both hold the same entries. */
+static int table_grow(memtable **tp, list *retired) {
+    memtable *t = *tp, *nt;
+    size_t i;
+
+    if ((t->used + 1) * 2 <= t->mask + 1) return 0;
+    nt = table_create((t->mask + 1) * 2);
+    if (nt == NULL) return -1;
+    for (i = 0; i <= t->mask; i++) {
+        mementry *e = t->slots[i];
+        if (e == NULL) continue;
+        nt->slots[table_slot(nt, e->hash, e->kv, e->klen)] = e;
+    }
+    nt->used = t->used;
+    __atomic_store_n(tp, nt, __ATOMIC_RELEASE);
+    retire(retired, t);
+    return 0;
+}
+
+static mementry *entry_create(const void *key, size_t klen, const void *data, size_t dlen) {
+    mementry *e = zmalloc(sizeof(*e) + klen + dlen);
+
+    if (e == NULL) return NULL;
+    e->hash = XXH3_64bits(key, klen);
+    e->klen = klen;
+    e->dlen = dlen;
+    memcpy(e->kv, key, klen);
+    memcpy(e->kv + klen, data, dlen);
+    return e;
+}
+
+/* Insert or replace, called with the writer lock held. Returns 1 when
+ * an entry was replaced, 0 when added and -1 on error. */
+static int table_put(memtable **tp, list *retired, const void *key, size_t klen,
+                     const void *data, size_t dlen) {
+    mementry *e, *old;
+    memtable *t;
+    size_t i;
+
+    if (table_grow(tp, retired) == -1) return -1;
+    e = entry_create(key, klen, data, dlen);
+    if (e == NULL) return -1;
+
+    t = *tp;
+    i = table_slot(t, e->hash, key, klen);
+    old = t->slots[i];
+    __atomic_store_n(&t->slots[i], e, __ATOMIC_RELEASE);
+    if (old == NULL) {
+        t->used++;
+        return 0;
+    }
+    retire(retired, old);
+    return 1;
+}
+
+/* Swap in an empty table, the old one and its entries are retired */
+static int table_clear(memtable **tp, list *retired) {
+    memtable *t = *tp, *nt = table_create(MEMSLOTS);
+    size_t i;
+
+    if (nt == NULL) return -1;
+    __atomic_store_n(tp, nt, __ATOMIC_RELEASE);
+    for (i = 0; i <= t->mask; i++)
+        if (t->slots[i]) retire(retired, t->slots[i]);
+    retire(retired, t);
+    return 0;
+}
+
+static void mem_close(kxdb *base) {
+    kxmem *db = (kxmem *)base;
+
+    table_free(db->files);
+    table_free(db->paths);
+    table_free(db->chunks);
+    table_free(db->fpcache);
+    zfree(db->user);
+    if (db->retired) listRelease(db->retired);
+    pthread_mutex_destroy(&db->lock);
+    zfree(db);
+}
+
+static kxdb *mem_open(uint64_t size, const char *dbpath, const char *dbname,
+                      const kxdboptions *opts) {
+    kxmem *db = zcalloc(sizeof(*db));
+
+    (void)size;
+    (void)opts;
+    if (db == NULL) return NULL;
+    strncpy(db->base.dbpath, dbpath, sizeof(db->base.dbpath)-1);
+    strncpy(db->base.dbname, dbname, sizeof(db->base.dbname)-1);
+    pthread_mutex_init(&db->lock, NULL);
+    db->files = table_create(MEMSLOTS);
+    db->paths = table_create(MEMSLOTS);
+    db->chunks = table_create(MEMSLOTS);
+    db->fpcache = table_create(MEMSLOTS);
+    db->user = zstrdup("");
+    db->retired = listCreate();
+    if (!db->files || !db->paths || !db->chunks || !db->fpcache || !db->user ||
+        !db->retired) {
+        fprintf(stderr, "Out of memory creating the catalog\n");
+        mem_close(&db->base);
+        return NULL;
+    }
+    listSetFreeMethod(db->retired, zfree);
+    return &db->base;
+}
+
+/* Store a record and its path and chunk digests, called with the
+ * writer lock held. Returns 1 when the uuid was already in the catalog. */
+static int write_file(kxmem *db, const kxfile *file) {
+    unsigned char rec[KX_DB_RECMAX];
+    size_t len;
+    kxfile owned;
+    const char *user = current_user(db);
+    int ret;
+
+    /* Records without an owner belong to the current user */
+    if (file->owner[0] == '\0' && user[0]) {
+        memcpy(&owned, file, sizeof(owned));
+        strcpy(owned.owner, user);
+        file = &owned;
+    }
+    len = kx_db_encode_file(file, 0, 0, rec);
+
+    ret = table_put(&db->files, db->retired, &file->uuid, sizeof(file->uuid), rec, len);
+    if (ret == -1) return -1;
+    if (table_put(&db->paths, db->retired, file->fullname, strlen(file->fullname),
+                  &file->uuid, sizeof(file->uuid)) == -1)
+        return -1;
+    if (file->tree && table_put(&db->chunks, db->retired, &file->uuid, sizeof(file->uuid),
+                                file->tree, KXTREE_SIZE(file->tree->nchunks)) == -1)
+        return -1;
+    return ret;
+}
+
+static int mem_put_file(kxdb *base, kxfile *file) {
+    kxmem *db = (kxmem *)base;
+    int ret;
+
+    pthread_mutex_lock(&db->lock);
+    ret = write_file(db, file);
+    pthread_mutex_unlock(&db->lock);
+    return ret == -1 ? -1 : 0;
+}
+
+static int view_entry(const mementry *e, kxfileview *view) {
+    return kx_db_view_file(e->kv, e->klen, ENTRY_DATA(e), e->dlen, view);
+}
+
+/* Read and rewrite under the writer lock, a racing put is never undone */
+static int mem_expire(kxdb *base, uint64_t uuid, uint64_t when) {
+    kxmem *db = (kxmem *)base;
+    kxfileview view;
+    mementry *e;
+    kxfile *kf;
+    int ret = -1;
+
+    kf = zmalloc(sizeof(*kf));
+    if (kf == NULL) return -1;
+    pthread_mutex_lock(&db->lock);
+    e = table_get(&db->files, &uuid, sizeof(uuid));
+    if (e && view_entry(e, &view) == 0) {
+        kx_db_view_copy(&view, kf);
+        ret = 0;
+        if (kf->expires == 0 || kf->expires > when) {
+            kf->expires = when;
+            ret = write_file(db, kf) == -1 ? -1 : 0;
+        }
+    }
+    pthread_mutex_unlock(&db->lock);
+    zfree(kf);
+    return ret;
+}
+
+static int mem_get_file(kxdb *base, uint64_t uuid, kxfile **outfile) {
+    kxmem *db = (kxmem *)base;
+    mementry *e = table_get(&db->files, &uuid, sizeof(uuid));
+    kxfileview view;
+    kxfile *kf;
+
+    *outfile = NULL;
+    if (e == NULL) {
+        printf("Key not found: %lu\n", uuid);
+        return 0;
+    }
+    if (view_entry(e, &view) == -1) {
+        fprintf(stderr, "Corrupt catalog record: %lu\n", uuid);
+        return 0;
+    }
+    kf = zmalloc(sizeof(*kf));
+    if (kf) kx_db_view_copy(&view, kf);
+    *outfile = kf;
+    return 0;
+}
+
+/* Append the record of e to files if it passes every filter */
+static void query_add(const mementry *e, const kxdbquery *q, list *files) {
+    kxfileview view;
+    kxfile *kf;
+
+    if (view_entry(e, &view) == -1) return;
+    kf = zmalloc(sizeof(*kf));
+    if (kf == NULL) return;
+    kx_db_view_copy(&view, kf);
+    if (!kx_db_match_query(q, kf)) {
+        zfree(kf);
+        return;
+    }
+    listAddNodeTail(files, kf);
+}
+
+/* There are no secondary indexes, a path query is two lookups and any
+ * other query a scan of every record. */
+static int mem_query(kxdb *base, const kxdbquery *query, list **outlist) {
+    kxmem *db = (kxmem *)base;
+    kxdbquery scoped = *query;
+    const char *user = current_user(db);
+    memtable *t;
+    mementry *e;
+    list *files;
+    size_t i;
+
+    /* Queries see the current user's files unless another owner is named */
+    if (scoped.owner == NULL && user[0])
+        scoped.owner = user;
+
+    *outlist = NULL;
+    files = listCreate();
+    if (files == NULL) return -1;
+    listSetFreeMethod(files, (void (*)(void*))kx_free_file);
+
+    if (scoped.path) {
+        e = table_get(&db->paths, scoped.path, strlen(scoped.path));
+        if (e && (e = table_get(&db->files, ENTRY_DATA(e), sizeof(uint64_t))))
+            query_add(e, &scoped, files);
+    } else {
+        t = __atomic_load_n(&db->files, __ATOMIC_ACQUIRE);
+        for (i = 0; i <= t->mask; i++) {
+            e = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE);
+            if (e) query_add(e, &scoped, files);
+        }
+    }
+    *outlist = files;
+    return 0;
+}
+
+static int cmp_uuid(const void *a, const void *b) {
+    const kxfileview *x = a, *y = b;
+    return x->uuid < y->uuid ? -1 : x->uuid > y->uuid;
+}
+
+static int cmp_bytes(const char *a, size_t alen, const char *b, size_t blen) {
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    return c ? c : (alen > blen) - (alen < blen);
+}
+
+static int cmp_path(const void *a, const void *b) {
+    const kxfileview *x = a, *y = b;
+    return cmp_bytes(x->fullname, x->fullnamelen, y->fullname, y->fullnamelen);
+}
+
+/* Walks sort the records they see, in uuid order or in path order with
+ * a prefix, to page through them the way the LMDB backend does. */
+static long mem_foreach(kxdb *base, kxdbiter *it, kxdbiterfn *fn, void *privdata) {
+    kxmem *db = (kxmem *)base;
+    const char *user = current_user(db);
+    size_t plen = it->prefix ? strlen(it->prefix) : 0;
+    size_t ulen = it->everyone ? 0 : strlen(user);
+    char kind = it->prefix ? 'p' : 'u';
+    union {
+        uint64_t uuid;
+        unsigned char bytes[KX_DB_TOKEN_LEN / 2];
+    } buf;
+    size_t toklen = 0;
+    kxfileview *views;
+    memtable *t;
+    size_t i, n = 0, first = 0;
+    long count = 0;
+
+    it->next[0] = '\0';
+    if (it->token && it->token[0]) {
+        if (kx_db_token_decode(it->token, kind, buf.bytes, &toklen) == -1 ||
+            (!it->prefix && toklen != sizeof(uint64_t))) {
+            fprintf(stderr, "Invalid page token\n");
+            return -1;
+        }
+    }
+
+    t = __atomic_load_n(&db->files, __ATOMIC_ACQUIRE);
+    views = zmalloc((t->mask + 1) * sizeof(*views));
+    if (views == NULL) return -1;
+    for (i = 0; i <= t->mask; i++) {
+        mementry *e = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE);
+        kxfileview *v = &views[n];
+
+        if (e == NULL || view_entry(e, v) == -1) continue;
+        if (ulen && (v->ownerlen != ulen || memcmp(v->owner, user, ulen) != 0))
+            continue;
+        if (plen && (v->fullnamelen < plen || memcmp(v->fullname, it->prefix, plen) != 0))
+            continue;
+        n++;
+    }
+    qsort(views, n, sizeof(*views), it->prefix ? cmp_path : cmp_uuid);
+
+    /* Resume at the first record not before the token */
+    if (toklen) {
+        while (first < n && (it->prefix ?
+               cmp_bytes(views[first].fullname, views[first].fullnamelen,
+                         (const char *)buf.bytes, toklen) < 0 :
+               views[first].uuid < buf.uuid))
+            first++;
+    }
+
+    for (i = first; i < n; i++) {
+        if (it->limit && (size_t)count == it->limit) {
+            if (it->prefix)
+                kx_db_token_encode(it->next, kind, views[i].fullname, views[i].fullnamelen);
+            else
+                kx_db_token_encode(it->next, kind, &views[i].uuid, sizeof(views[i].uuid));
+            break;
+        }
+        count++;
+        if (fn(&views[i], privdata))
+            break;
+    }
+    zfree(views);
+    return count;
+}
+
+static int mem_file_known(kxdb *base, uint64_t uuid, const char *path) {
+    kxmem *db = (kxmem *)base;
+
+    if (uuid && table_get(&db->files, &uuid, sizeof(uuid)) == NULL)
+        return 0;
+    if (path && table_get(&db->paths, path, strlen(path)) == NULL)
+        return 0;
+    return 1;
+}
+
+static int mem_put_digests(kxdb *base, uint64_t uuid, kxtree *tree) {
+    kxmem *db = (kxmem *)base;
+    int ret;
+
+    pthread_mutex_lock(&db->lock);
+    ret = table_put(&db->chunks, db->retired, &uuid, sizeof(uuid),
+                    tree, KXTREE_SIZE(tree->nchunks));
+    pthread_mutex_unlock(&db->lock);
+    return ret == -1 ? -1 : 0;
+}
+
+static int mem_get_digests(kxdb *base, uint64_t uuid, kxtree **outtree) {
+    kxmem *db = (kxmem *)base;
+    mementry *e = table_get(&db->chunks, &uuid, sizeof(uuid));
+    kxtree *tree = NULL;
+
+    if (e && (tree = zmalloc(e->dlen)) != NULL)
+        memcpy(tree, ENTRY_DATA(e), e->dlen);
+    *outtree = tree;
+    return tree ? 0 : -1;
+}
+
+static int mem_put_fingerprint(kxdb *base, const kxfpkey *fp, uint64_t uuid) {
+    kxmem *db = (kxmem *)base;
+    int ret;
+
+    pthread_mutex_lock(&db->lock);
+    ret = table_put(&db->fpcache, db->retired, fp, sizeof(*fp), &uuid, sizeof(uuid));
+    pthread_mutex_unlock(&db->lock);
+    return ret == -1 ? -1 : 0;
+}
+
+static int mem_get_fingerprint(kxdb *base, const kxfpkey *fp, uint64_t *uuid) {
+    kxmem *db = (kxmem *)base;
+    mementry *e = table_get(&db->fpcache, fp, sizeof(*fp));
+
+    if (e == NULL) return -1;
+    memcpy(uuid, ENTRY_DATA(e), sizeof(*uuid));
+    return 0;
+}
+
+static void free_copy(void *ptr) {
+    kxfile *kf = ptr;
+
+    zfree(kf->tree);
+    zfree(kf);
+}
+
+static kxdbbatch *mem_batch_begin(kxdb *db) {
+    kxmembatch *batch = zmalloc(sizeof(*batch));
+
+    if (batch == NULL) return NULL;
+    batch->files = listCreate();
+    if (batch->files == NULL) {
+        zfree(batch);
+        return NULL;
+    }
+    listSetFreeMethod(batch->files, free_copy);
+    batch->base.db = db;
+    return &batch->base;
+}
+
+static int mem_batch_put(kxdbbatch *base, kxfile *file) {
+    kxmembatch *batch = (kxmembatch *)base;
+    kxfile *kf = zmalloc(sizeof(*kf));
+
+    if (kf == NULL) return -1;
+    memcpy(kf, file, sizeof(*kf));
+    kf->tree = NULL;
+    if (file->tree) {
+        size_t len = KXTREE_SIZE(file->tree->nchunks);
+        if ((kf->tree = zmalloc(len)) == NULL) {
+            zfree(kf);
+            return -1;
+        }
+        memcpy(kf->tree, file->tree, len);
+    }
+    if (listAddNodeTail(batch->files, kf) == NULL) {
+        free_copy(kf);
+        return -1;
+    }
+    return 0;
+}
+
+static void mem_batch_abort(kxdbbatch *base) {
+    kxmembatch *batch = (kxmembatch *)base;
+
+    listRelease(batch->files);
+    zfree(batch);
+}
+
+/* Readers may see part of a batch, there are no transactions to hide it */
+static int mem_batch_commit(kxdbbatch *base) {
+    kxmembatch *batch = (kxmembatch *)base;
+    kxmem *db = (kxmem *)base->db;
+    listIter li;
+    listNode *ln;
+    int ret = 0;
+
+    pthread_mutex_lock(&db->lock);
+    listRewind(batch->files, &li);
+    while ((ln = listNext(&li)) != NULL && ret == 0)
+        ret = write_file(db, listNodeValue(ln)) == -1 ? -1 : 0;
+    pthread_mutex_unlock(&db->lock);
+    mem_batch_abort(base);
+    return ret;
+}
+
+/* Readers load the user without a lock, so it is replaced, never
+ * overwritten */
+static int mem_set_user(kxdb *base, const char *user) {
+    kxmem *db = (kxmem *)base;
+    char *copy = zstrdup(user ? user : "");
+
+    if (copy == NULL) return -1;
+    pthread_mutex_lock(&db->lock);
+    retire(db->retired, __atomic_exchange_n(&db->user, copy, __ATOMIC_ACQ_REL));
+    pthread_mutex_unlock(&db->lock);
+    return 0;
+}
+
+/* The input is read into encoded records before the writer lock is
+ * taken, since the source may itself write to the catalog. They are
+ * then stored in input order, the last record of a repeated uuid wins. */
+static int mem_import(kxdb *base, kxdbsource *next, void *privdata, int replace,
+                      kxdbimport *st) {
+    kxmem *db = (kxmem *)base;
+    kxdbimport stats;
+    memtable *seen = table_create(MEMSLOTS);
+    list *input = listCreate();
+    unsigned char rec[KX_DB_RECMAX];
+    kxfileview view;
+    mementry *e;
+    listIter li;
+    listNode *ln;
+    kxfile kf;
+    int rc, ret = -1;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.ms = kx_mstime();
+    if (seen == NULL || input == NULL) goto out;
+    listSetFreeMethod(input, zfree);
+
+    while (1) {
+        memset(&kf, 0, sizeof(kf));
+        rc = next(&kf, privdata);
+        if (rc == 0) break;
+        if (rc == -1) goto out;
+        stats.records++;
+        rc = table_put(&seen, NULL, &kf.uuid, sizeof(kf.uuid), "", 0);
+        if (rc == -1) goto out;
+        if (rc == 1) stats.duplicates++;
+        kf.tree = NULL;
+        e = entry_create(&kf.uuid, sizeof(kf.uuid), rec, kx_db_encode_file(&kf, 0, 0, rec));
+        if (e == NULL || listAddNodeTail(input, e) == NULL) {
+            zfree(e);
+            goto out;
+        }
+    }
+
+    pthread_mutex_lock(&db->lock);
+    if (replace && (table_clear(&db->files, db->retired) == -1 ||
+                    table_clear(&db->paths, db->retired) == -1 ||
+                    table_clear(&db->chunks, db->retired) == -1)) {
+        pthread_mutex_unlock(&db->lock);
+        goto out;
+    }
+    rc = 0;
+    listRewind(input, &li);
+    while ((ln = listNext(&li)) != NULL && rc == 0) {
+        if (view_entry(listNodeValue(ln), &view) == -1) continue;
+        kx_db_view_copy(&view, &kf);
+        rc = write_file(db, &kf) == -1 ? -1 : 0;
+    }
+    pthread_mutex_unlock(&db->lock);
+    if (rc == -1) goto out;
+    stats.loaded = stats.records - stats.duplicates;
+    ret = 0;
+out:
+    if (input) listRelease(input);
+    table_free(seen);
+    stats.ms = kx_mstime() - stats.ms;
+    if (st) *st = stats;
+    return ret;
+}
+
+const kxdbtype kxdb_mem = {
+    .name = "memory",
+    .open = mem_open,
+    .close = mem_close,
+    .put_file = mem_put_file,
+    .get_file = mem_get_file,
+    .query = mem_query,
+    .foreach = mem_foreach,
+    .file_known = mem_file_known,
+    .put_digests = mem_put_digests,
+    .get_digests = mem_get_digests,
+    .put_fingerprint = mem_put_fingerprint,
+    .get_fingerprint = mem_get_fingerprint,
+    .batch_begin = mem_batch_begin,
+    .batch_put = mem_batch_put,
+    .batch_commit = mem_batch_commit,
+    .batch_abort = mem_batch_abort,
+    .set_user = mem_set_user,
+    .import = mem_import,
+    .expire = mem_expire,
+};
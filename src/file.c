@@ -28,44 +28,192 @@
  */
 
 #include "file.h"
+#include "atomicvar.h"
+#include "xxh_x86dispatch.h"
 
 #define AES_BLOCK_SIZE  16
 #define MAXFILESIZE     (100 * 1024 * 1024)  /* Process files smaller than 100M */
+#define HASHBUFSIZE     (1024 * 1024)        /* Streaming hash read size */
+
+/* Tree hashing configuration, disabled until kx_file_set_treehash() */
+static struct {
+    int threads;
+    uint64_t chunksize;
+} treecfg = {0, KXTREE_CHUNKSIZE};
+
+static void cache_fingerprint(const char *fname, const kxfpkey *before, uint64_t uuid);
+
+struct treejob {
+    int fd;
+    kxtree *tree;           /* digests are written in place */
+    uint64_t next;          /* next chunk to hash, shared by workers */
+    uint64_t last;          /* last chunk (inclusive) */
+    int err;
+};
+
+/* Feed the whole file to an XXH3 streaming state through a fixed size
+ * buffer, so fingerprinting memory stays bounded whatever the file size.
+ * When wide is set the 128 bit variant is used, otherwise only the low64
+ * half of digest is filled. Returns 0 on success and -1 on failure. */
+static int hash_file(const char *file_path, int wide, XXH128_hash_t *digest) {
+    int             fd;
+    ssize_t         nread;
+    char            *buffer = NULL;
+    XXH3_state_t    *state = NULL;
+    int             ret = -1;
+
+    fd = open(file_path, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening file");
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-static uint64_t calculate_xxhash(const char *file_path) {
-    FILE            *fp;
-    XXH64_hash_t    hash;
-    char            *buffer;
-    uint64_t        file_size;
-    
+    buffer = zmalloc(HASHBUFSIZE);
+    state = XXH3_createState();
+    if (buffer == NULL || state == NULL) {
+        perror("Error allocating memory");
+        goto out;
+    }
 
-    fp = fopen(file_path, "rb");
-    if (!fp) {
-        perror("Error opening file");
-        goto err;
+    if (wide)
+        XXH3_128bits_reset(state);
+    else
+        XXH3_64bits_reset(state);
+
+    while ((nread = read(fd, buffer, HASHBUFSIZE)) != 0) {
+        if (nread == -1) {
+            if (errno == EINTR) continue;
+            perror("Error reading file");
+            goto out;
+        }
+        if (wide)
+            XXH3_128bits_update(state, buffer, nread);
+        else
+            XXH3_64bits_update(state, buffer, nread);
     }
 
-    fseek(fp, 0, SEEK_END);
-    file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    if (wide) {
+        *digest = XXH3_128bits_digest(state);
+    } else {
+        digest->high64 = 0;
+        digest->low64 = XXH3_64bits_digest(state);
+    }
+    ret = 0;
+out:
+    if (state) XXH3_freeState(state);
+    if (buffer) zfree(buffer);
+    close(fd);
+    return ret;
+}
 
-    buffer = (char *)zmalloc(file_size);
-    if (buffer == NULL) {
-        perror("Error allocating memory");
-        goto err;
+static uint64_t calculate_xxhash(const char *file_path) {
+    XXH128_hash_t digest;
+
+    if (hash_file(file_path, 0, &digest) == -1)
+        return 0;
+    return digest.low64;
+}
+
+/* Hash every chunk claimed from the job until the range is exhausted.
+ * Each worker owns its read buffer and XXH3 state. */
+static void *tree_worker(void *arg) {
+    struct treejob  *job = arg;
+    kxtree          *tree = job->tree;
+    char            *buffer;
+    XXH3_state_t    *state;
+    uint64_t        idx, off, end;
+    ssize_t         nread;
+
+    buffer = zmalloc(HASHBUFSIZE);
+    state = XXH3_createState();
+    if (buffer == NULL || state == NULL) {
+        atomicSet(job->err, 1);
+        goto out;
     }
 
-    if (fread(buffer, 1, file_size, fp) != file_size) {
-        perror("Error reading file");
-        goto err;
+    while (1) {
+        atomicGetIncr(job->next, idx, 1);
+        if (idx > job->last) break;
+
+        off = idx * tree->chunksize;
+        end = off + tree->chunksize;
+        if (end > tree->filesize) end = tree->filesize;
+
+        XXH3_64bits_reset(state);
+        while (off < end) {
+            size_t want = end - off < HASHBUFSIZE ? end - off : HASHBUFSIZE;
+            nread = pread(job->fd, buffer, want, off);
+            if (nread == -1 && errno == EINTR) continue;
+            if (nread <= 0) {
+                atomicSet(job->err, 1);
+                goto out;
+            }
+            XXH3_64bits_update(state, buffer, nread);
+            off += nread;
+        }
+        tree->digests[idx] = XXH3_64bits_digest(state);
     }
-    fclose(fp);
+out:
+    if (state) XXH3_freeState(state);
+    if (buffer) zfree(buffer);
+    return NULL;
+}
 
-    hash = XXH64(buffer, file_size, 0);
-    zfree(buffer);
-    return hash;
-err:
-    return 0;
+/* Hash chunks [first, last] of an open file into tree->digests, spreading
+ * the work over nthreads threads (the caller counts as one). */
+static int tree_hash_range(int fd, kxtree *tree, uint64_t first, uint64_t last, int nthreads) {
+    struct treejob  job;
+    pthread_t       *tids;
+    int             i, started = 0;
+
+    job.fd = fd;
+    job.tree = tree;
+    job.next = first;
+    job.last = last;
+    job.err = 0;
+
+    if ((uint64_t)nthreads > last - first + 1)
+        nthreads = last - first + 1;
+    if (nthreads < 1)
+        nthreads = 1;
+
+    tids = zmalloc(sizeof(pthread_t) * nthreads);
+    if (tids == NULL) return -1;
+
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&tids[i], NULL, tree_worker, &job) != 0)
+            break;
+        started++;
+    }
+    tree_worker(&job);
+    for (i = 1; i <= started; i++)
+        pthread_join(tids[i], NULL);
+    zfree(tids);
+
+    return job.err ? -1 : 0;
+}
+
+static kxtree *tree_create(uint64_t filesize, uint64_t chunksize) {
+    uint64_t    nchunks;
+    kxtree      *tree;
+
+    nchunks = filesize == 0 ? 1 : (filesize + chunksize - 1) / chunksize;
+    tree = zmalloc(sizeof(*tree) + nchunks * sizeof(uint64_t));
+    if (tree == NULL) return NULL;
+
+    tree->chunksize = chunksize;
+    tree->filesize = filesize;
+    tree->nchunks = nchunks;
+    memset(tree->digests, 0, nchunks * sizeof(uint64_t));
+    return tree;
+}
+
+/* Chunk size files of this size are tree hashed with, 0 to hash them
+ * in one pass. Only files larger than one chunk are split. */
+static uint64_t tree_chunksize(uint64_t size) {
+    if (treecfg.threads <= 0 || size <= treecfg.chunksize) return 0;
+    return treecfg.chunksize;
 }
 
 /* Encrypting and decrypting files is currently stuck when testing 100M files, 
@@ -166,6 +314,7 @@ kxfile *kx_crypt_file(const char *fname) {
     char *name;
     kxfile *kf = NULL;
     struct stat st;
+    kxfpkey fp;
     /* We are currently processing files that are less than 100 MB. 
      * Files larger than 100 MB are not being processed at the moment 
      * to prevent potential performance issues or system slowdowns.*/
@@ -180,22 +329,38 @@ kxfile *kx_crypt_file(const char *fname) {
     kf = zmalloc(sizeof(*kf));
     if (kf == NULL)
         goto err;
+    memset(kf, 0, sizeof(*kf));
 
     if (encrypt_file(fname, client.user->key) == -1)
         goto err;
-
-    kf->uuid = calculate_xxhash(fname);
+    if (stat(fname, &st) == -1)
+        goto err;
+    kx_file_fpkey(&st, &fp);
+
+    /* In tree mode the chunks are hashed in parallel and the uuid is
+     * their root, the file is read once */
+    if (fp.chunksize) {
+        kf->tree = kx_file_tree_hash(fname, fp.chunksize, treecfg.threads);
+        if (kf->tree == NULL)
+            goto err;
+        kf->uuid = kx_file_tree_root(kf->tree);
+    } else {
+        kf->uuid = calculate_xxhash(fname);
+    }
     if (kf->uuid == 0)
         goto err;
+    cache_fingerprint(fname, &fp, kf->uuid);
 
     strncpy(kf->fullname, fname, sizeof(kf->fullname));
     name = basename((char*)fname);
     strncpy(kf->fname, name, sizeof(kf->fname));
     kf->type = KXCIPHER;
+    strncpy(kf->owner, client.user->username, sizeof(kf->owner)-1);
+    kf->ctime = (uint64_t)time(NULL);
     
     return kf;
 err:
-    if (kf) zfree(kf);
+    if (kf) kx_free_file(kf);
     return NULL;
 }
 
@@ -204,9 +369,224 @@ int kx_decrypt_file(const char *fname, const char *key) {
 }
 
 void kx_free_file(kxfile *kf) {
+    if (kf->tree)
+        zfree(kf->tree);
     zfree(kf);
 }
 
+/* Hash a file the same way kx_crypt_file does, chunksize 0 selects
+ * the flat digest */
+static uint64_t compute_uuid(const char *fname, uint64_t chunksize, int threads) {
+    kxtree *tree;
+    uint64_t uuid;
+
+    if (chunksize == 0)
+        return calculate_xxhash(fname);
+    tree = kx_file_tree_hash(fname, chunksize, threads);
+    if (tree == NULL) return 0;
+    uuid = kx_file_tree_root(tree);
+    zfree(tree);
+    return uuid;
+}
+
+/* Remember the uuid of a file, unless it changed while being hashed */
+static void cache_fingerprint(const char *fname, const kxfpkey *before, uint64_t uuid) {
+    struct stat st;
+    kxfpkey after;
+
+    if (client.db == NULL || uuid == 0) return;
+    if (stat(fname, &st) == -1) return;
+
+    kx_file_fpkey(&st, &after);
+    after.chunksize = before->chunksize;
+    if (memcmp(before, &after, sizeof(after)) == 0)
+        kx_store_db(client.db, KX_DB_INSERT_FINGERPRINT, (void*)&after, (void*)&uuid);
+}
+
 uint64_t kx_get_file_uuid(const char *fname) {
-    return calculate_xxhash(fname);
-}
\ No newline at end of file
+    struct stat st;
+    kxfpkey fp;
+    uint64_t uuid;
+
+    if (stat(fname, &st) == -1)
+        return calculate_xxhash(fname);
+
+    kx_file_fpkey(&st, &fp);
+    if (client.db == NULL)
+        return compute_uuid(fname, fp.chunksize, treecfg.threads);
+    if (kx_get_db(client.db, KX_DB_GET_FINGERPRINT, (void*)&fp, (void**)&uuid) == 0)
+        return uuid;
+
+    uuid = compute_uuid(fname, fp.chunksize, treecfg.threads);
+    cache_fingerprint(fname, &fp, uuid);
+    return uuid;
+}
+
+int kx_get_file_digest128(const char *fname, XXH128_hash_t *digest) {
+    return hash_file(fname, 1, digest);
+}
+
+void kx_file_fpkey(const struct stat *st, kxfpkey *key) {
+    memset(key, 0, sizeof(*key));
+    key->dev = st->st_dev;
+    key->ino = st->st_ino;
+    key->size = st->st_size;
+    key->mtime_sec = st->st_mtim.tv_sec;
+    key->mtime_nsec = st->st_mtim.tv_nsec;
+    key->ctime_sec = st->st_ctim.tv_sec;
+    key->ctime_nsec = st->st_ctim.tv_nsec;
+    key->chunksize = tree_chunksize(st->st_size);
+}
+
+void kx_file_set_treehash(int threads, uint64_t chunksize) {
+    if (threads < 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    treecfg.threads = threads;
+    treecfg.chunksize = chunksize ? chunksize : KXTREE_CHUNKSIZE;
+}
+
+kxtree *kx_file_tree_hash(const char *fname, uint64_t chunksize, int threads) {
+    int         fd;
+    struct stat st;
+    kxtree      *tree = NULL;
+
+    fd = open(fname, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening file");
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1) {
+        perror("Error stat() failed");
+        goto out;
+    }
+
+    tree = tree_create(st.st_size, chunksize ? chunksize : KXTREE_CHUNKSIZE);
+    if (tree == NULL)
+        goto out;
+
+    if (tree_hash_range(fd, tree, 0, tree->nchunks - 1, threads) == -1) {
+        fprintf(stderr, "Error tree hashing file %s\n", fname);
+        zfree(tree);
+        tree = NULL;
+    }
+out:
+    close(fd);
+    return tree;
+}
+
+uint64_t kx_file_tree_root(const kxtree *tree) {
+    XXH3_state_t        *state;
+    XXH64_canonical_t   canon;
+    uint64_t            root;
+
+    state = XXH3_createState();
+    if (state == NULL) return 0;
+
+    /* Digests are combined in canonical (big endian) form so the root
+     * does not depend on the host byte order. */
+    XXH3_64bits_reset_withSeed(state, tree->chunksize);
+    for (uint64_t i = 0; i < tree->nchunks; i++) {
+        XXH64_canonicalFromHash(&canon, tree->digests[i]);
+        XXH3_64bits_update(state, &canon, sizeof(canon));
+    }
+    root = XXH3_64bits_digest(state);
+    XXH3_freeState(state);
+    return root;
+}
+
+int kx_file_tree_verify(const char *fname, const kxtree *tree, 
+                        uint64_t off, uint64_t len, int threads) {
+    int         fd;
+    int         bad = -1;
+    struct stat st;
+    uint64_t    first, last;
+    kxtree      *cur = NULL;
+
+    fd = open(fname, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening file");
+        return -1;
+    }
+    if (fstat(fd, &st) == -1) {
+        perror("Error stat() failed");
+        goto out;
+    }
+    /* A size change invalidates every chunk from the old end onwards,
+     * report the whole file rather than guessing. */
+    if ((uint64_t)st.st_size != tree->filesize) {
+        bad = tree->nchunks;
+        goto out;
+    }
+
+    /* An empty file has one empty chunk at offset 0 */
+    if (off > 0 && off >= tree->filesize) {
+        fprintf(stderr, "Error offset %lu beyond end of file %s\n",
+                (unsigned long)off, fname);
+        goto out;
+    }
+    if (len == 0 || off + len > tree->filesize)
+        len = tree->filesize - off;
+    first = off / tree->chunksize;
+    last = len == 0 ? first : (off + len - 1) / tree->chunksize;
+    if (last >= tree->nchunks)
+        last = tree->nchunks - 1;
+
+    cur = tree_create(tree->filesize, tree->chunksize);
+    if (cur == NULL)
+        goto out;
+    if (tree_hash_range(fd, cur, first, last, threads) == -1)
+        goto out;
+
+    bad = 0;
+    for (uint64_t i = first; i <= last; i++) {
+        if (cur->digests[i] != tree->digests[i])
+            bad++;
+    }
+out:
+    if (cur) zfree(cur);
+    close(fd);
+    return bad;
+}
+
+int kx_file_verify(const char *fname, uint64_t uuid, int threads) {
+    struct stat st;
+    kxfpkey fp;
+    kxtree *stored = NULL, *tree;
+    uint64_t cur;
+    int same;
+
+    if (stat(fname, &st) == -1)
+        return errno == ENOENT ? KXVERIFY_MISSING : KXVERIFY_ERROR;
+
+    /* The record says how its uuid was derived, whatever the current
+     * tree settings: from stored digests or in one pass */
+    if (client.db)
+        kx_get_db(client.db, KX_DB_GET_DIGESTS, (void*)&uuid, (void**)&stored);
+    kx_file_fpkey(&st, &fp);
+    fp.chunksize = stored ? stored->chunksize : 0;
+    if (client.db && kx_get_db(client.db, KX_DB_GET_FINGERPRINT, (void*)&fp, (void**)&cur) == 0) {
+        if (stored) zfree(stored);
+        return cur == uuid ? KXVERIFY_OK : KXVERIFY_MISMATCH;
+    }
+
+    /* Stored digests are rehashed in parallel and compared by their
+     * root, which is cached as the uuid of the current content */
+    if (stored) {
+        tree = kx_file_tree_hash(fname, stored->chunksize, threads);
+        cur = tree ? kx_file_tree_root(tree) : 0;
+        same = tree && cur == kx_file_tree_root(stored);
+        if (tree) zfree(tree);
+        zfree(stored);
+        if (cur == 0)
+            return KXVERIFY_ERROR;
+        cache_fingerprint(fname, &fp, cur);
+        return same ? KXVERIFY_OK : KXVERIFY_MISMATCH;
+    }
+
+    cur = calculate_xxhash(fname);
+    if (cur == 0)
+        return KXVERIFY_ERROR;
+
+    cache_fingerprint(fname, &fp, cur);
+    return cur == uuid ? KXVERIFY_OK : KXVERIFY_MISMATCH;
+}
@@ -36,11 +36,57 @@ typedef enum filetype {
     KXPLAIN,
 } kxfiletype;
 
+#define KXTREE_CHUNKSIZE    (4 * 1024 * 1024)   /* Default tree hash chunk size */
+
+/* Per chunk digests of a tree hashed file, hashed in parallel and kept
+ * beside the record so a range or the whole file can be rehashed. The
+ * uuid of such a file is the root of its digests, files hashed in one
+ * pass keep the flat XXH3 of their content. */
+typedef struct kxtree {
+    uint64_t chunksize;     /* Bytes covered by one digest */
+    uint64_t filesize;      /* File size when the tree was built */
+    uint64_t nchunks;       /* Number of digests */
+    uint64_t digests[];     /* XXH3 64 bit digest of each chunk */
+} kxtree;
+
+#define KXTREE_SIZE(n)  (sizeof(kxtree) + (n) * sizeof(uint64_t))
+
+/* Identity of a file version as seen by stat(). While the key is
+ * unchanged the content is assumed unchanged, so a cached uuid can be
+ * reused without reading the file. ctime is part of the key because it
+ * cannot be forged by utimes(). */
+typedef struct kxfpkey {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint64_t chunksize;     /* Tree hash chunk size of the uuid, 0 when flat */
+} kxfpkey;
+
+/* How the uuid behind a cached fingerprint was computed, the flat XXH3
+ * 64 of the content or, with a chunk size in the key, the root of its
+ * chunk digests. Entries cached under another scheme are misses, so
+ * bump it whenever the uuid computation changes. */
+#define KXFP_SCHEME         3
+
+/* kx_file_verify() results */
+#define KXVERIFY_OK         0
+#define KXVERIFY_MISMATCH   1   /* Content no longer matches the uuid */
+#define KXVERIFY_MISSING    2   /* File does not exist */
+#define KXVERIFY_ERROR      3   /* File could not be read */
+
 typedef struct kxfile {
     char fname[NAME_MAX];
     char fullname[PATH_MAX];
     uint64_t uuid;
     kxfiletype type;
+    char owner[32];         /* User that encrypted the file */
+    uint64_t ctime;         /* Encryption time, seconds since the epoch */
+    uint64_t expires;       /* Pruned from the catalog after this time, 0 never */
+    kxtree *tree;           /* Chunk digests, NULL when hashed in one pass */
 } kxfile;
 
 /** create file object
@@ -65,7 +111,68 @@ void kx_free_file(kxfile *kf);
 /** Calculate file uuid
  * @param fname file path
  * @return return File calculated uuid 
+ * @note The uuid is looked up in the fingerprint cache of client.db 
+ *       first, the file is only read when its stat() identity changed
  */
 uint64_t kx_get_file_uuid(const char *fname);
 
+/** Fill a fingerprint cache key from stat() output
+ * @param st file status
+ * @param key output key
+ */
+void kx_file_fpkey(const struct stat *st, kxfpkey *key);
+
+/** Calculate the 128 bit XXH3 digest of a file
+ * @param fname file path
+ * @param digest output digest
+ * @return Returns 0 on success and -1 on failure
+ */
+int kx_get_file_digest128(const char *fname, XXH128_hash_t *digest);
+
+/** Enable or disable the chunked tree hash mode
+ * @param threads hashing threads, 0 disables tree mode and a negative
+ *        value uses one thread per online CPU
+ * @param chunksize bytes per chunk, 0 selects KXTREE_CHUNKSIZE
+ * @note Files larger than one chunk then get chunk digests from
+ *       kx_crypt_file and their uuid is the root of the digests, so it
+ *       differs from the flat uuid the file has with the mode off
+ */
+void kx_file_set_treehash(int threads, uint64_t chunksize);
+
+/** Hash a file chunk by chunk in parallel
+ * @param fname file path
+ * @param chunksize bytes per chunk, 0 selects KXTREE_CHUNKSIZE
+ * @param threads number of hashing threads
+ * @return return the chunk digests, release with zfree(). NULL on failure
+ */
+kxtree *kx_file_tree_hash(const char *fname, uint64_t chunksize, int threads);
+
+/** Combine chunk digests into a root hash
+ * @param tree chunk digests
+ * @return return root hash, 0 on failure
+ */
+uint64_t kx_file_tree_root(const kxtree *tree);
+
+/** Rehash only the chunks covering a byte range and compare them
+ * @param fname file path
+ * @param tree stored chunk digests
+ * @param off first byte to verify, before the end of file
+ * @param len number of bytes to verify, 0 verifies up to the end of file
+ * @param threads number of hashing threads
+ * @return Returns the number of mismatching chunks, -1 on failure
+ */
+int kx_file_tree_verify(const char *fname, const kxtree *tree, 
+                        uint64_t off, uint64_t len, int threads);
+
+/** Check that a file still hashes to its catalog uuid
+ * @param fname file path
+ * @param uuid uuid recorded in the catalog
+ * @param threads tree hashing threads for files stored with chunk digests
+ * @return return KXVERIFY_* status
+ * @note A valid fingerprint cache entry answers without reading the file.
+ *       Files stored with chunk digests are rehashed with the chunk size
+ *       they were stored with, whatever the current tree hash setting.
+ */
+int kx_file_verify(const char *fname, uint64_t uuid, int threads);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,902 @@
+/*
+ * Copyright 2023-2024 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "kx_db.h"
+
+#define AUTHORS             "Written by Yan Ruibing."
+#define PACKAGE_VERSION     "0.0.1"
+
+#define DB_BACKUP       1
+#define DB_IMPORT       2
+#define DB_EXPORT       3
+#define DB_STAT         4
+#define DB_PRUNE        5
+
+#define FORMAT_TSV      0   /* db export output */
+#define FORMAT_LIST     1   /* One path per line */
+#define FORMAT_REDIS    2   /* HGETALL fileuuid:* replies, one line each */
+
+#define EXPORT_HEADER   "# rkx catalog v1"
+
+struct state {
+    int cmd;                /* DB_* */
+    bool isstop;
+    bool replace;           /* Import over an emptied catalog */
+    bool readers;           /* db stat also lists the reader table */
+    bool columnar;          /* db export writes the columnar layout */
+    int format;             /* FORMAT_* of the import input */
+    long every;             /* Seconds between scheduled backups, 0 once */
+    char *output;           /* Target path, strftime() expanded */
+    char *pipecmd;          /* Shell command fed the copy on stdin */
+    char *input;            /* Import source, NULL for stdin */
+    char *owner;            /* Owner of imported paths */
+};
+
+/* Reader state of an import source */
+struct source {
+    FILE *fp;
+    int format;
+    const char *owner;
+    char *line;
+    size_t linecap;
+    unsigned long lineno;
+    unsigned long skipped;
+    bool pending;           /* line holds a field not handled yet, redis only */
+};
+
+/* Columns of db export --columnar, in file order */
+enum {
+    COL_UUID, COL_CTIME, COL_EXPIRES, COL_TYPE,
+    COL_PATHOFF, COL_PATH, COL_NAMEOFF, COL_NAME, COL_OWNEROFF, COL_OWNER,
+    NCOLUMNS
+};
+
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint32_t width;
+} columns[NCOLUMNS] = {
+    {"uuid", KX_COL_U64, 8},
+    {"ctime", KX_COL_U64, 8},
+    {"expires", KX_COL_U64, 8},
+    {"type", KX_COL_U8, 1},
+    {"path.off", KX_COL_OFFSETS, 8},
+    {"path", KX_COL_HEAP, 1},
+    {"fname.off", KX_COL_OFFSETS, 8},
+    {"fname", KX_COL_HEAP, 1},
+    {"owner.off", KX_COL_OFFSETS, 8},
+    {"owner", KX_COL_HEAP, 1},
+};
+
+/* Columns are built in memory during the walk, then written out in
+ * one pass so a pipe works as well as a file */
+struct colbuf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct colexport {
+    struct colbuf cols[NCOLUMNS];
+    uint64_t nrows;
+};
+
+/* Periodic backup started by db backup --every */
+struct backupsched {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool running;
+    bool stop;
+    long every;
+    char *output;
+    char *pipecmd;
+};
+
+static struct state *state = NULL;
+static struct backupsched sched = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+static struct option const long_options[] = {
+    {"output", required_argument, NULL, 'o'},
+    {"pipe", required_argument, NULL, 'p'},
+    {"every", required_argument, NULL, 'E'},
+    {"stop", no_argument, NULL, 'K'},
+    {"input", required_argument, NULL, 'i'},
+    {"format", required_argument, NULL, 'f'},
+    {"replace", no_argument, NULL, 'R'},
+    {"owner", required_argument, NULL, 'O'},
+    {"readers", no_argument, NULL, 'r'},
+    {"columnar", no_argument, NULL, 'C'},
+    {"version", no_argument, NULL, 'v'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, no_argument, NULL, 0}
+};
+
+static void usage() {
+    printf ("Usage: db backup|import|export|stat|prune [OPTION]... \n"
+                "catalog maintenance\n\n"
+                "  backup           Write a compacted copy of the catalog .\n"
+                "  -o, --output=PATH  backup file, may hold strftime %%-escapes .\n"
+                "  -p, --pipe=CMD     feed the backup to CMD instead .\n"
+                "      --every=SECS   repeat the backup every SECS in background .\n"
+                "      --stop         stop the scheduled backup .\n"
+                "                   The map is grown first, writes that still fill\n"
+                "                   it wait for the copy to finish .\n"
+                "  import           Bulk load file records .\n"
+                "  -i, --input=FILE   read FILE instead of standard input .\n"
+                "  -f, --format=FMT   tsv (db export), list (one path per line)\n"
+                "                     or redis (redis-cli HGETALL fileuuid:* output) .\n"
+                "      --replace      drop every file record first .\n"
+                "      --owner=NAME   owner of list imports (default current user) .\n"
+                "  export           Write every file record as tsv .\n"
+                "  -o, --output=PATH  export file (default standard output) .\n"
+                "  -p, --pipe=CMD     feed the export to CMD instead .\n"
+                "      --columnar     write mappable columns instead of tsv, see kx_db.h .\n"
+                "  stat             B-tree and map usage of every catalog database .\n"
+                "  -r, --readers      also list the reader lock table .\n"
+                "  prune            Delete expired records and fingerprints now .\n"
+                "      --help       display this help and exit\n"
+                "      --version    output version information and exit\n\n"
+                "Examples:\n"
+                "  db backup -o /backup/catalog.mdb\n"
+                "  db backup -p 'gzip > /backup/catalog.mdb.gz'\n"
+                "  db backup --every 3600 -o /backup/catalog-%%Y%%m%%d%%H.mdb\n"
+                "  db export -o node1.tsv\n"
+                "  db export --columnar -o node1.col\n"
+                "  db import --replace -i node1.tsv\n"
+                "  db import -f list -i protected.txt\n"
+                "  db stat -r\n"
+                "  db prune\n\n");
+}
+
+/**
+ * Parses command line flags into a global application state.
+ */
+static int
+parse_options (int argc, char *argv[]) {
+    int ret = -1;
+    int opt = 0;
+    int option_index = 0;
+    char *end;
+
+    if (argc < 2 || argv[argc-1] == NULL || argv[argc-1][0] == '\0') {
+        fprintf(stderr, "Invalid command line arguments\n");
+        goto err;
+    }
+
+    if (strcmp(argv[1], "backup") == 0)
+        state->cmd = DB_BACKUP;
+    else if (strcmp(argv[1], "import") == 0)
+        state->cmd = DB_IMPORT;
+    else if (strcmp(argv[1], "export") == 0)
+        state->cmd = DB_EXPORT;
+    else if (strcmp(argv[1], "stat") == 0)
+        state->cmd = DB_STAT;
+    else if (strcmp(argv[1], "prune") == 0)
+        state->cmd = DB_PRUNE;
+    if (state->cmd) {
+        /* Options follow the subcommand */
+        argc--;
+        argv++;
+    }
+
+    optind = 0;
+    while (true) {
+        opt = getopt_long(argc, argv, "o:p:i:f:rhv", long_options, &option_index);
+
+        if (opt == -1) break;
+
+        switch (opt) {
+        case 'o':
+            state->output = strdup(optarg);
+            break;
+        case 'p':
+            state->pipecmd = strdup(optarg);
+            break;
+        case 'E':
+            errno = 0;
+            state->every = strtol(optarg, &end, 10);
+            if (errno || *end != '\0' || state->every <= 0) {
+                fprintf(stderr, "Invalid interval %s\n", optarg);
+                goto err;
+            }
+            break;
+        case 'K':
+            state->isstop = true;
+            break;
+        case 'i':
+            state->input = strdup(optarg);
+            break;
+        case 'f':
+            if (strcmp(optarg, "tsv") == 0)
+                state->format = FORMAT_TSV;
+            else if (strcmp(optarg, "list") == 0)
+                state->format = FORMAT_LIST;
+            else if (strcmp(optarg, "redis") == 0)
+                state->format = FORMAT_REDIS;
+            else {
+                fprintf(stderr, "Invalid format %s\n", optarg);
+                goto err;
+            }
+            break;
+        case 'R':
+            state->replace = true;
+            break;
+        case 'O':
+            state->owner = strdup(optarg);
+            break;
+        case 'r':
+            state->readers = true;
+            break;
+        case 'C':
+            state->columnar = true;
+            break;
+        case 'v':
+            printf ("%s (%s) %s\n", argv[0], PACKAGE_VERSION, AUTHORS);
+            ret = -2;
+            goto out;
+        case 'h':
+            usage();
+            ret = -2;
+            goto out;
+        default: goto err;
+        }
+    }
+
+    if (!state->cmd) {
+        error(0, 0, "missing subcommand");
+        goto err;
+    }
+    if (state->output && state->pipecmd) {
+        error(0, 0, "--output and --pipe are exclusive");
+        goto err;
+    }
+    if (state->cmd != DB_BACKUP || state->isstop) {
+        ret = 0;
+        goto out;
+    }
+    if (state->output == NULL && state->pipecmd == NULL) {
+        error(0, 0, "--output or --pipe is required");
+        goto err;
+    }
+    ret = 0;
+    goto out;
+err:
+    error(0, 0, "Try db --help for more information.");
+out:
+    return ret;
+}
+
+/**
+ * Initializes the global application state.
+ */
+static struct state*
+init_state()
+{
+    struct state *state = zmalloc(sizeof (*state));
+    if (state == NULL)
+        goto out;
+
+    state->cmd = 0;
+    state->isstop = false;
+    state->replace = false;
+    state->readers = false;
+    state->columnar = false;
+    state->format = FORMAT_TSV;
+    state->every = 0;
+    state->output = NULL;
+    state->pipecmd = NULL;
+    state->input = NULL;
+    state->owner = NULL;
+out:
+    return state;
+}
+
+static void free_state() {
+    if (state) {
+        if (state->output) free(state->output);
+        if (state->pipecmd) free(state->pipecmd);
+        if (state->input) free(state->input);
+        if (state->owner) free(state->owner);
+        zfree(state);
+        state = NULL;
+    }
+}
+
+static void backup_report(const char *target, const kxdbbackup *st) {
+    double secs = st->ms > 0 ? st->ms / 1000.0 : 0.001;
+
+    printf("Backup %s: %llu bytes in %lld ms, %.1f MB/s, "
+           "compacted to %.1f%% of %llu bytes\n",
+           target, (unsigned long long)st->bytes, st->ms,
+           st->bytes / secs / (1024 * 1024),
+           st->srcbytes ? 100.0 * st->bytes / st->srcbytes : 100.0,
+           (unsigned long long)st->srcbytes);
+}
+
+/* A file appears under PATH only once it is complete, a crash leaves
+ * PATH.tmp behind instead of a torn copy */
+static int backup_file(const char *pattern) {
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    time_t now = time(NULL);
+    struct tm tm;
+    kxdbbackup st;
+    int fd;
+
+    localtime_r(&now, &tm);
+    if (strftime(path, sizeof(path), pattern, &tm) == 0) {
+        fprintf(stderr, "Error backup path %s too long\n", pattern);
+        return -1;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        fprintf(stderr, "Error open %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    if (kx_db_backup(client.db, fd, &st) == -1)
+        goto err;
+    if (fsync(fd) == -1) {
+        fprintf(stderr, "Error fsync %s: %s\n", tmp, strerror(errno));
+        goto err;
+    }
+    close(fd);
+    if (rename(tmp, path) == -1) {
+        fprintf(stderr, "Error rename %s: %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    backup_report(path, &st);
+    return 0;
+err:
+    close(fd);
+    unlink(tmp);
+    return -1;
+}
+
+static int backup_pipe(const char *cmd) {
+    kxdbbackup st;
+    FILE *fp;
+    int ret, status;
+
+    fp = popen(cmd, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Error popen %s: %s\n", cmd, strerror(errno));
+        return -1;
+    }
+    ret = kx_db_backup(client.db, fileno(fp), &st);
+    status = pclose(fp);
+    if (status != 0) {
+        fprintf(stderr, "Error backup command exited with %d\n",
+                WIFEXITED(status) ? WEXITSTATUS(status) : status);
+        ret = -1;
+    }
+    if (ret == 0)
+        backup_report(cmd, &st);
+    return ret;
+}
+
+static int backup_once(const char *output, const char *pipecmd) {
+    return output ? backup_file(output) : backup_pipe(pipecmd);
+}
+
+static void *sched_main(void *arg) {
+    struct timespec ts;
+    (void)arg;
+
+    pthread_mutex_lock(&sched.lock);
+    while (!sched.stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += sched.every;
+        while (!sched.stop &&
+               pthread_cond_timedwait(&sched.cond, &sched.lock, &ts) != ETIMEDOUT);
+        if (sched.stop) break;
+        /* db backup --stop waits for a copy in progress */
+        pthread_mutex_unlock(&sched.lock);
+        backup_once(sched.output, sched.pipecmd);
+        pthread_mutex_lock(&sched.lock);
+    }
+    pthread_mutex_unlock(&sched.lock);
+    return NULL;
+}
+
+static int sched_stop(bool quiet) {
+    pthread_mutex_lock(&sched.lock);
+    if (!sched.running) {
+        pthread_mutex_unlock(&sched.lock);
+        if (!quiet) printf("No backup scheduled\n");
+        return 0;
+    }
+    sched.stop = true;
+    pthread_cond_signal(&sched.cond);
+    pthread_mutex_unlock(&sched.lock);
+
+    pthread_join(sched.tid, NULL);
+    if (sched.output) free(sched.output);
+    if (sched.pipecmd) free(sched.pipecmd);
+    sched.output = sched.pipecmd = NULL;
+    sched.running = false;
+    if (!quiet) printf("Scheduled backup stopped\n");
+    return 0;
+}
+
+void kx_db_backup_stop() {
+    sched_stop(true);
+}
+
+static int sched_start() {
+    if (sched.running) {
+        fprintf(stderr, "Error backup already scheduled, use --stop first\n");
+        return -1;
+    }
+    sched.stop = false;
+    sched.every = state->every;
+    /* The thread owns the targets from here on */
+    sched.output = state->output;
+    sched.pipecmd = state->pipecmd;
+    state->output = state->pipecmd = NULL;
+
+    if (pthread_create(&sched.tid, NULL, sched_main, NULL) != 0) {
+        fprintf(stderr, "Unable to start backup scheduler\n");
+        free(sched.output);
+        free(sched.pipecmd);
+        sched.output = sched.pipecmd = NULL;
+        return -1;
+    }
+    sched.running = true;
+    printf("Backup every %ld seconds\n", sched.every);
+    return 0;
+}
+
+static int db_backup() {
+    if (state->isstop)
+        return sched_stop(false);
+    if (state->every)
+        return sched_start();
+    return backup_once(state->output, state->pipecmd);
+}
+
+/* Undo the escapes of tsv_put() in place */
+static void tsv_unescape(char *s) {
+    char *d = s;
+
+    for (; *s; s++) {
+        if (*s == '\\' && s[1]) {
+            s++;
+            *d++ = *s == 't' ? '\t' : *s == 'n' ? '\n' : *s;
+        } else {
+            *d++ = *s;
+        }
+    }
+    *d = '\0';
+}
+
+/* uuid type ctime owner fname fullname [expires] */
+static int parse_tsv(char *line, kxfile *kf) {
+    char *field[7];
+    int n = 0;
+
+    field[n++] = line;
+    for (char *p = line; *p && n < 7; p++) {
+        if (*p == '\t') {
+            *p = '\0';
+            field[n++] = p + 1;
+        }
+    }
+    if (n < 6) return -1;
+    for (int i = 0; i < n; i++)
+        tsv_unescape(field[i]);
+
+    kf->uuid = strtoull(field[0], NULL, 10);
+    kf->type = atoi(field[1]);
+    kf->ctime = strtoull(field[2], NULL, 10);
+    if (strlen(field[3]) >= sizeof(kf->owner) ||
+        strlen(field[4]) >= sizeof(kf->fname) ||
+        strlen(field[5]) >= sizeof(kf->fullname))
+        return -1;
+    strcpy(kf->owner, field[3]);
+    strcpy(kf->fname, field[4]);
+    strcpy(kf->fullname, field[5]);
+    if (n == 7)
+        kf->expires = strtoull(field[6], NULL, 10);
+    return kf->uuid ? 0 : -1;
+}
+
+/* A protected file on this node, hashed like file -e did */
+static int parse_path(struct source *src, char *path, kxfile *kf) {
+    struct stat st;
+    char *name;
+
+    if (stat(path, &st) == -1 || strlen(path) >= sizeof(kf->fullname))
+        return -1;
+    kf->uuid = kx_get_file_uuid(path);
+    if (kf->uuid == 0) return -1;
+    strcpy(kf->fullname, path);
+    name = basename(path);
+    strncpy(kf->fname, name, sizeof(kf->fname)-1);
+    kf->type = KXCIPHER;
+    kf->ctime = (uint64_t)st.st_mtime;
+    if (src->owner)
+        strncpy(kf->owner, src->owner, sizeof(kf->owner)-1);
+    return 0;
+}
+
+static ssize_t source_line(struct source *src) {
+    ssize_t len = getline(&src->line, &src->linecap, src->fp);
+
+    if (len > 0 && src->line[len-1] == '\n')
+        src->line[--len] = '\0';
+    if (len >= 0) src->lineno++;
+    return len;
+}
+
+/* Field and value lines of the FILE_CRYPT hashes, a field seen twice
+ * starts the next file */
+static int next_redis(struct source *src, kxfile *kf) {
+    int seen = 0, bit;
+
+    while (1) {
+        if (!src->pending && source_line(src) == -1)
+            return seen ? 1 : 0;
+        src->pending = false;
+        if (src->line[0] == '\0') {
+            if (seen) return 1;
+            continue;
+        }
+
+        if (strcmp(src->line, "filename") == 0) bit = 1;
+        else if (strcmp(src->line, "path") == 0) bit = 2;
+        else if (strcmp(src->line, "uuid") == 0) bit = 4;
+        else if (strcmp(src->line, "user") == 0) bit = 8;
+        else bit = 0;
+        if (seen & bit) {
+            /* The field name stays in line for the next call */
+            src->pending = true;
+            return 1;
+        }
+        seen |= bit;
+        if (source_line(src) == -1)
+            return seen ? 1 : 0;
+
+        switch (bit) {
+        case 1: strncpy(kf->fname, src->line, sizeof(kf->fname)-1); break;
+        case 2: strncpy(kf->fullname, src->line, sizeof(kf->fullname)-1); break;
+        case 4: kf->uuid = strtoull(src->line, NULL, 10); break;
+        case 8: strncpy(kf->owner, src->line, sizeof(kf->owner)-1); break;
+        }
+    }
+}
+
+static int next_record(kxfile *kf, void *privdata) {
+    struct source *src = privdata;
+    ssize_t len;
+    int rc;
+
+    while (1) {
+        if (src->format == FORMAT_REDIS) {
+            rc = next_redis(src, kf);
+            if (rc != 1) return rc;
+            kf->type = KXCIPHER;
+            if (kf->uuid) return 1;
+            src->skipped++;
+            memset(kf, 0, sizeof(*kf));
+            continue;
+        }
+
+        len = source_line(src);
+        if (len == -1) return ferror(src->fp) ? -1 : 0;
+        if (len == 0 || src->line[0] == '#')
+            continue;
+        rc = src->format == FORMAT_TSV ? parse_tsv(src->line, kf)
+                                       : parse_path(src, src->line, kf);
+        if (rc == 0) return 1;
+        fprintf(stderr, "Skipping line %lu\n", src->lineno);
+        src->skipped++;
+        memset(kf, 0, sizeof(*kf));
+    }
+}
+
+static int db_import() {
+    struct source src;
+    kxdbimport st;
+    int ret;
+
+    memset(&src, 0, sizeof(src));
+    src.format = state->format;
+    src.owner = state->owner;
+    src.fp = state->input ? fopen(state->input, "r") : stdin;
+    if (src.fp == NULL) {
+        fprintf(stderr, "Error open %s: %s\n", state->input, strerror(errno));
+        return -1;
+    }
+    ret = kx_db_import(client.db, next_record, &src, state->replace, &st);
+    if (src.fp != stdin) fclose(src.fp);
+    if (src.line) free(src.line);
+
+    printf("Imported %lu of %lu records in %lld ms (%s), %lu duplicates, "
+           "%lu lines skipped\n",
+           (unsigned long)st.loaded, (unsigned long)st.records, st.ms,
+           st.appended ? "appended" : "merged",
+           (unsigned long)st.duplicates, src.skipped);
+    return ret;
+}
+
+/* Tabs, newlines and backslashes of names are escaped */
+static void tsv_put(FILE *fp, const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        switch (s[i]) {
+        case '\t': fputs("\\t", fp); break;
+        case '\n': fputs("\\n", fp); break;
+        case '\\': fputs("\\\\", fp); break;
+        default: fputc(s[i], fp); break;
+        }
+    }
+}
+
+static int export_file(const kxfileview *v, void *privdata) {
+    FILE *fp = privdata;
+
+    fprintf(fp, "%lu\t%d\t%lu\t", v->uuid, v->type, v->ctime);
+    tsv_put(fp, v->owner, v->ownerlen);
+    fputc('\t', fp);
+    tsv_put(fp, v->fname, v->fnamelen);
+    fputc('\t', fp);
+    tsv_put(fp, v->fullname, v->fullnamelen);
+    /* Only records due to be pruned have the last field */
+    if (v->expires)
+        fprintf(fp, "\t%lu", v->expires);
+    fputc('\n', fp);
+    return ferror(fp) ? 1 : 0;
+}
+
+static void colbuf_put(struct colbuf *b, const void *p, size_t len) {
+    if (b->len + len > b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 4096;
+        while (b->cap < b->len + len) b->cap *= 2;
+        b->data = zrealloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, p, len);
+    b->len += len;
+}
+
+static void colbuf_string(struct colexport *ce, int heap, const char *s, size_t len) {
+    uint64_t end;
+
+    colbuf_put(&ce->cols[heap], s, len);
+    end = ce->cols[heap].len;
+    colbuf_put(&ce->cols[heap - 1], &end, sizeof(end));
+}
+
+static int export_column(const kxfileview *v, void *privdata) {
+    struct colexport *ce = privdata;
+    uint8_t type = (uint8_t)v->type;
+
+    colbuf_put(&ce->cols[COL_UUID], &v->uuid, sizeof(v->uuid));
+    colbuf_put(&ce->cols[COL_CTIME], &v->ctime, sizeof(v->ctime));
+    colbuf_put(&ce->cols[COL_EXPIRES], &v->expires, sizeof(v->expires));
+    colbuf_put(&ce->cols[COL_TYPE], &type, sizeof(type));
+    colbuf_string(ce, COL_PATH, v->fullname, v->fullnamelen);
+    colbuf_string(ce, COL_NAME, v->fname, v->fnamelen);
+    colbuf_string(ce, COL_OWNER, v->owner, v->ownerlen);
+    ce->nrows++;
+    return 0;
+}
+
+/* Pad with zeros up to the next column boundary */
+static int col_pad(FILE *fp, uint64_t *pos) {
+    static const char zeros[KX_COLUMNAR_ALIGN];
+    size_t pad = (KX_COLUMNAR_ALIGN - *pos % KX_COLUMNAR_ALIGN) % KX_COLUMNAR_ALIGN;
+
+    if (pad && fwrite(zeros, 1, pad, fp) != pad)
+        return -1;
+    *pos += pad;
+    return 0;
+}
+
+/* Header block, columns, index and footer. Returns the number of
+ * records, -1 on failure. */
+static long export_columnar(FILE *fp, kxdbiter *it) {
+    struct colexport ce;
+    kxcolumn index[NCOLUMNS];
+    kxcolfooter footer;
+    uint64_t zero = 0, pos = 0;
+    long count = -1;
+
+    memset(&ce, 0, sizeof(ce));
+    colbuf_put(&ce.cols[COL_PATHOFF], &zero, sizeof(zero));
+    colbuf_put(&ce.cols[COL_NAMEOFF], &zero, sizeof(zero));
+    colbuf_put(&ce.cols[COL_OWNEROFF], &zero, sizeof(zero));
+    if (kx_db_foreach(client.db, it, export_column, &ce) == -1)
+        goto out;
+
+    memset(index, 0, sizeof(index));
+    memset(&footer, 0, sizeof(footer));
+    memcpy(footer.magic, KX_COLUMNAR_MAGIC, sizeof(footer.magic));
+    if (fwrite(footer.magic, 1, sizeof(footer.magic), fp) != sizeof(footer.magic))
+        goto out;
+    pos = sizeof(footer.magic);
+    for (int i = 0; i < NCOLUMNS; i++) {
+        if (col_pad(fp, &pos) == -1)
+            goto out;
+        snprintf(index[i].name, sizeof(index[i].name), "%s", columns[i].name);
+        index[i].type = columns[i].type;
+        index[i].width = columns[i].width;
+        index[i].offset = pos;
+        index[i].size = ce.cols[i].len;
+        if (ce.cols[i].len &&
+            fwrite(ce.cols[i].data, 1, ce.cols[i].len, fp) != ce.cols[i].len)
+            goto out;
+        pos += ce.cols[i].len;
+    }
+    if (col_pad(fp, &pos) == -1)
+        goto out;
+
+    footer.nrows = ce.nrows;
+    footer.ncolumns = NCOLUMNS;
+    footer.index = pos;
+    footer.check = XXH3_64bits(index, sizeof(index));
+    footer.version = KX_COLUMNAR_VERSION;
+    if (fwrite(index, sizeof(index), 1, fp) != 1 ||
+        fwrite(&footer, sizeof(footer), 1, fp) != 1)
+        goto out;
+    count = (long)ce.nrows;
+out:
+    for (int i = 0; i < NCOLUMNS; i++) {
+        if (ce.cols[i].data) zfree(ce.cols[i].data);
+    }
+    return count;
+}
+
+static int db_export() {
+    char tmp[PATH_MAX + 8];
+    kxdbiter it;
+    FILE *fp;
+    long count;
+    int ret = 0;
+
+    if (state->pipecmd) {
+        fp = popen(state->pipecmd, "w");
+    } else if (state->output) {
+        snprintf(tmp, sizeof(tmp), "%s.tmp", state->output);
+        fp = fopen(tmp, "w");
+    } else {
+        fp = stdout;
+    }
+    if (fp == NULL) {
+        fprintf(stderr, "Error open export target: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&it, 0, sizeof(it));
+    it.everyone = 1;
+    if (state->columnar) {
+        count = export_columnar(fp, &it);
+    } else {
+        fprintf(fp, "%s\n", EXPORT_HEADER);
+        count = kx_db_foreach(client.db, &it, export_file, fp);
+    }
+    if (count == -1 || fflush(fp) == EOF || ferror(fp))
+        ret = -1;
+
+    if (state->pipecmd) {
+        if (pclose(fp) != 0) ret = -1;
+    } else if (state->output) {
+        if (fsync(fileno(fp)) == -1) ret = -1;
+        fclose(fp);
+        if (ret == 0 && rename(tmp, state->output) == -1)
+            ret = -1;
+        if (ret == -1) unlink(tmp);
+    }
+    if (ret == -1)
+        fprintf(stderr, "Error catalog export failed\n");
+    else if (fp != stdout)
+        printf("Exported %ld records\n", count);
+    return ret;
+}
+
+static int print_reader(const char *msg, void *ctx) {
+    (void)ctx;
+    printf("  %s", msg);
+    return 0;
+}
+
+static int db_stat() {
+    kxdbstat st;
+    uint64_t used, maxpages;
+
+    if (kx_db_stat(client.db, &st) == -1)
+        return -1;
+
+    used = st.lastpage + 1;
+    maxpages = st.mapsize / st.psize;
+    printf("Environment\n");
+    printf("  Map usage: %lu of %lu pages (%.1f%%), %lu free for reuse\n",
+           (unsigned long)used, (unsigned long)maxpages,
+           100.0 * used / maxpages, (unsigned long)st.freepages);
+    printf("  Map bytes: %lu, page size %u\n",
+           (unsigned long)st.mapsize, st.psize);
+    printf("  Last transaction ID: %lu\n", (unsigned long)st.lasttxn);
+    printf("  Readers: %u of %u slots used\n", st.readers, st.maxreaders);
+    if (st.bloomcapacity)
+        printf("  Bloom filter: %zu keys of %zu, %s\n", st.bloomkeys,
+               st.bloomcapacity, st.bloomfresh ? "current" : "stale");
+
+    printf("\n %-10s%6s%10s%10s%10s%12s\n",
+           "Database", "Depth", "Branch", "Leaf", "Overflow", "Entries");
+    for (int i = 0; i < st.ndbs; i++) {
+        kxdbtree *t = &st.dbs[i];
+        printf(" %-10s%6u%10lu%10lu%10lu%12lu\n", t->name,
+               t->depth, (unsigned long)t->branchpages,
+               (unsigned long)t->leafpages,
+               (unsigned long)t->overflowpages,
+               (unsigned long)t->entries);
+    }
+
+    if (state->readers) {
+        printf("\nReader Table\n");
+        kx_db_readers(client.db, print_reader, NULL);
+    }
+    return 0;
+}
+
+static int db_prune() {
+    kxdbprune st;
+
+    if (kx_db_prune(client.db, 0, &st) == -1)
+        return -1;
+    printf("Pruned %lu records and %lu fingerprints in %lu transactions, %lld ms\n",
+           (unsigned long)st.files, (unsigned long)st.fingerprints,
+           (unsigned long)st.txns, st.ms);
+    return 0;
+}
+
+int do_db(struct context *ctx) {
+    int ret = -1;
+    int argc = ctx->argc;
+    char **argv = ctx->argv;
+
+    state = init_state();
+    if (state == NULL) {
+        error(0, errno, "failed to initialize state");
+        goto out;
+    }
+
+    ret = parse_options(argc, argv);
+    switch (ret) {
+        case -2: ret = 0;
+        case -1: goto out;
+    }
+    if (client.db == NULL) {
+        fprintf(stderr, "Error catalog unavailable\n");
+        ret = -1;
+        goto out;
+    }
+    if (state->cmd == DB_BACKUP)
+        ret = db_backup();
+    else if (state->cmd == DB_IMPORT)
+        ret = db_import();
+    else if (state->cmd == DB_EXPORT)
+        ret = db_export();
+    else if (state->cmd == DB_STAT)
+        ret = db_stat();
+    else if (state->cmd == DB_PRUNE)
+        ret = db_prune();
+out:
+    free_state();
+    return ret;
+}
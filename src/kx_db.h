@@ -0,0 +1,60 @@
+/*
+ * Copyright 2023-2023 yanruibinghxu
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __KX_DB__
+#define __KX_DB__
+#include "rkx.h"
+
+/* db export --columnar layout. Every column is a little endian array
+ * starting on a KX_COLUMNAR_ALIGN boundary, so the file can be mapped
+ * and a column scanned in place. Row i of a string column is
+ * heap[offsets[i], offsets[i+1]), not NUL terminated. A reader starts
+ * from the footer in the last bytes of the file. */
+#define KX_COLUMNAR_MAGIC   "RKXCOL01"
+#define KX_COLUMNAR_VERSION 1
+#define KX_COLUMNAR_ALIGN   64
+
+#define KX_COL_U64          1   /* uint64_t per row */
+#define KX_COL_U8           2   /* uint8_t per row */
+#define KX_COL_OFFSETS      3   /* uint64_t per row plus one, into the next column */
+#define KX_COL_HEAP         4   /* String bytes */
+
+/* Index entry, the index is an array of ncolumns of them */
+typedef struct kxcolumn {
+    char name[16];          /* uuid, ctime, expires, type, path, fname or
+                             * owner, ".off" appended for the offsets */
+    uint32_t type;          /* KX_COL_* */
+    uint32_t width;         /* Bytes per value, 1 for heaps */
+    uint64_t offset;        /* From the start of the file */
+    uint64_t size;          /* Bytes */
+} kxcolumn;
+
+typedef struct kxcolfooter {
+    uint64_t nrows;
+    uint64_t ncolumns;
+    uint64_t index;         /* Offset of the column index */
+    uint64_t check;         /* XXH3 64 of the index */
+    uint32_t version;
+    uint32_t reserved;
+    char magic[8];          /* KX_COLUMNAR_MAGIC, also the first bytes */
+} kxcolfooter;
+
+int do_db(struct context *ctx);
+
+/** Stop a backup scheduled with db backup --every, waiting for a copy in
+ *  progress to finish. Called before the catalog is closed at exit. */
+void kx_db_backup_stop();
+
+#endif
@@ -23,7 +23,38 @@ struct state {
     bool isdecrypt;
     bool istrace;
     bool isgetlist;
+    bool isverify;
+    bool islocal;           /* file -l --local */
+    int jobs;               /* Files verified concurrently */
     char *file;
+    kxdbquery query;        /* Filters of file -l, point into argv */
+    kxdbiter iter;          /* Unfiltered file -l walk */
+};
+
+#define VERIFY_JOBS     4   /* Default bound on concurrent file reads */
+
+/* Catalog entry handed from the REPL thread to a verify worker */
+struct verifyitem {
+    uint64_t uuid;
+    char fullname[];
+};
+
+/* Catalog records handed from the REPL thread to verify workers */
+struct verifyqueue {
+    pthread_mutex_t lock;
+    pthread_cond_t notempty;
+    pthread_cond_t notfull;
+    struct verifyitem **items;
+    size_t cap;
+    size_t head;
+    size_t count;
+    bool done;
+    unsigned long ok;
+    unsigned long mismatch;
+    unsigned long missing;
+    unsigned long errors;
+    uint64_t *gone;         /* uuids of the missing files, expired after the walk */
+    size_t ngone;
 };
 
 static void kx_filelist_reply(redisReply *reply);
@@ -32,6 +63,16 @@ static void kx_local_cryptfilelist();
 
 static struct state *state = NULL;
 static struct option const long_options[] = {
+    {"path", required_argument, NULL, 'P'},
+    {"user", required_argument, NULL, 'U'},
+    {"since", required_argument, NULL, 'S'},
+    {"until", required_argument, NULL, 'W'},
+    {"prefix", required_argument, NULL, 'X'},
+    {"limit", required_argument, NULL, 'L'},
+    {"page", required_argument, NULL, 'G'},
+    {"local", no_argument, NULL, 'N'},
+    {"verify", no_argument, NULL, 'V'},
+    {"jobs", required_argument, NULL, 'j'},
     {"version", no_argument, NULL, 'v'},
     {"help", no_argument, NULL, 'h'},
     {NULL, no_argument, NULL, 0}
@@ -44,11 +85,47 @@ static void usage() {
                 "  -d,              File decryption .\n"
                 "  -t,              Document traceability .\n"
                 "  -l,              Query file list .\n"
+                "      --path=PATH  with -l, only the file at PATH .\n"
+                "      --user=NAME  with -l, only files encrypted by NAME .\n"
+                "      --since=TIME with -l, encrypted at or after TIME .\n"
+                "      --until=TIME with -l, encrypted at or before TIME .\n"
+                "                   TIME is YYYY-MM-DD or seconds since the epoch .\n"
+                "      --prefix=DIR with -l, only paths under DIR, in path order .\n"
+                "      --limit=N    with -l, print at most N files per page .\n"
+                "      --page=TOKEN with -l, continue from a previous page .\n"
+                "      --local      with -l, files encrypted on this node, newest first .\n"
+                "      --verify     Rehash every catalog file and report changes .\n"
+                "  -j, --jobs=N     Files verified in parallel (default 4) .\n"
                 "      --help       display this help and exit\n"
                 "      --version    output version information and exit\n\n"
                 "Examples:\n"
                 "  file -e filename\n"
-                "  file -d filename\n\n");
+                "  file -d filename\n"
+                "  file -l --since 2024-06-01\n"
+                "  file --verify -j 8\n\n");
+}
+
+/* Accept YYYY-MM-DD (local midnight) or seconds since the epoch */
+static int parse_time(const char *s, uint64_t *t) {
+    struct tm tm;
+    char *end;
+    unsigned long long v;
+
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(s, "%d-%d-%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday) == 3) {
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        tm.tm_isdst = -1;
+        time_t tt = mktime(&tm);
+        if (tt == (time_t)-1) return -1;
+        *t = (uint64_t)tt;
+        return 0;
+    }
+    errno = 0;
+    v = strtoull(s, &end, 10);
+    if (errno || end == s || *end != '\0') return -1;
+    *t = v;
+    return 0;
 }
 
 /**
@@ -67,7 +144,7 @@ parse_options (int argc, char *argv[]) {
 
     optind = 0;
     while (true) {
-        opt = getopt_long(argc, argv, "e:d:t:lhv", long_options, &option_index);
+        opt = getopt_long(argc, argv, "e:d:t:lj:hv", long_options, &option_index);
 
         if (opt == -1) break;
 
@@ -108,7 +185,43 @@ parse_options (int argc, char *argv[]) {
         case 'l':
             state->isgetlist = true;
             ret = 0;
-            goto out;
+            break;
+        case 'P':
+        case 'U':
+            if (opt == 'P') state->query.path = optarg;
+            else state->query.owner = optarg;
+            break;
+        case 'X':
+            state->iter.prefix = optarg;
+            break;
+        case 'G':
+            state->iter.token = optarg;
+            break;
+        case 'N':
+            state->islocal = true;
+            break;
+        case 'L':
+            state->iter.limit = strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+        case 'W':
+            if (parse_time(optarg, opt == 'S' ? &state->query.since 
+                                              : &state->query.until) == -1) {
+                fprintf(stderr, "Invalid time %s\n", optarg);
+                goto err;
+            }
+            break;
+        case 'V':
+            state->isverify = true;
+            ret = 0;
+            break;
+        case 'j':
+            state->jobs = atoi(optarg);
+            if (state->jobs <= 0) {
+                fprintf(stderr, "Invalid number of jobs\n");
+                goto err;
+            }
+            break;
         case 'v':
             printf ("%s (%s) %s\n", argv[0], PACKAGE_VERSION, AUTHORS);
             ret = -2;
@@ -121,6 +234,9 @@ parse_options (int argc, char *argv[]) {
         }
     }
 
+    if (state->isverify || state->isgetlist)
+        goto out;
+
     if ((argc - option_index) < 2) {
         error(0, 0, "missing operand");
         goto err;
@@ -147,7 +263,12 @@ init_state()
     state->isecrypt = false;
     state->istrace = false;
     state->isgetlist = false;
+    state->isverify = false;
+    state->islocal = false;
+    state->jobs = VERIFY_JOBS;
     state->file = NULL;
+    memset(&state->query, 0, sizeof(state->query));
+    memset(&state->iter, 0, sizeof(state->iter));
 out:
     return state;
 }
@@ -172,8 +293,6 @@ static int file_encrypt() {
 
     kf = kx_crypt_file(state->file);
     if (kf) {
-        listAddNodeHead(client.local_cryptfiles, kf);
-
         struct action *ac = kx_search_action(FILE_CRYPT);
         kx_sync_send_cmd(client.net, ac, ac->cmdline, 
                         kf->uuid,
@@ -185,7 +304,14 @@ static int file_encrypt() {
 
         /* Save encrypted file information and make local persistence*/
         snprintf(buf, sizeof(buf), "%s:%lu", client.user->username, kf->uuid);
+        /* Chunk digests are stored along with the record, so later 
+         * checks only rehash damaged ranges */
         kx_store_db(client.db, KX_DB_INSERT_FILE, (void*)buf, (void*)kf);
+        /* Owned by the registry from here, it may be dropped at any time */
+        if (client.local_cryptfiles)
+            kx_registry_put(client.local_cryptfiles, kf);
+        else
+            kx_free_file(kf);
     } else {
         fprintf(stderr, "Error crypt file failed.\n");
         return -1;
@@ -193,6 +319,35 @@ static int file_encrypt() {
     return 0;
 }
 
+/* The file is no longer protected, its record is kept for
+ * KX_DB_RETENTION and then pruned */
+static void expire_file(const char *path) {
+    kxdbquery q;
+    list *files = NULL;
+    listIter li;
+    listNode *ln;
+    uint64_t when = (uint64_t)time(NULL) + KX_DB_RETENTION;
+    kxfile kf;
+
+    if (client.db == NULL) return;
+    /* Files encrypted on this node are found without a catalog query */
+    if (client.local_cryptfiles &&
+        kx_registry_find(client.local_cryptfiles, path, &kf)) {
+        kx_db_expire(client.db, kf.uuid, when);
+        return;
+    }
+    memset(&q, 0, sizeof(q));
+    q.path = path;
+    if (kx_get_db(client.db, KX_DB_QUERY_FILES, &q, (void**)&files) == -1)
+        return;
+    listRewind(files, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        kxfile *kf = listNodeValue(ln);
+        kx_db_expire(client.db, kf->uuid, when);
+    }
+    listRelease(files);
+}
+
 static int file_decrypt() {
     int ret = -1;
 
@@ -208,12 +363,252 @@ static int file_decrypt() {
     } else {
         printf("Decryption of file success\n");
     }
+    expire_file(state->file);
+    if (client.local_cryptfiles)
+        kx_registry_del_path(client.local_cryptfiles, state->file);
     return 0; 
 }
 
+static int print_fileview(const kxfileview *v, void *privdata) {
+    (void)privdata;
+    printf(" [*] %-10.*s%-30.*s%20lu [L+]\n", (int)v->fnamelen, v->fname,
+            (int)v->fullnamelen, v->fullname, v->uuid);
+    return 0;
+}
+
 static int file_getfilelist() {
-    // kx_local_cryptfilelist();
-    kx_get_db(client.db, KX_DB_GET_FILELIST, NULL, NULL);
+    list *files = NULL;
+    listIter li;
+    listNode *ln;
+    kxdbquery *q = &state->query;
+
+    if (state->islocal) {
+        kx_local_cryptfilelist();
+        return 0;
+    }
+    if (client.db == NULL) {
+        fprintf(stderr, "Error catalog unavailable\n");
+        return -1;
+    }
+
+    /* Without filters stream straight from the map, page by page */
+    if (q->path == NULL && q->owner == NULL && q->since == 0 && q->until == 0) {
+        if (kx_db_foreach(client.db, &state->iter, print_fileview, NULL) == -1)
+            return -1;
+        if (state->iter.next[0])
+            printf("More files: file -l --page %s%s%s\n", state->iter.next,
+                    state->iter.prefix ? " --prefix " : "",
+                    state->iter.prefix ? state->iter.prefix : "");
+        return 0;
+    }
+
+    if (kx_get_db(client.db, KX_DB_QUERY_FILES, &state->query, (void**)&files) == -1)
+        return -1;
+
+    listRewind(files, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        kxfile *kf = listNodeValue(ln);
+        printf(" [*] %-10s%-30s%20lu [L+]\n", kf->fname, kf->fullname, kf->uuid);
+    }
+    listRelease(files);
+    return 0;
+}
+
+static void *verify_worker(void *arg) {
+    struct verifyqueue *q = arg;
+    struct verifyitem *kf;
+    int res;
+
+    while (1) {
+        pthread_mutex_lock(&q->lock);
+        while (q->count == 0 && !q->done)
+            pthread_cond_wait(&q->notempty, &q->lock);
+        if (q->count == 0) {
+            pthread_mutex_unlock(&q->lock);
+            break;
+        }
+        kf = q->items[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+        pthread_cond_signal(&q->notfull);
+        pthread_mutex_unlock(&q->lock);
+
+        res = kx_file_verify(kf->fullname, kf->uuid, 1);
+
+        pthread_mutex_lock(&q->lock);
+        switch (res) {
+        case KXVERIFY_OK:
+            q->ok++;
+            break;
+        case KXVERIFY_MISMATCH:
+            q->mismatch++;
+            printf(" [!] %-10s%-64s%20lu\n", "changed", kf->fullname, kf->uuid);
+            break;
+        case KXVERIFY_MISSING:
+            q->missing++;
+            printf(" [!] %-10s%-64s%20lu\n", "missing", kf->fullname, kf->uuid);
+            q->gone = zrealloc(q->gone, sizeof(uint64_t) * (q->ngone + 1));
+            q->gone[q->ngone++] = kf->uuid;
+            if (client.local_cryptfiles)
+                kx_registry_del(client.local_cryptfiles, kf->uuid);
+            break;
+        default:
+            q->errors++;
+            printf(" [!] %-10s%-64s%20lu\n", "error", kf->fullname, kf->uuid);
+            break;
+        }
+        pthread_mutex_unlock(&q->lock);
+        zfree(kf);
+    }
+    return NULL;
+}
+
+/* kx_db_foreach() callback, blocks while every worker is busy */
+static int verify_enqueue(const kxfileview *v, void *privdata) {
+    struct verifyqueue *q = privdata;
+    struct verifyitem *item = zmalloc(sizeof(*item) + v->fullnamelen + 1);
+
+    if (item == NULL) return 1;
+    item->uuid = v->uuid;
+    memcpy(item->fullname, v->fullname, v->fullnamelen);
+    item->fullname[v->fullnamelen] = '\0';
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->cap)
+        pthread_cond_wait(&q->notfull, &q->lock);
+    q->items[(q->head + q->count) % q->cap] = item;
+    q->count++;
+    pthread_cond_signal(&q->notempty);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/* Stream the catalog and rehash every file on a pool of state->jobs
+ * workers. The queue is bounded so no more than that many files are
+ * read, or held in memory, at once whatever the size of the catalog. */
+static int file_verify() {
+    struct verifyqueue q;
+    pthread_t *tids;
+    kxdbiter it;
+    bool failed = false;
+    int i, started = 0;
+
+    if (client.db == NULL) {
+        fprintf(stderr, "Error catalog unavailable\n");
+        return -1;
+    }
+
+    memset(&q, 0, sizeof(q));
+    memset(&it, 0, sizeof(it));
+    q.cap = state->jobs * 2;
+    q.items = zmalloc(sizeof(struct verifyitem*) * q.cap);
+    tids = zmalloc(sizeof(pthread_t) * state->jobs);
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.notempty, NULL);
+    pthread_cond_init(&q.notfull, NULL);
+
+    for (i = 0; i < state->jobs; i++) {
+        if (pthread_create(&tids[i], NULL, verify_worker, &q) != 0)
+            break;
+        started++;
+    }
+    if (started == 0) {
+        fprintf(stderr, "Error unable to start verify workers\n");
+        failed = true;
+        goto out;
+    }
+
+    if (kx_db_foreach(client.db, &it, verify_enqueue, &q) == -1) {
+        fprintf(stderr, "Error catalog walk stopped early\n");
+        failed = true;
+    }
+
+    pthread_mutex_lock(&q.lock);
+    q.done = true;
+    pthread_cond_broadcast(&q.notempty);
+    pthread_mutex_unlock(&q.lock);
+    for (i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+    printf("%lu files checked: %lu ok, %lu changed, %lu missing, %lu errors\n",
+            q.ok + q.mismatch + q.missing + q.errors, q.ok, q.mismatch, q.missing, q.errors);
+
+    /* Records of deleted files are pruned once the retention is over,
+     * not while the walk above still holds its read transaction */
+    for (size_t j = 0; j < q.ngone; j++)
+        kx_db_expire(client.db, q.gone[j], (uint64_t)time(NULL) + KX_DB_RETENTION);
+out:
+    pthread_cond_destroy(&q.notfull);
+    pthread_cond_destroy(&q.notempty);
+    pthread_mutex_destroy(&q.lock);
+    zfree(tids);
+    zfree(q.items);
+    if (q.gone) zfree(q.gone);
+    return (failed || q.mismatch || q.missing || q.errors) ? -1 : 0;
+}
+
+/* File of the current user seen while filling the registry */
+struct localent {
+    uint64_t uuid;
+    uint64_t ctime;
+};
+
+struct localscan {
+    struct localent *ents;
+    size_t n;
+    size_t cap;
+};
+
+static int scan_localfile(const kxfileview *v, void *privdata) {
+    struct localscan *s = privdata;
+
+    if (s->n == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 1024;
+        struct localent *ents = zrealloc(s->ents, cap * sizeof(*ents));
+        if (ents == NULL) return 1;
+        s->ents = ents;
+        s->cap = cap;
+    }
+    s->ents[s->n].uuid = v->uuid;
+    s->ents[s->n].ctime = v->ctime;
+    s->n++;
+    return 0;
+}
+
+static int cmp_newest(const void *a, const void *b) {
+    const struct localent *x = a, *y = b;
+
+    if (x->ctime != y->ctime)
+        return x->ctime > y->ctime ? -1 : 1;
+    return x->uuid > y->uuid ? -1 : x->uuid < y->uuid;
+}
+
+/* A warm start resumes the user with an empty registry. It is filled
+ * from the catalog on the first file command, with the newest files up
+ * to its bound, added oldest first so the newest file of a path wins. */
+static void local_load() {
+    kxregistry *reg = client.local_cryptfiles;
+    struct localscan s = {NULL, 0, 0};
+    kxdbiter it;
+    size_t n;
+
+    client.localload = 0;
+    if (reg == NULL || client.db == NULL) return;
+    memset(&it, 0, sizeof(it));
+    if (kx_db_foreach(client.db, &it, scan_localfile, &s) == -1) goto out;
+
+    qsort(s.ents, s.n, sizeof(*s.ents), cmp_newest);
+    n = s.n < reg->maxfiles ? s.n : reg->maxfiles;
+    while (n-- > 0) {
+        kxfile *kf = NULL;
+
+        if (kx_get_db(client.db, KX_DB_GET_FILE, &s.ents[n].uuid, (void**)&kf) == -1 ||
+            kf == NULL)
+            continue;
+        if (kx_registry_put(reg, kf) == -1) break;
+    }
+out:
+    if (s.ents) zfree(s.ents);
 }
 
 int do_file(struct context *ctx) {
@@ -221,6 +616,9 @@ int do_file(struct context *ctx) {
     int argc = ctx->argc;
     char **argv = ctx->argv;
 
+    if (client.localload)
+        local_load();
+
     state = init_state();
     if (state == NULL) {
         error(0, errno, "failed to initialize state");
@@ -238,6 +636,8 @@ int do_file(struct context *ctx) {
         file_getfilelist();
     else if (state->isdecrypt)
         file_decrypt();
+    else if (state->isverify)
+        file_verify();
 out:
     free_state();
     return ret;
@@ -270,14 +670,16 @@ static void kx_file_reply(redisReply *reply) {
     }
 }
 
+static int print_localfile(const kxfile *kf, void *privdata) {
+    (void)privdata;
+    printf(" [*] %-24s%-64s[L+]\n", kf->fname, kf->fullname);
+    return 0;
+}
+
 static void kx_local_cryptfilelist() {
-    listNode *node, *nextnode;
-
-    node = listFirst(client.local_cryptfiles);
-    while (node) {
-        kxfile *kf = (kxfile *)node->value;
-        printf(" [*] %-24s%-64s[L+]\n", kf->fname, kf->fullname);
-        nextnode = listNextNode(node);
-        node = nextnode;
+    if (client.local_cryptfiles == NULL) {
+        fprintf(stderr, "Error local file list unavailable\n");
+        return;
     }
+    kx_registry_foreach(client.local_cryptfiles, print_localfile, NULL);
 }
\ No newline at end of file
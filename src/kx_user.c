@@ -165,7 +165,8 @@ static void free_state() {
 static int kx_user_register() {
     client.user = kx_creat_user(state->puser, strlen(state->puser), state->ppwd, strlen(state->ppwd));
     client.user->isonline = 1;
-    client.db = kx_creat_db(MAXMAPSIZE, "./data", state->puser);
+    if (client.db)
+        kx_db_set_user(client.db, client.user->username);
     struct action *ac = kx_search_action(USER_REG);
     kx_sync_send_cmd(client.net, ac, ac->cmdline,
                 client.node->uuid,
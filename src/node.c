@@ -140,6 +140,14 @@ kxnode *kx_creat_node(void) {
     return gnode;
 }
 
+kxnode *kx_load_node(const kxnode *saved) {
+    gnode = zmalloc(sizeof(*gnode));
+    if (gnode == NULL) return NULL;
+
+    memcpy(gnode, saved, sizeof(*gnode));
+    return gnode;
+}
+
 kxnode *kx_get_node(void) {
     return gnode;
 }
@@ -48,6 +48,14 @@ typedef struct kxnode {
  */
 kxnode *kx_creat_node(void);
 
+/** Restore machine node information saved by an earlier run,
+ *  without probing the interfaces again
+ * 
+ * @param saved node information to copy
+ * @return return new node infomation, NULL if failed
+ */
+kxnode *kx_load_node(const kxnode *saved);
+
 /** Create machine node information
  * 
  * @return return current node infomation 
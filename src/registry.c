@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2024-2024, yanruibinghxu@gmail.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE     /* pthread_rwlockattr_setkind_np */
+#include "rkx.h"
+#include "registry.h"
+
+#define REG_MINENTRIES  64
+
+static inline uint64_t reg_home(uint64_t key) {
+    return (key * 0x9E3779B97F4A7C15ULL) >> 17;
+}
+
+static uint64_t reg_pathhash(const char *path) {
+    return XXH3_64bits(path, strlen(path));
+}
+
+/* Slots of an entry, 0 when not found */
+static uint32_t slot_find(const kxregistry *reg, const kxregslot *t,
+                          uint64_t key, const char *path) {
+    uint64_t i = reg_home(key) & reg->mask;
+
+    for (; t[i].entry; i = (i + 1) & reg->mask) {
+        if (t[i].key != key) continue;
+        if (path && strcmp(reg->entries[t[i].entry - 1].kf->fullname, path) != 0)
+            continue;
+        return t[i].entry;
+    }
+    return 0;
+}
+
+static void slot_add(kxregistry *reg, kxregslot *t, uint64_t key, uint32_t entry) {
+    uint64_t i = reg_home(key) & reg->mask;
+
+    while (t[i].entry)
+        i = (i + 1) & reg->mask;
+    t[i].key = key;
+    t[i].entry = entry;
+}
+
+/* Linear probing delete, later slots of the run shift back so lookups
+ * never need tombstones */
+static void slot_del(kxregistry *reg, kxregslot *t, uint64_t key, uint32_t entry) {
+    uint64_t i = reg_home(key) & reg->mask;
+    uint64_t j, h;
+
+    while (t[i].entry != entry)
+        i = (i + 1) & reg->mask;
+    j = i;
+    while (1) {
+        t[i].entry = 0;
+        while (1) {
+            j = (j + 1) & reg->mask;
+            if (t[j].entry == 0)
+                return;
+            h = reg_home(t[j].key) & reg->mask;
+            /* Stays put while its home lies cyclically in (i, j] */
+            if (i <= j ? (h <= i || h > j) : (h <= i && h > j))
+                break;
+        }
+        t[i] = t[j];
+        i = j;
+    }
+}
+
+/* Add entries up to maxfiles, the tables are sized for twice as many
+ * and indexed again */
+static int reg_grow(kxregistry *reg) {
+    uint32_t n = reg->nentries ? reg->nentries * 2 : REG_MINENTRIES;
+    uint64_t slots = 1;
+    kxregentry *entries;
+    kxregslot *byuuid, *bypath;
+
+    if (n > reg->maxfiles) n = reg->maxfiles;
+    if (n <= reg->nentries) return -1;
+    while (slots < (uint64_t)n * 2)
+        slots <<= 1;
+    byuuid = zcalloc(slots * sizeof(kxregslot));
+    bypath = zcalloc(slots * sizeof(kxregslot));
+    entries = (byuuid && bypath) ?
+              zrealloc(reg->entries, n * sizeof(kxregentry)) : NULL;
+    if (entries == NULL) {
+        if (byuuid) zfree(byuuid);
+        if (bypath) zfree(bypath);
+        return -1;
+    }
+    memset(entries + reg->nentries, 0, (n - reg->nentries) * sizeof(kxregentry));
+    /* Push the new entries lowest first onto the free list */
+    for (uint32_t e = n; e > reg->nentries; e--) {
+        entries[e - 1].nextfree = reg->freelist;
+        reg->freelist = e;
+    }
+    if (reg->byuuid) zfree(reg->byuuid);
+    if (reg->bypath) zfree(reg->bypath);
+    reg->entries = entries;
+    reg->nentries = n;
+    reg->byuuid = byuuid;
+    reg->bypath = bypath;
+    reg->mask = slots - 1;
+    for (uint32_t e = 0; e < reg->nentries; e++) {
+        if (reg->entries[e].kf == NULL) continue;
+        slot_add(reg, byuuid, reg->entries[e].kf->uuid, e + 1);
+        slot_add(reg, bypath, reg->entries[e].pathhash, e + 1);
+    }
+    return 0;
+}
+
+static void reg_drop(kxregistry *reg, uint32_t entry) {
+    kxregentry *e = &reg->entries[entry - 1];
+
+    slot_del(reg, reg->byuuid, e->kf->uuid, entry);
+    slot_del(reg, reg->bypath, e->pathhash, entry);
+    if (e->newer)
+        reg->entries[e->newer - 1].older = e->older;
+    else
+        reg->newest = e->older;
+    if (e->older)
+        reg->entries[e->older - 1].newer = e->newer;
+    reg->bytes -= e->bytes;
+    reg->count--;
+    kx_free_file(e->kf);
+    e->kf = NULL;
+    e->nextfree = reg->freelist;
+    reg->freelist = entry;
+}
+
+/* Second chance: files looked up since the hand last passed are
+ * spared once */
+static void reg_evict(kxregistry *reg) {
+    kxregentry *e;
+
+    while (1) {
+        e = &reg->entries[reg->hand];
+        reg->hand = (reg->hand + 1) % reg->nentries;
+        if (e->kf == NULL) continue;
+        if (__atomic_load_n(&e->used, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&e->used, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        reg_drop(reg, (uint32_t)(e - reg->entries) + 1);
+        return;
+    }
+}
+
+kxregistry *kx_registry_create(size_t maxfiles, size_t maxbytes) {
+    kxregistry *reg = zcalloc(sizeof(*reg));
+    pthread_rwlockattr_t attr;
+
+    if (reg == NULL) return NULL;
+    if (maxfiles == 0) maxfiles = KX_REGISTRY_MAXFILES;
+    if (maxfiles > UINT32_MAX / 2) maxfiles = UINT32_MAX / 2;
+    reg->maxfiles = maxfiles;
+    reg->maxbytes = maxbytes;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    /* Lookups from busy workers must not keep the REPL from adding */
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&reg->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    if (reg_grow(reg) == -1) {
+        kx_registry_free(reg);
+        return NULL;
+    }
+    return reg;
+}
+
+void kx_registry_free(kxregistry *reg) {
+    if (reg == NULL) return;
+    for (uint32_t e = 0; e < reg->nentries; e++) {
+        if (reg->entries[e].kf)
+            kx_free_file(reg->entries[e].kf);
+    }
+    if (reg->entries) zfree(reg->entries);
+    if (reg->byuuid) zfree(reg->byuuid);
+    if (reg->bypath) zfree(reg->bypath);
+    pthread_rwlock_destroy(&reg->lock);
+    zfree(reg);
+}
+
+int kx_registry_put(kxregistry *reg, kxfile *kf) {
+    uint64_t pathhash = reg_pathhash(kf->fullname);
+    size_t bytes = sizeof(*kf);
+    uint32_t entry;
+    kxregentry *e;
+
+    if (kf->tree)
+        bytes += KXTREE_SIZE(kf->tree->nchunks);
+
+    pthread_rwlock_wrlock(&reg->lock);
+    if ((entry = slot_find(reg, reg->byuuid, kf->uuid, NULL)) != 0)
+        reg_drop(reg, entry);
+    if ((entry = slot_find(reg, reg->bypath, pathhash, kf->fullname)) != 0)
+        reg_drop(reg, entry);
+
+    while (reg->count > 0 && (reg->count >= reg->maxfiles ||
+           (reg->maxbytes && reg->bytes + bytes > reg->maxbytes)))
+        reg_evict(reg);
+    if (reg->freelist == 0 && reg_grow(reg) == -1) {
+        pthread_rwlock_unlock(&reg->lock);
+        kx_free_file(kf);
+        return -1;
+    }
+
+    entry = reg->freelist;
+    e = &reg->entries[entry - 1];
+    reg->freelist = e->nextfree;
+    e->kf = kf;
+    e->pathhash = pathhash;
+    e->bytes = bytes;
+    e->used = 0;
+    e->older = reg->newest;
+    e->newer = 0;
+    if (reg->newest)
+        reg->entries[reg->newest - 1].newer = entry;
+    reg->newest = entry;
+    slot_add(reg, reg->byuuid, kf->uuid, entry);
+    slot_add(reg, reg->bypath, pathhash, entry);
+    reg->count++;
+    reg->bytes += bytes;
+    pthread_rwlock_unlock(&reg->lock);
+    return 0;
+}
+
+/* Copy out under the read lock, the entry may be dropped right after.
+ * The tables are only looked at under the lock, a put may replace them. */
+static int reg_lookup(kxregistry *reg, uint64_t key, const char *path,
+                      kxfile *out) {
+    uint32_t entry;
+    kxregentry *e;
+
+    pthread_rwlock_rdlock(&reg->lock);
+    entry = slot_find(reg, path ? reg->bypath : reg->byuuid, key, path);
+    if (entry) {
+        e = &reg->entries[entry - 1];
+        if (!__atomic_load_n(&e->used, __ATOMIC_RELAXED))
+            __atomic_store_n(&e->used, 1, __ATOMIC_RELAXED);
+        if (out) {
+            memcpy(out, e->kf, sizeof(*out));
+            out->tree = NULL;
+        }
+    }
+    pthread_rwlock_unlock(&reg->lock);
+    return entry != 0;
+}
+
+int kx_registry_get(kxregistry *reg, uint64_t uuid, kxfile *out) {
+    return reg_lookup(reg, uuid, NULL, out);
+}
+
+int kx_registry_find(kxregistry *reg, const char *path, kxfile *out) {
+    return reg_lookup(reg, reg_pathhash(path), path, out);
+}
+
+int kx_registry_del(kxregistry *reg, uint64_t uuid) {
+    uint32_t entry;
+
+    pthread_rwlock_wrlock(&reg->lock);
+    entry = slot_find(reg, reg->byuuid, uuid, NULL);
+    if (entry) reg_drop(reg, entry);
+    pthread_rwlock_unlock(&reg->lock);
+    return entry != 0;
+}
+
+int kx_registry_del_path(kxregistry *reg, const char *path) {
+    uint64_t pathhash = reg_pathhash(path);
+    uint32_t entry;
+
+    pthread_rwlock_wrlock(&reg->lock);
+    entry = slot_find(reg, reg->bypath, pathhash, path);
+    if (entry) reg_drop(reg, entry);
+    pthread_rwlock_unlock(&reg->lock);
+    return entry != 0;
+}
+
+size_t kx_registry_count(kxregistry *reg) {
+    size_t count;
+
+    pthread_rwlock_rdlock(&reg->lock);
+    count = reg->count;
+    pthread_rwlock_unlock(&reg->lock);
+    return count;
+}
+
+int kx_registry_foreach(kxregistry *reg,
+        int (*fn)(const kxfile *kf, void *privdata), void *privdata) {
+    int ret = 0;
+
+    pthread_rwlock_rdlock(&reg->lock);
+    for (uint32_t e = reg->newest; e && ret == 0; e = reg->entries[e - 1].older)
+        ret = fn(reg->entries[e - 1].kf, privdata);
+    pthread_rwlock_unlock(&reg->lock);
+    return ret;
+}
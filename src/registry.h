@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2024-2024, yanruibinghxu@gmail.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __KX_REGISTRY_H__
+#define __KX_REGISTRY_H__
+
+#include "rkxconfig.h"
+
+#define KX_REGISTRY_MAXFILES    4096    /* Default bound on files kept */
+
+struct kxfile;
+
+/* Files encrypted on this node, indexed by uuid and by path in two open
+ * addressing tables. Only one file is kept per path, the newest. Once
+ * the bound on files or bytes is reached the least recently used file
+ * is dropped, approximated with a clock so lookups never write shared
+ * state beyond a flag. Entries are also linked in the order they were
+ * added, for walks newest first. Lookups and walks share a read lock, so
+ * the REPL and worker threads can use the registry at the same time. */
+typedef struct kxregslot {
+    uint64_t key;           /* uuid or path hash */
+    uint32_t entry;         /* Index of the entry plus 1, 0 when empty */
+} kxregslot;
+
+typedef struct kxregentry {
+    struct kxfile *kf;      /* NULL when the entry is free */
+    uint64_t pathhash;
+    size_t bytes;           /* Memory held by kf */
+    uint32_t nextfree;      /* Next free entry plus 1 */
+    uint32_t older;         /* Entry added before this one plus 1, 0 for none */
+    uint32_t newer;         /* Entry added after this one plus 1, 0 for none */
+    unsigned char used;     /* Set by lookups, cleared by the clock hand */
+} kxregentry;
+
+typedef struct kxregistry {
+    pthread_rwlock_t lock;
+    kxregentry *entries;
+    uint32_t nentries;      /* Entries allocated, grows up to maxfiles */
+    uint32_t count;         /* Entries in use */
+    uint32_t freelist;      /* First free entry plus 1 */
+    uint32_t hand;          /* Clock hand */
+    uint32_t newest;        /* Entry added last plus 1 */
+    kxregslot *byuuid;
+    kxregslot *bypath;
+    uint64_t mask;          /* Slots per table minus 1 */
+    size_t maxfiles;
+    size_t maxbytes;        /* 0 when only the file count is bounded */
+    size_t bytes;
+} kxregistry;
+
+/** @brief Create an empty registry
+ * @param maxfiles most files kept, KX_REGISTRY_MAXFILES when 0
+ * @param maxbytes most memory held by the files, 0 for no limit
+ * @return Returns the registry, NULL when out of memory */
+kxregistry *kx_registry_create(size_t maxfiles, size_t maxbytes);
+
+/** @brief Free the registry and every file in it */
+void kx_registry_free(kxregistry *reg);
+
+/** @brief Add a file, replacing any file with the same uuid or path.
+ *         The registry owns kf afterwards and frees it when dropped.
+ * @return Returns 0 on success, -1 when out of memory, kf is freed */
+int kx_registry_put(kxregistry *reg, struct kxfile *kf);
+
+/** @brief Look a file up by uuid
+ * @param out receives a copy of the file without its chunk digests,
+ *            may be NULL to only test for it
+ * @return Returns 1 when found, 0 otherwise */
+int kx_registry_get(kxregistry *reg, uint64_t uuid, struct kxfile *out);
+
+/** @brief Look a file up by its full path, see kx_registry_get() */
+int kx_registry_find(kxregistry *reg, const char *path, struct kxfile *out);
+
+/** @brief Drop the file with this uuid
+ * @return Returns 1 when it was there, 0 otherwise */
+int kx_registry_del(kxregistry *reg, uint64_t uuid);
+
+/** @brief Drop the file at this path, see kx_registry_del() */
+int kx_registry_del_path(kxregistry *reg, const char *path);
+
+/** @brief Number of files in the registry */
+size_t kx_registry_count(kxregistry *reg);
+
+/** @brief Call fn for every file under the read lock, newest first,
+ *         fn must not modify the registry. A non zero return stops the walk.
+ * @return Returns the last value returned by fn */
+int kx_registry_foreach(kxregistry *reg,
+        int (*fn)(const struct kxfile *kf, void *privdata), void *privdata);
+
+#endif
@@ -30,6 +30,7 @@
 #include "linenoise.h"
 #include "kx_user.h"
 #include "kx_file.h"
+#include "kx_db.h"
 #include "kx_command.h"
 
 #define KX_PROMPT   "rkx>"
@@ -40,6 +41,9 @@ struct cmd {
 };
 
 static int g_cbComplete = 0;
+static bool g_cold = false;     /* Ignore the snapshot of the last session */
+static size_t g_localfiles = 0; /* Bound on the local file registry */
+static size_t g_localbytes = 0;
 static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
 struct kxclient client;
@@ -59,6 +63,7 @@ static int shell_usage() {
     printf ("The following commands are supported:\n"
             " * user\n"
             " * file\n"
+            " * db\n"
             " * ls\n"
             " * cd\n"
             " * help\n"
@@ -76,10 +81,117 @@ static int shell_usage() {
 }
 
 
+static struct option const long_options[] = {
+    {"tree-hash", required_argument, NULL, 'T'},
+    {"chunk-size", required_argument, NULL, 'C'},
+    {"group-commit", required_argument, NULL, 'g'},
+    {"group-commit-delay", required_argument, NULL, 'G'},
+    {"durability", required_argument, NULL, 'D'},
+    {"sync-interval", required_argument, NULL, 'S'},
+    {"backend", required_argument, NULL, 'B'},
+    {"cold", no_argument, NULL, 'c'},
+    {"local-files", required_argument, NULL, 'L'},
+    {"local-mb", required_argument, NULL, 'M'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, no_argument, NULL, 0}
+};
+
+static void rkx_help(const char *prog) {
+    printf ("Usage: %s [OPTION]...\n\n"
+            "  -T, --tree-hash=N    tree hash large files with N threads (0 = auto)\n"
+            "  -C, --chunk-size=MB  tree hash chunk size in MB (default 4)\n"
+            "  -g, --group-commit=N commit catalog inserts N at a time (default off)\n"
+            "  -G, --group-commit-delay=MS\n"
+            "                       longest an insert waits for its group (default 2)\n"
+            "  -D, --durability=MODE\n"
+            "                       catalog durability, full (default), meta or async\n"
+            "                       meta may undo the last commit on a crash, async\n"
+            "                       may lose the last sync interval of commits\n"
+            "  -S, --sync-interval=MS\n"
+            "                       how often async mode syncs the catalog (default 1000)\n"
+            "  -B, --backend=NAME   catalog storage, lmdb (default) or memory, which\n"
+            "                       keeps the catalog only while the node runs\n"
+            "  -c, --cold           probe the node again instead of resuming the\n"
+            "                       last session of this boot\n"
+            "  -L, --local-files=N  recently encrypted files kept in memory (default 4096)\n"
+            "  -M, --local-mb=MB    memory they may hold (default no limit)\n"
+            "  -h, --help           display this help and exit\n\n", prog);
+}
+
+/* Process wide settings given on the command line */
+static void parse_options(int argc, char *argv[]) {
+    int opt;
+    int threads = 0;
+    uint64_t chunksize = 0;
+    bool treehash = false;
+
+    while ((opt = getopt_long(argc, argv, "T:C:g:G:D:S:B:cL:M:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'T':
+            treehash = true;
+            threads = atoi(optarg);
+            break;
+        case 'C':
+            chunksize = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'g':
+            client.dbopts.gcrecords = strtoul(optarg, NULL, 10);
+            break;
+        case 'G':
+            client.dbopts.gcdelay = strtoul(optarg, NULL, 10);
+            break;
+        case 'D':
+            if (strcmp(optarg, "full") == 0)
+                client.dbopts.durability = KX_DB_SYNC_FULL;
+            else if (strcmp(optarg, "meta") == 0)
+                client.dbopts.durability = KX_DB_SYNC_META;
+            else if (strcmp(optarg, "async") == 0)
+                client.dbopts.durability = KX_DB_SYNC_ASYNC;
+            else {
+                fprintf(stderr, "Unknown durability mode %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'S':
+            client.dbopts.syncms = strtoul(optarg, NULL, 10);
+            break;
+        case 'B':
+            if (strcmp(optarg, "lmdb") == 0)
+                client.dbopts.backend = KX_DB_BACKEND_LMDB;
+            else if (strcmp(optarg, "memory") == 0)
+                client.dbopts.backend = KX_DB_BACKEND_MEM;
+            else {
+                fprintf(stderr, "Unknown catalog backend %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'c':
+            g_cold = true;
+            break;
+        case 'L':
+            g_localfiles = strtoul(optarg, NULL, 10);
+            break;
+        case 'M':
+            g_localbytes = strtoul(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'h':
+            rkx_help(argv[0]);
+            exit(0);
+        default:
+            rkx_help(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (treehash)
+        kx_file_set_treehash(threads > 0 ? threads : -1, chunksize);
+}
+
 static struct cmd const cmds[] =
 {
     {.name = "user", .execute = do_user},
     {.name = "file", .execute = do_file},
+    {.name = "db", .execute = do_db},
     {.name = "ls", .execute = do_command},
     {.name = "cd", .execute = do_command},
     {.name = "help", .execute = shell_usage}
@@ -258,13 +370,44 @@ static void *kxmq_thread_main(void *arg) {
     }
 }
 
-void rkx_init(struct kxclient *kx) {
-    kx->local_cryptfiles = listCreate();
+int rkx_init(struct kxclient *kx) {
+    kxsnapshot snap;
+    int warm = 0;
+
+    kx->local_cryptfiles = kx_registry_create(g_localfiles, g_localbytes);
     kx->remote_cryptfiles = listCreate();
-    kx->node = kx_creat_node();
+    if (!g_cold && kx_snapshot_load(SNAPPATH, &snap) == 0)
+        kx->node = kx_load_node(&snap.node);
+    else
+        kx->node = NULL;
+    if (kx->node)
+        warm = 1;
+    else
+        kx->node = kx_creat_node();
     kx->user = NULL;
     kx->net = kx_sync_creat_net("127.0.0.1", 6379);
-    kx->db = NULL;
+    /* One environment for the whole process, users only select
+     * their own files in it */
+    kx->db = kx_creat_db(MAXMAPSIZE, DBPATH, DBNAME, &kx->dbopts);
+    if (kx->db && kx->dbopts.gcrecords)
+        kx_db_group_commit_start(kx->db, kx->dbopts.gcrecords, kx->dbopts.gcdelay);
+
+    /* The user key derives from the node and the name, the session
+     * resumes without a password. pwd stays empty, it is only sent
+     * upstream by user -r, which creates the user anew with the one
+     * given. The registry is refilled from the catalog when first used. */
+    kx->localload = 0;
+    if (warm && snap.user[0]) {
+        kx->user = kx_creat_user(snap.user, strlen(snap.user), "", 0);
+        if (kx->user) {
+            kx->user->isonline = 1;
+            if (kx->db) {
+                kx_db_set_user(kx->db, kx->user->username);
+                kx->localload = 1;
+            }
+            printf("Resumed the session of %s\n", kx->user->username);
+        }
+    }
 
     kx->mq = kx_mq_init("127.0.0.1", 1883, "test/topic");
     kx_mq_set_connect_cb(kx->mq, rkx_connect_cb);
@@ -272,14 +415,21 @@ void rkx_init(struct kxclient *kx) {
 	kx_mq_set_message_cb(kx->mq, rkx_message_cb);
 
     pthread_rwlock_init(&kx->rwlock, NULL);
+    /* A backup target or compressor that goes away must fail the
+     * write, not kill the shell */
+    signal(SIGPIPE, SIG_IGN);
+    return warm;
 }
 
 int main(int argc, char *argv[]) {
+    int warm;
+
+    parse_options(argc, argv);
     printf(usage, "127.0.0.1", "Yan RuiBing");
     setlocale(LC_COLLATE,"");
 
     /* init client struct data*/
-    rkx_init(&client);
+    warm = rkx_init(&client);
     /* start MQTT server*/
     if (pthread_create(&client.ptdmq, NULL, &kxmq_thread_main, (void*)client.mq)) {
         char *msg = strerror(errno);
@@ -289,9 +439,10 @@ int main(int argc, char *argv[]) {
 
     /* Wait for the subscription callback to complete before 
      * continuing the main thread execution to prevent 
-     * confusion in printing information. */
+     * confusion in printing information. A warm start
+     * does not hold the prompt back for the broker. */
     pthread_mutex_lock(&g_mutex);
-    while (!g_cbComplete) {
+    while (!g_cbComplete && !warm) {
         pthread_cond_wait(&g_cond, &g_mutex);
     }
     pthread_mutex_unlock(&g_mutex);
@@ -304,6 +455,14 @@ int main(int argc, char *argv[]) {
     gctx->argv = NULL;
     kx_loop();
 
+    /* The scheduler thread must not outlive the catalog */
+    kx_db_backup_stop();
+    kx_snapshot_save(SNAPPATH, client.node,
+                     client.user ? client.user->username : NULL);
+    /* Commits pending writes and saves the catalog filter */
+    if (client.db)
+        kx_free_db(client.db);
+
     kx_free_net(client.net);
     kx_mq_free(client.mq);
     pthread_rwlock_destroy(&client.rwlock);
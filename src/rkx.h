@@ -41,8 +41,13 @@
 #include "aes.h"
 #include "db.h"
 #include "mq.h"
+#include "snapshot.h"
+#include "registry.h"
 
-#define MAXMAPSIZE  (10 * 1024 * 1024)
+#define MAXMAPSIZE  (10 * 1024 * 1024)  /* Initial catalog map, grown on demand */
+#define DBPATH      "./data"            /* Catalog environment, shared by every user */
+#define DBNAME      "files"             /* File records of every user */
+#define SNAPPATH    DBPATH "/rkx.snap"  /* Client state of the last session */
 
 struct kxoption {
     struct kxoption *next;
@@ -65,18 +70,24 @@ struct kxclient {
     kxuser *user;               /* User Info */
     kxsyncnet *net;
     kxdb *db;
+    kxdboptions dbopts;         /* Catalog settings from the command line */
     kxmq *mq;
-    list *local_cryptfiles;     /* Local encrypted files */
+    kxregistry *local_cryptfiles;   /* Local encrypted files, most recent */
+    int localload;              /* Fill local_cryptfiles from the catalog first */
     list *remote_cryptfiles;    /* Encrypt files remotely */
     pthread_t ptdnet;
     pthread_t ptdmq;            /* MQTT server thread id*/
     pthread_rwlock_t rwlock;
 };
 
-/** Initialize client node
+/** Initialize the client. A snapshot of the last session in this boot
+ *  restores the node identity and the user instead of probing them.
  * @note Only called once when the server starts
+ * 
+ * @param kx client object
+ * @return Returns 1 on a warm start from the snapshot, 0 otherwise
  */
-void rkx_init(struct kxclient *kx);
+int rkx_init(struct kxclient *kx);
 
 extern struct kxclient client;
 
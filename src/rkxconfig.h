@@ -41,10 +41,14 @@
 #include <net/if.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <stddef.h>
 #include <limits.h>
 #include <locale.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <getopt.h>
 #include <error.h>
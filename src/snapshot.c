@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2024-2024, yanruibinghxu@gmail.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "rkxconfig.h"
+#include "xxhash.h"
+#include "snapshot.h"
+
+#define SNAPMAGIC   "RKXSNAP"
+#define BOOTID      "/proc/sys/kernel/random/boot_id"
+
+static void get_bootid(char *id, size_t size) {
+    FILE *fp = fopen(BOOTID, "r");
+
+    memset(id, 0, size);
+    if (fp == NULL) return;
+    if (fgets(id, size, fp) != NULL)
+        id[strcspn(id, "\n")] = '\0';
+    fclose(fp);
+}
+
+static uint64_t snap_check(const kxsnapshot *snap) {
+    return XXH3_64bits(snap, offsetof(kxsnapshot, check));
+}
+
+int kx_snapshot_load(const char *path, kxsnapshot *snap) {
+    char bootid[sizeof(snap->bootid)];
+    int fd;
+    ssize_t n;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    n = read(fd, snap, sizeof(*snap));
+    close(fd);
+
+    if (n != sizeof(*snap) || memcmp(snap->magic, SNAPMAGIC, sizeof(SNAPMAGIC)) != 0 ||
+        snap->version != KX_SNAP_VERSION || snap->size != sizeof(*snap) ||
+        snap->check != snap_check(snap))
+        return -1;
+    get_bootid(bootid, sizeof(bootid));
+    if (bootid[0] == '\0' || strcmp(bootid, snap->bootid) != 0)
+        return -1;
+    /* Strings come from disk, they must end inside their fields */
+    snap->node.ip[sizeof(snap->node.ip)-1] = '\0';
+    snap->node.mac[sizeof(snap->node.mac)-1] = '\0';
+    snap->node.uuid[sizeof(snap->node.uuid)-1] = '\0';
+    snap->user[sizeof(snap->user)-1] = '\0';
+    return 0;
+}
+
+int kx_snapshot_save(const char *path, const kxnode *node, const char *user) {
+    char tmp[PATH_MAX];
+    kxsnapshot snap;
+    int fd, ok;
+
+    /* Padding included, the checksum covers every byte */
+    memset(&snap, 0, sizeof(snap));
+    memcpy(snap.magic, SNAPMAGIC, sizeof(SNAPMAGIC));
+    snap.version = KX_SNAP_VERSION;
+    snap.size = sizeof(snap);
+    get_bootid(snap.bootid, sizeof(snap.bootid));
+    memcpy(&snap.node, node, sizeof(snap.node));
+    if (user)
+        strncpy(snap.user, user, sizeof(snap.user)-1);
+    snap.saved = (uint64_t)time(NULL);
+    snap.check = snap_check(&snap);
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd == -1) goto err;
+    ok = write(fd, &snap, sizeof(snap)) == sizeof(snap) && fsync(fd) == 0;
+    if (close(fd) == -1) ok = 0;
+    if (ok && rename(tmp, path) == 0)
+        return 0;
+    unlink(tmp);
+err:
+    fprintf(stderr, "Unable to save the client snapshot %s: %s\n", path, strerror(errno));
+    return -1;
+}
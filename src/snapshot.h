@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2024-2024, yanruibinghxu@gmail.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __KX_SNAPSHOT_H__
+#define __KX_SNAPSHOT_H__
+
+#include "rkxconfig.h"
+#include "node.h"
+
+#define KX_SNAP_VERSION     1
+
+/* Client state kept across restarts, see kx_snapshot_load() */
+typedef struct kxsnapshot {
+    char magic[8];          /* "RKXSNAP" */
+    uint32_t version;       /* KX_SNAP_VERSION */
+    uint32_t size;          /* sizeof(kxsnapshot) */
+    char bootid[40];        /* Boot the node identity was probed in */
+    kxnode node;            /* Node identity */
+    char user[32];          /* User of the last session, "" for none */
+    uint64_t saved;         /* Seconds since the epoch */
+    uint64_t check;         /* XXH3 of the fields above */
+} kxsnapshot;
+
+/** @brief Read the snapshot written by the last session. It is only
+ *         accepted within the boot it was written in, the addresses of
+ *         the node may change across a reboot.
+ * @param[in] path snapshot file
+ * @param[out] snap client state
+ * @return Returns 0 on success, -1 when missing, damaged or stale */
+int kx_snapshot_load(const char *path, kxsnapshot *snap);
+
+/** @brief Write the client state for the next start. The new snapshot
+ *         replaces the old one atomically.
+ * @param[in] path snapshot file
+ * @param[in] node node identity
+ * @param[in] user user of the session, NULL for none
+ * @return Returns 0 on success, -1 otherwise */
+int kx_snapshot_save(const char *path, const kxnode *node, const char *user);
+
+#endif
@@ -33,7 +33,7 @@
 
 typedef struct kxuser {
     char username[32];  // user name
-    char pwd[32];       // password
+    char pwd[32];       // password, empty for a session resumed from a snapshot
     char trustid[37];   // trust id
     int isonline;       // Is the user online sign? 1 online 0: offline
     kxnode *node;       // User associated node
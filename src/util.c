@@ -33,6 +33,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/time.h>
 #include "util.h"
 #include "zmalloc.h"
 
@@ -102,4 +104,21 @@ fail:
     zfree(pathname);
     zfree(parent);
     return -1;
-}
\ No newline at end of file
+}
+
+long long kx_mstime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+}
+
+void kx_deadline(struct timespec *ts, long long ms) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
@@ -29,10 +29,21 @@
 #ifndef __KX_UTIL_H__
 #define __KX_UTIL_H__
 
+#include <time.h>
+
 /** @brief Create multi-level directories
  * @param pathname pathname of create a directory
  * @param mode The argument mode specifies the mode for the new directory (see inode(7))
  * @return Returns 0 on success, otherwise returns -1 */
 int kx_mkdirp(const char *path, unsigned int mode);
 
+/** @brief Wall clock time in milliseconds */
+long long kx_mstime(void);
+
+/** @brief Absolute CLOCK_REALTIME deadline ms milliseconds from now,
+ *         for pthread_cond_timedwait()
+ * @param ts output deadline
+ * @param ms delay in milliseconds */
+void kx_deadline(struct timespec *ts, long long ms);
+
 #endif
\ No newline at end of file
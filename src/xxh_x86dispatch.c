@@ -0,0 +1,303 @@
+/*
+ * xxHash - Extremely Fast Hash algorithm
+ * Copyright (C) 2012-2023 Yann Collet
+ *
+ * BSD 2-Clause License (https://www.opensource.org/licenses/bsd-license.php)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * You can contact the author at:
+ *   - xxHash homepage: https://www.xxhash.com
+ *   - xxHash source repository: https://github.com/Cyan4973/xxHash
+ */
+
+/*
+ * Dispatcher code for XXH3 on x86-based targets, modeled on the
+ * xxh_x86dispatch.c unit shipped with xxHash.
+ *
+ * xxhash.c is built for the baseline ISA of the toolchain, which on a
+ * generic x86-64 build means SSE2. This unit compiles the long-input
+ * loops once per vector extension with function level target attributes,
+ * then selects the widest one supported by the running CPU (and enabled
+ * by the OS through XCR0) the first time a hash is requested.
+ */
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_IX86) || defined(_M_X64)
+
+#if !defined(__GNUC__)
+#  error "Dispatching requires GCC or clang target attributes."
+#endif
+
+#ifndef XXH_DISPATCH_AVX2
+#  define XXH_DISPATCH_AVX2 1
+#endif
+#ifndef XXH_DISPATCH_AVX512
+#  define XXH_DISPATCH_AVX512 1
+#endif
+
+#define XXH_TARGET_SSE2   __attribute__((__target__("sse2")))
+#define XXH_TARGET_AVX2   __attribute__((__target__("avx2")))
+#define XXH_TARGET_AVX512 __attribute__((__target__("avx512f")))
+
+#include <immintrin.h>
+#include <cpuid.h>
+
+/* Private copy of xxhash: the public entry points below keep the ABI of
+ * the prototypes in xxh_x86dispatch.h, which is not included here since
+ * XXH_INLINE_ALL renames the xxhash types. */
+#define XXH_INLINE_ALL
+#define XXH_X86DISPATCH
+#include "xxhash.h"
+
+/* CPUID and XCR0 bits we care about */
+#define XXH_SSE2_CPUID_MASK     (1 << 26)   /* leaf 1, edx */
+#define XXH_OSXSAVE_CPUID_MASK  ((1 << 26) | (1 << 27)) /* leaf 1, ecx */
+#define XXH_AVX2_CPUID_MASK     (1 << 5)    /* leaf 7, ebx */
+#define XXH_AVX512F_CPUID_MASK  (1 << 16)   /* leaf 7, ebx */
+#define XXH_AVX2_XGETBV_MASK    ((1 << 2) | (1 << 1))
+#define XXH_AVX512F_XGETBV_MASK ((7 << 5) | (1 << 2) | (1 << 1))
+
+enum { XXH_SCALAR_ID = 0, XXH_SSE2_ID, XXH_AVX2_ID, XXH_AVX512_ID, XXH_NB_DISPATCH };
+
+static const char *const XXH_dispatchNames[XXH_NB_DISPATCH] = {
+    "scalar", "sse2", "avx2", "avx512"
+};
+
+static xxh_u64 XXH_xgetbv(void)
+{
+    xxh_u32 eax, edx;
+    __asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+    return ((xxh_u64)edx << 32) | eax;
+}
+
+/* Returns the best vector extension usable on this CPU and OS. */
+static int XXH_featureTest(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    int best = XXH_SCALAR_ID;
+    xxh_u64 xgetbv;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return best;
+    if (edx & XXH_SSE2_CPUID_MASK)
+        best = XXH_SSE2_ID;
+    /* AVX state must be saved by the OS before it can be used */
+    if ((ecx & XXH_OSXSAVE_CPUID_MASK) != XXH_OSXSAVE_CPUID_MASK)
+        return best;
+    xgetbv = XXH_xgetbv();
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return best;
+#if XXH_DISPATCH_AVX2
+    if ((ebx & XXH_AVX2_CPUID_MASK)
+        && (xgetbv & XXH_AVX2_XGETBV_MASK) == XXH_AVX2_XGETBV_MASK)
+        best = XXH_AVX2_ID;
+#endif
+#if XXH_DISPATCH_AVX512
+    if ((ebx & XXH_AVX512F_CPUID_MASK)
+        && (xgetbv & XXH_AVX512F_XGETBV_MASK) == XXH_AVX512F_XGETBV_MASK)
+        best = XXH_AVX512_ID;
+#endif
+    return best;
+}
+
+/*
+ * One set of long-input routines per vector extension. The small-input
+ * paths do not benefit from SIMD and are shared.
+ */
+#define XXH_DEFINE_DISPATCH_FUNCS(suffix, target)                            \
+                                                                             \
+XXH_NO_INLINE target XXH64_hash_t                                            \
+XXHL64_default_##suffix(const void* XXH_RESTRICT input, size_t len)          \
+{                                                                            \
+    return XXH3_hashLong_64b_internal(                                       \
+               input, len, XXH3_kSecret, sizeof(XXH3_kSecret),               \
+               XXH3_accumulate_##suffix, XXH3_scrambleAcc_##suffix);         \
+}                                                                            \
+                                                                             \
+XXH_NO_INLINE target XXH64_hash_t                                            \
+XXHL64_seed_##suffix(const void* XXH_RESTRICT input, size_t len,             \
+                     XXH64_hash_t seed)                                      \
+{                                                                            \
+    return XXH3_hashLong_64b_withSeed_internal(                              \
+               input, len, seed, XXH3_accumulate_##suffix,                   \
+               XXH3_scrambleAcc_##suffix, XXH3_initCustomSecret_##suffix);   \
+}                                                                            \
+                                                                             \
+XXH_NO_INLINE target XXH_errorcode                                           \
+XXH3_update_##suffix(XXH3_state_t* state, const void* input, size_t len)     \
+{                                                                            \
+    return XXH3_update(state, (const xxh_u8*)input, len,                     \
+                       XXH3_accumulate_##suffix, XXH3_scrambleAcc_##suffix); \
+}                                                                            \
+                                                                             \
+XXH_NO_INLINE target XXH128_hash_t                                           \
+XXHL128_default_##suffix(const void* XXH_RESTRICT input, size_t len)         \
+{                                                                            \
+    return XXH3_hashLong_128b_internal(                                      \
+               input, len, XXH3_kSecret, sizeof(XXH3_kSecret),               \
+               XXH3_accumulate_##suffix, XXH3_scrambleAcc_##suffix);         \
+}                                                                            \
+                                                                             \
+XXH_NO_INLINE target XXH128_hash_t                                           \
+XXHL128_seed_##suffix(const void* XXH_RESTRICT input, size_t len,            \
+                      XXH64_hash_t seed)                                     \
+{                                                                            \
+    return XXH3_hashLong_128b_withSeed_internal(                             \
+               input, len, seed, XXH3_accumulate_##suffix,                   \
+               XXH3_scrambleAcc_##suffix, XXH3_initCustomSecret_##suffix);   \
+}
+
+XXH_DEFINE_DISPATCH_FUNCS(scalar, /* nothing */)
+XXH_DEFINE_DISPATCH_FUNCS(sse2, XXH_TARGET_SSE2)
+#if XXH_DISPATCH_AVX2
+XXH_DEFINE_DISPATCH_FUNCS(avx2, XXH_TARGET_AVX2)
+#endif
+#if XXH_DISPATCH_AVX512
+XXH_DEFINE_DISPATCH_FUNCS(avx512, XXH_TARGET_AVX512)
+#endif
+
+#undef XXH_DEFINE_DISPATCH_FUNCS
+
+typedef XXH64_hash_t (*XXH3_dispatchx86_hashLong64_default)(const void* XXH_RESTRICT, size_t);
+typedef XXH64_hash_t (*XXH3_dispatchx86_hashLong64_seed)(const void* XXH_RESTRICT, size_t, XXH64_hash_t);
+typedef XXH128_hash_t (*XXH3_dispatchx86_hashLong128_default)(const void* XXH_RESTRICT, size_t);
+typedef XXH128_hash_t (*XXH3_dispatchx86_hashLong128_seed)(const void* XXH_RESTRICT, size_t, XXH64_hash_t);
+typedef XXH_errorcode (*XXH3_dispatchx86_update)(XXH3_state_t*, const void*, size_t);
+
+typedef struct {
+    XXH3_dispatchx86_hashLong64_default  hashLong64_default;
+    XXH3_dispatchx86_hashLong64_seed     hashLong64_seed;
+    XXH3_dispatchx86_hashLong128_default hashLong128_default;
+    XXH3_dispatchx86_hashLong128_seed    hashLong128_seed;
+    XXH3_dispatchx86_update              update;
+} XXH_dispatchFunctions_s;
+
+static const XXH_dispatchFunctions_s XXH_kDispatch[XXH_NB_DISPATCH] = {
+    /* Scalar */ { XXHL64_default_scalar, XXHL64_seed_scalar,
+                   XXHL128_default_scalar, XXHL128_seed_scalar, XXH3_update_scalar },
+    /* SSE2   */ { XXHL64_default_sse2, XXHL64_seed_sse2,
+                   XXHL128_default_sse2, XXHL128_seed_sse2, XXH3_update_sse2 },
+#if XXH_DISPATCH_AVX2
+    /* AVX2   */ { XXHL64_default_avx2, XXHL64_seed_avx2,
+                   XXHL128_default_avx2, XXHL128_seed_avx2, XXH3_update_avx2 },
+#else
+    /* AVX2   */ { NULL, NULL, NULL, NULL, NULL },
+#endif
+#if XXH_DISPATCH_AVX512
+    /* AVX512 */ { XXHL64_default_avx512, XXHL64_seed_avx512,
+                   XXHL128_default_avx512, XXHL128_seed_avx512, XXH3_update_avx512 },
+#else
+    /* AVX512 */ { NULL, NULL, NULL, NULL, NULL },
+#endif
+};
+
+/* Written once; every thread computes the same selection, so a racy
+ * first call only repeats the detection. */
+static const XXH_dispatchFunctions_s *XXH_g_dispatch = NULL;
+
+static const XXH_dispatchFunctions_s *XXH_setDispatch(void)
+{
+    const XXH_dispatchFunctions_s *d = __atomic_load_n(&XXH_g_dispatch, __ATOMIC_ACQUIRE);
+
+    if (d == NULL) {
+        d = &XXH_kDispatch[XXH_featureTest()];
+        __atomic_store_n(&XXH_g_dispatch, d, __ATOMIC_RELEASE);
+    }
+    return d;
+}
+
+/* Adapters matching the hashLong signatures expected by xxhash.h */
+static XXH64_hash_t
+XXH3_hashLong_64b_defaultSecret_selection(const void* XXH_RESTRICT input, size_t len,
+                                          XXH64_hash_t seed64, const xxh_u8* XXH_RESTRICT secret, size_t secretLen)
+{
+    (void)seed64; (void)secret; (void)secretLen;
+    return XXH_setDispatch()->hashLong64_default(input, len);
+}
+
+static XXH64_hash_t
+XXH3_hashLong_64b_withSeed_selection(const void* XXH_RESTRICT input, size_t len,
+                                     XXH64_hash_t seed64, const xxh_u8* XXH_RESTRICT secret, size_t secretLen)
+{
+    (void)secret; (void)secretLen;
+    return XXH_setDispatch()->hashLong64_seed(input, len, seed64);
+}
+
+static XXH128_hash_t
+XXH3_hashLong_128b_defaultSecret_selection(const void* XXH_RESTRICT input, size_t len,
+                                           XXH64_hash_t seed64, const void* XXH_RESTRICT secret, size_t secretLen)
+{
+    (void)seed64; (void)secret; (void)secretLen;
+    return XXH_setDispatch()->hashLong128_default(input, len);
+}
+
+static XXH128_hash_t
+XXH3_hashLong_128b_withSeed_selection(const void* XXH_RESTRICT input, size_t len,
+                                      XXH64_hash_t seed64, const void* XXH_RESTRICT secret, size_t secretLen)
+{
+    (void)secret; (void)secretLen;
+    return XXH_setDispatch()->hashLong128_seed(input, len, seed64);
+}
+
+XXH64_hash_t XXH3_64bits_dispatch(const void* input, size_t len)
+{
+    return XXH3_64bits_internal(input, len, 0, XXH3_kSecret, sizeof(XXH3_kSecret),
+                                XXH3_hashLong_64b_defaultSecret_selection);
+}
+
+XXH64_hash_t XXH3_64bits_withSeed_dispatch(const void* input, size_t len, XXH64_hash_t seed)
+{
+    return XXH3_64bits_internal(input, len, seed, XXH3_kSecret, sizeof(XXH3_kSecret),
+                                XXH3_hashLong_64b_withSeed_selection);
+}
+
+XXH_errorcode XXH3_64bits_update_dispatch(XXH3_state_t* state, const void* input, size_t len)
+{
+    return XXH_setDispatch()->update(state, input, len);
+}
+
+XXH128_hash_t XXH3_128bits_dispatch(const void* input, size_t len)
+{
+    return XXH3_128bits_internal(input, len, 0, XXH3_kSecret, sizeof(XXH3_kSecret),
+                                 XXH3_hashLong_128b_defaultSecret_selection);
+}
+
+XXH128_hash_t XXH3_128bits_withSeed_dispatch(const void* input, size_t len, XXH64_hash_t seed)
+{
+    return XXH3_128bits_internal(input, len, seed, XXH3_kSecret, sizeof(XXH3_kSecret),
+                                 XXH3_hashLong_128b_withSeed_selection);
+}
+
+XXH_errorcode XXH3_128bits_update_dispatch(XXH3_state_t* state, const void* input, size_t len)
+{
+    /* XXH3_update is shared by the 64 and 128 bit streaming states */
+    return XXH_setDispatch()->update(state, input, len);
+}
+
+const char *XXH_dispatchName(void)
+{
+    return XXH_dispatchNames[XXH_setDispatch() - XXH_kDispatch];
+}
+
+#endif /* x86 */
@@ -0,0 +1,87 @@
+/*
+ * xxHash - Extremely Fast Hash algorithm
+ * Copyright (C) 2012-2023 Yann Collet
+ *
+ * BSD 2-Clause License (https://www.opensource.org/licenses/bsd-license.php)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * You can contact the author at:
+ *   - xxHash homepage: https://www.xxhash.com
+ *   - xxHash source repository: https://github.com/Cyan4973/xxHash
+ */
+
+/*
+ * Runtime CPU dispatch for the XXH3 long-input loops, modeled on the
+ * xxh_x86dispatch unit shipped with xxHash. One binary carries scalar,
+ * SSE2, AVX2 and AVX-512 variants and picks the widest one the host CPU
+ * and OS support on first use.
+ */
+#ifndef XXH_X86DISPATCH_H_13563687684
+#define XXH_X86DISPATCH_H_13563687684
+
+#include "xxhash.h"  /* XXH64_hash_t, XXH3_state_t */
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_IX86) || defined(_M_X64)
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+
+XXH64_hash_t  XXH3_64bits_dispatch(const void* input, size_t len);
+XXH64_hash_t  XXH3_64bits_withSeed_dispatch(const void* input, size_t len, XXH64_hash_t seed);
+XXH_errorcode XXH3_64bits_update_dispatch(XXH3_state_t* state, const void* input, size_t len);
+
+XXH128_hash_t XXH3_128bits_dispatch(const void* input, size_t len);
+XXH128_hash_t XXH3_128bits_withSeed_dispatch(const void* input, size_t len, XXH64_hash_t seed);
+XXH_errorcode XXH3_128bits_update_dispatch(XXH3_state_t* state, const void* input, size_t len);
+
+/* Name of the vector unit selected at runtime: "scalar", "sse2", "avx2"
+ * or "avx512". */
+const char *XXH_dispatchName(void);
+
+#if defined (__cplusplus)
+}
+#endif
+
+/* Automatic replacement of the XXH3 entry points, can be disabled by
+ * defining XXH_DISPATCH_DISABLE_REPLACE before including this header. */
+#ifndef XXH_DISPATCH_DISABLE_REPLACE
+#  undef  XXH3_64bits
+#  define XXH3_64bits XXH3_64bits_dispatch
+#  undef  XXH3_64bits_withSeed
+#  define XXH3_64bits_withSeed XXH3_64bits_withSeed_dispatch
+#  undef  XXH3_64bits_update
+#  define XXH3_64bits_update XXH3_64bits_update_dispatch
+#  undef  XXH3_128bits
+#  define XXH3_128bits XXH3_128bits_dispatch
+#  undef  XXH3_128bits_withSeed
+#  define XXH3_128bits_withSeed XXH3_128bits_withSeed_dispatch
+#  undef  XXH3_128bits_update
+#  define XXH3_128bits_update XXH3_128bits_update_dispatch
+#endif
+
+#endif /* x86 */
+
+#endif /* XXH_X86DISPATCH_H_13563687684 */
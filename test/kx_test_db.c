@@ -0,0 +1,210 @@
+/*
+ * Catalog tests against the memory backend: record encoding, page
+ * tokens, registry eviction and import of repeated records.
+ */
+#include "rkx.h"
+#include "db.h"
+#include "file.h"
+#include "registry.h"
+#include "zmalloc.h"
+
+struct kxclient client;
+
+static int failures = 0;
+
+#define CHECK(cond) do {                                            \
+    if (!(cond)) {                                                  \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++;                                                 \
+    }                                                               \
+} while (0)
+
+static void fill_file(kxfile *kf, uint64_t uuid, const char *path, const char *owner) {
+    const char *name = strrchr(path, '/');
+
+    memset(kf, 0, sizeof(*kf));
+    kf->uuid = uuid;
+    kf->type = KXCIPHER;
+    strncpy(kf->fullname, path, sizeof(kf->fullname)-1);
+    strncpy(kf->fname, name ? name + 1 : path, sizeof(kf->fname)-1);
+    strncpy(kf->owner, owner, sizeof(kf->owner)-1);
+    kf->ctime = 1700000000 + uuid;
+}
+
+static void test_encode(void) {
+    unsigned char rec[KX_DB_RECMAX];
+    unsigned char buf[KX_DB_TOKEN_LEN / 2];
+    char token[KX_DB_TOKEN_LEN];
+    kxfile in, out;
+    kxfileview view;
+    size_t len, klen;
+
+    fill_file(&in, 0x1122334455667788ULL, "/home/alice/docs/report.pdf", "alice");
+    in.expires = 1800000000;
+    len = kx_db_encode_file(&in, 0, 0, rec);
+    CHECK(len > 0 && len <= KX_DB_RECMAX);
+
+    CHECK(kx_db_decode_file(&in.uuid, sizeof(in.uuid), rec, len, &out) == 0);
+    CHECK(out.uuid == in.uuid);
+    CHECK(out.type == in.type);
+    CHECK(out.ctime == in.ctime);
+    CHECK(out.expires == in.expires);
+    CHECK(strcmp(out.fullname, in.fullname) == 0);
+    CHECK(strcmp(out.fname, in.fname) == 0);
+    CHECK(strcmp(out.owner, in.owner) == 0);
+
+    CHECK(kx_db_view_file(&in.uuid, sizeof(in.uuid), rec, len, &view) == 0);
+    CHECK(view.fullnamelen == strlen(in.fullname) &&
+          memcmp(view.fullname, in.fullname, view.fullnamelen) == 0);
+    CHECK(view.dirid == 0);
+
+    /* A truncated record is reported, not decoded */
+    CHECK(kx_db_decode_file(&in.uuid, sizeof(in.uuid), rec, len / 2, &out) == -1);
+
+    kx_db_token_encode(token, 'p', in.fullname, strlen(in.fullname));
+    CHECK(kx_db_token_decode(token, 'p', buf, &klen) == 0);
+    CHECK(klen == strlen(in.fullname) && memcmp(buf, in.fullname, klen) == 0);
+    CHECK(kx_db_token_decode(token, 'u', buf, &klen) == -1);
+}
+
+static kxfile *new_file(uint64_t uuid, const char *path) {
+    kxfile *kf = zmalloc(sizeof(*kf));
+
+    fill_file(kf, uuid, path, "alice");
+    return kf;
+}
+
+static int collect(const kxfile *kf, void *privdata) {
+    uint64_t **next = privdata;
+
+    *(*next)++ = kf->uuid;
+    return 0;
+}
+
+static void test_registry(void) {
+    kxregistry *reg = kx_registry_create(4, 0);
+    uint64_t order[4], *next = order;
+    kxfile kf;
+
+    CHECK(reg != NULL);
+    if (reg == NULL) return;
+    CHECK(kx_registry_put(reg, new_file(1, "/r/1")) == 0);
+    CHECK(kx_registry_put(reg, new_file(2, "/r/2")) == 0);
+    CHECK(kx_registry_put(reg, new_file(3, "/r/3")) == 0);
+    CHECK(kx_registry_put(reg, new_file(4, "/r/4")) == 0);
+
+    /* The clock spares the file looked up since it last passed */
+    CHECK(kx_registry_get(reg, 1, NULL) == 1);
+    CHECK(kx_registry_put(reg, new_file(5, "/r/5")) == 0);
+    CHECK(kx_registry_count(reg) == 4);
+    CHECK(kx_registry_get(reg, 1, NULL) == 1);
+    CHECK(kx_registry_get(reg, 2, NULL) == 0);
+    CHECK(kx_registry_get(reg, 5, NULL) == 1);
+
+    /* One file per path, the newest */
+    CHECK(kx_registry_put(reg, new_file(6, "/r/5")) == 0);
+    CHECK(kx_registry_get(reg, 5, NULL) == 0);
+    CHECK(kx_registry_find(reg, "/r/5", &kf) == 1 && kf.uuid == 6);
+    CHECK(kx_registry_count(reg) == 4);
+
+    kx_registry_foreach(reg, collect, &next);
+    CHECK(next == order + 4);
+    CHECK(order[0] == 6 && order[1] == 4 && order[2] == 3 && order[3] == 1);
+    kx_registry_free(reg);
+}
+
+/* Import input: uuid 3 is repeated, /i/a is repeated under two uuids */
+static const struct {
+    uint64_t uuid;
+    const char *path;
+} input[] = {
+    {3, "/i/old3"}, {1, "/i/a"}, {7, "/i/b"}, {3, "/i/new3"}, {2, "/i/a"},
+};
+
+static int source(kxfile *kf, void *privdata) {
+    size_t *pos = privdata;
+
+    if (*pos == sizeof(input) / sizeof(input[0])) return 0;
+    fill_file(kf, input[*pos].uuid, input[*pos].path, "alice");
+    (*pos)++;
+    return 1;
+}
+
+static uint64_t path_uuid(kxdb *db, const char *path) {
+    kxdbquery q;
+    list *files = NULL;
+    uint64_t uuid = 0;
+
+    memset(&q, 0, sizeof(q));
+    q.path = path;
+    q.owner = "alice";
+    if (kx_get_db(db, KX_DB_QUERY_FILES, &q, (void**)&files) == 0 && files) {
+        if (listLength(files) == 1)
+            uuid = ((kxfile *)listNodeValue(listFirst(files)))->uuid;
+        listRelease(files);
+    }
+    return uuid;
+}
+
+static void test_import(void) {
+    kxdboptions opts;
+    kxdbimport st;
+    kxfile kf, *got = NULL;
+    kxtree *tree;
+    uint64_t uuid = 3;
+    size_t pos = 0;
+    kxdb *db;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.backend = KX_DB_BACKEND_MEM;
+    db = kx_creat_db(0, "/tmp", "files", &opts);
+    CHECK(db != NULL);
+    if (db == NULL) return;
+
+    fill_file(&kf, 9, "/i/kept", "alice");
+    CHECK(kx_store_db(db, KX_DB_INSERT_FILE, NULL, &kf) == 0);
+
+    CHECK(kx_db_import(db, source, &pos, 0, &st) == 0);
+    CHECK(st.records == 5);
+    CHECK(st.duplicates == 1);
+    CHECK(st.loaded == 4);
+
+    /* The last record of a repeated uuid or path wins */
+    CHECK(kx_get_db(db, KX_DB_GET_FILE, &uuid, (void**)&got) == 0 && got);
+    if (got) {
+        CHECK(strcmp(got->fullname, "/i/new3") == 0);
+        kx_free_file(got);
+    }
+    CHECK(path_uuid(db, "/i/a") == 2);
+    CHECK(path_uuid(db, "/i/kept") == 9);
+
+    /* A replacing import drops what was there, digests included */
+    tree = zcalloc(KXTREE_SIZE(1));
+    tree->chunksize = 4096;
+    tree->nchunks = 1;
+    CHECK(kx_store_db(db, KX_DB_INSERT_DIGESTS, &uuid, tree) == 0);
+    zfree(tree);
+    tree = NULL;
+    pos = 0;
+    CHECK(kx_db_import(db, source, &pos, 1, &st) == 0);
+    CHECK(path_uuid(db, "/i/kept") == 0);
+    CHECK(path_uuid(db, "/i/a") == 2);
+    kx_get_db(db, KX_DB_GET_DIGESTS, &uuid, (void**)&tree);
+    CHECK(tree == NULL);
+    if (tree) zfree(tree);
+
+    kx_free_db(db);
+}
+
+int main(void) {
+    test_encode();
+    test_registry();
+    test_import();
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("All catalog tests passed\n");
+    return EXIT_SUCCESS;
+}